@@ -1,51 +1,167 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "chunk.h"
 #include "line.h"
 #include "memory.h"
 #include "value.h"
 
+static void freeDecoded(DecodedChunk *decoded);
+
+// Static description of every opcode, indexed by OpCode.
+static const OpInfo opInfos[__OP_COUNT] = {
+    [OP_ADD] = {"OP_ADD", OPERAND_NONE, 2, 1},
+    [OP_ARRAY] = {"OP_ARRAY", OPERAND_ARG_COUNT, 0, 1},
+    [OP_ARRAY_POP] = {"OP_ARRAY_POP", OPERAND_NONE, 1, 1},
+    [OP_ARRAY_PUSH] = {"OP_ARRAY_PUSH", OPERAND_NONE, 2, 1},
+    [OP_BITWISE_AND] = {"OP_BITWISE_AND", OPERAND_NONE, 2, 1},
+    [OP_BITWISE_NOT] = {"OP_BITWISE_NOT", OPERAND_NONE, 1, 1},
+    [OP_BITWISE_OR] = {"OP_BITWISE_OR", OPERAND_NONE, 2, 1},
+    [OP_BITWISE_SHIFT_LEFT] = {"OP_BITWISE_SHIFT_LEFT", OPERAND_NONE, 2, 1},
+    [OP_BITWISE_SHIFT_RIGHT] = {"OP_BITWISE_SHIFT_RIGHT", OPERAND_NONE, 2, 1},
+    [OP_BITWISE_XOR] = {"OP_BITWISE_XOR", OPERAND_NONE, 2, 1},
+    [OP_CALL] = {"OP_CALL", OPERAND_ARG_COUNT, 1, 1},
+    [OP_CLASS] = {"OP_CLASS", OPERAND_CONSTANT, 0, 1},
+    [OP_CLOSE_UPVALUE] = {"OP_CLOSE_UPVALUE", OPERAND_NONE, 1, 0},
+    [OP_CLOSURE] = {"OP_CLOSURE", OPERAND_CONSTANT, 0, 1},
+    [OP_CONSTANT] = {"OP_CONSTANT", OPERAND_CONSTANT, 0, 1},
+    [OP_DECREMENT] = {"OP_DECREMENT", OPERAND_NONE, 1, 1},
+    [OP_DEFINE_GLOBAL] = {"OP_DEFINE_GLOBAL", OPERAND_CONSTANT, 1, 0},
+    [OP_DIVIDE] = {"OP_DIVIDE", OPERAND_NONE, 2, 1},
+    [OP_EQUAL] = {"OP_EQUAL", OPERAND_NONE, 2, 1},
+    [OP_FALSE] = {"OP_FALSE", OPERAND_NONE, 0, 1},
+    [OP_FLOOR] = {"OP_FLOOR", OPERAND_NONE, 1, 1},
+    [OP_FOR_EACH] = {"OP_FOR_EACH", OPERAND_SLOT_JUMP, 0, 0},
+    [OP_FOR_RANGE] = {"OP_FOR_RANGE", OPERAND_SLOT_LOOP, 0, 0},
+    [OP_FOR_RANGE_INIT] = {"OP_FOR_RANGE_INIT", OPERAND_SLOT_JUMP, 0, 0},
+    [OP_GET_CONST_UPVALUE] = {"OP_GET_CONST_UPVALUE", OPERAND_UPVALUE, 0, 1},
+    [OP_GET_GLOBAL] = {"OP_GET_GLOBAL", OPERAND_CONSTANT, 0, 1},
+    [OP_GET_LOCAL] = {"OP_GET_LOCAL", OPERAND_SLOT, 0, 1},
+    [OP_GET_PROPERTY] = {"OP_GET_PROPERTY", OPERAND_PROPERTY, 1, 1},
+    [OP_GET_SUPER] = {"OP_GET_SUPER", OPERAND_CONSTANT, 2, 1},
+    [OP_GET_THIS] = {"OP_GET_THIS", OPERAND_NONE, 0, 1},
+    [OP_GET_UPVALUE] = {"OP_GET_UPVALUE", OPERAND_UPVALUE, 0, 1},
+    [OP_GREATER] = {"OP_GREATER", OPERAND_NONE, 2, 1},
+    [OP_GREATER_EQUAL] = {"OP_GREATER_EQUAL", OPERAND_NONE, 2, 1},
+    [OP_INCREMENT] = {"OP_INCREMENT", OPERAND_NONE, 1, 1},
+    [OP_INDEX_GET] = {"OP_INDEX_GET", OPERAND_NONE, 2, 1},
+    [OP_INDEX_GET_UNCHECKED] = {"OP_INDEX_GET_UNCHECKED", OPERAND_NONE, 2, 1},
+    [OP_INDEX_SET] = {"OP_INDEX_SET", OPERAND_NONE, 3, 1},
+    [OP_INDEX_SET_UNCHECKED] = {"OP_INDEX_SET_UNCHECKED", OPERAND_NONE, 3, 1},
+    [OP_INHERIT] = {"OP_INHERIT", OPERAND_NONE, 2, 1},
+    [OP_INVOKE] = {"OP_INVOKE", OPERAND_INVOKE, 1, 1},
+    [OP_JUMP] = {"OP_JUMP", OPERAND_JUMP, 0, 0},
+    [OP_JUMP_HASH] = {"OP_JUMP_HASH", OPERAND_CONSTANT, 1, 0},
+    [OP_JUMP_IF_FALSE] = {"OP_JUMP_IF_FALSE", OPERAND_JUMP, 1, 1},
+    [OP_JUMP_IF_NOT_GREATER] = {"OP_JUMP_IF_NOT_GREATER", OPERAND_JUMP, 2, 0},
+    [OP_JUMP_IF_NOT_GREATER_EQUAL] = {"OP_JUMP_IF_NOT_GREATER_EQUAL",
+                                      OPERAND_JUMP, 2, 0},
+    [OP_JUMP_IF_NOT_LESS] = {"OP_JUMP_IF_NOT_LESS", OPERAND_JUMP, 2, 0},
+    [OP_JUMP_IF_NOT_LESS_EQUAL] = {"OP_JUMP_IF_NOT_LESS_EQUAL", OPERAND_JUMP,
+                                   2, 0},
+    [OP_JUMP_IF_TRUE] = {"OP_JUMP_IF_TRUE", OPERAND_JUMP, 1, 1},
+    [OP_JUMP_TABLE] = {"OP_JUMP_TABLE", OPERAND_CONSTANT, 1, 0},
+    [OP_LEN] = {"OP_LEN", OPERAND_NONE, 1, 1},
+    [OP_LESS] = {"OP_LESS", OPERAND_NONE, 2, 1},
+    [OP_LESS_EQUAL] = {"OP_LESS_EQUAL", OPERAND_NONE, 2, 1},
+    [OP_LOOP] = {"OP_LOOP", OPERAND_LOOP, 0, 0},
+    [OP_MAP] = {"OP_MAP", OPERAND_ARG_COUNT, 0, 1},
+    [OP_MAP_DELETE] = {"OP_MAP_DELETE", OPERAND_NONE, 2, 1},
+    [OP_MAP_HAS] = {"OP_MAP_HAS", OPERAND_NONE, 2, 1},
+    [OP_METHOD] = {"OP_METHOD", OPERAND_CONSTANT, 2, 1},
+    [OP_MULTIPLY] = {"OP_MULTIPLY", OPERAND_NONE, 2, 1},
+    [OP_NEGATE] = {"OP_NEGATE", OPERAND_NONE, 1, 1},
+    [OP_NIL] = {"OP_NIL", OPERAND_NONE, 0, 1},
+    [OP_NOT] = {"OP_NOT", OPERAND_NONE, 1, 1},
+    [OP_NOT_EQUAL] = {"OP_NOT_EQUAL", OPERAND_NONE, 2, 1},
+    [OP_POP] = {"OP_POP", OPERAND_NONE, 1, 0},
+    [OP_POP_JUMP_IF_FALSE] = {"OP_POP_JUMP_IF_FALSE", OPERAND_JUMP, 1, 0},
+    [OP_POP_JUMP_IF_TRUE] = {"OP_POP_JUMP_IF_TRUE", OPERAND_JUMP, 1, 0},
+    [OP_PRINT] = {"OP_PRINT", OPERAND_NONE, 1, 0},
+    [OP_PUSH_ONE] = {"OP_PUSH_ONE", OPERAND_NONE, 0, 1},
+    [OP_PUSH_SMALLINT] = {"OP_PUSH_SMALLINT", OPERAND_IMMEDIATE, 0, 1},
+    [OP_PUSH_ZERO] = {"OP_PUSH_ZERO", OPERAND_NONE, 0, 1},
+    [OP_RETURN] = {"OP_RETURN", OPERAND_NONE, 0, 0},
+    [OP_RETURN_VALUE] = {"OP_RETURN_VALUE", OPERAND_NONE, 1, 0},
+    [OP_SET_GLOBAL] = {"OP_SET_GLOBAL", OPERAND_CONSTANT, 1, 1},
+    [OP_SET_LOCAL] = {"OP_SET_LOCAL", OPERAND_SLOT, 1, 1},
+    [OP_SET_PROPERTY] = {"OP_SET_PROPERTY", OPERAND_PROPERTY, 2, 1},
+    [OP_SET_UPVALUE] = {"OP_SET_UPVALUE", OPERAND_UPVALUE, 1, 1},
+    [OP_SQRT] = {"OP_SQRT", OPERAND_NONE, 1, 1},
+    [OP_SUBTRACT] = {"OP_SUBTRACT", OPERAND_NONE, 2, 1},
+    [OP_SUPER_INVOKE] = {"OP_SUPER_INVOKE", OPERAND_INVOKE, 2, 1},
+    [OP_TAIL_CALL] = {"OP_TAIL_CALL", OPERAND_ARG_COUNT, 1, 1},
+    [OP_TRUE] = {"OP_TRUE", OPERAND_NONE, 0, 1},
+    [OP_WIDE] = {"OP_WIDE", OPERAND_NONE, 0, 0},
+    [OP_YIELD] = {"OP_YIELD", OPERAND_NONE, 1, 0},
+    [__OP_DUP] = {"__OP_DUP", OPERAND_NONE, 1, 2},
+    [__OP_STACK_RESET] = {"__OP_STACK_RESET", OPERAND_NONE, 0, 0},
+};
+
 void initChunk(Chunk *chunk) {
   chunk->count = 0;
   chunk->cap = 0;
   chunk->code = NULL;
   initValueArray(&chunk->constants);
   initLineArray(&chunk->lines);
+  chunk->cacheCount = 0;
+  chunk->decoded.count = 0;
+  chunk->decoded.code = NULL;
+  chunk->decoded.offsets = NULL;
+  chunk->decoded.caches = NULL;
+  chunk->decoded.cacheCount = 0;
+  chunk->decoded.maxStack = 0;
+  chunk->decoded.verified = false;
 }
 
-void writeChunk(Chunk *chunk, uint8_t byte, int line) {
-  if (chunk->cap < chunk->count + 1) {
-    int oldCap = chunk->cap;
-    chunk->cap = GROW_CAP(oldCap);
-    chunk->code = GROW_ARR(uint8_t, chunk->code, oldCap, chunk->cap);
+// Makes room for count more bytes of code at once, e.g. from the size of the
+// source being compiled, so that writing them doesn't grow the chunk.
+void reserveChunk(Chunk *chunk, int count) {
+  if (chunk->cap >= chunk->count + count)
+    return;
+
+  int oldCap = chunk->cap;
+  while (chunk->cap < chunk->count + count) {
+    chunk->cap = GROW_CAP(chunk->cap);
   }
+  chunk->code = GROW_ARR(uint8_t, chunk->code, oldCap, chunk->cap);
+}
 
-  setLine(&chunk->lines, line);
+void writeChunk(Chunk *chunk, uint8_t byte, int line, int column) {
+  writeChunkBytes(chunk, &byte, 1, line, column);
+}
+
+// Appends the bytes of one or more instructions at the same source position,
+// with a single capacity check and line update.
+void writeChunkBytes(Chunk *chunk, const uint8_t *bytes, int count, int line,
+                     int column) {
+  if (chunk->decoded.code != NULL)
+    freeDecoded(&chunk->decoded);
+
+  reserveChunk(chunk, count);
+  setLines(&chunk->lines, line, column, count);
 
-  chunk->code[chunk->count] = byte;
-  chunk->count++;
+  memcpy(chunk->code + chunk->count, bytes, count);
+  chunk->count += count;
 }
 
-void writeConstant(Chunk *chunk, Value value, int line) {
+void writeConstant(Chunk *chunk, Value value, int line, int column) {
   int idx = addConstant(chunk, value);
 
-  if (idx < 256) {
+  if (idx <= UINT8_MAX) {
     // Use OP_CONSTANT
-    writeChunk(chunk, OP_CONSTANT, line);
-    writeChunk(chunk, idx, line);
+    uint8_t code[] = {OP_CONSTANT, (uint8_t)idx};
+    writeChunkBytes(chunk, code, 2, line, column);
     return;
   }
 
-  // Use OP_CONSTANT_LONG
-  writeChunk(chunk, OP_CONSTANT_LONG, line);
-
-  // Write the 24-bit (3 bytes)
+  // Use OP_WIDE OP_CONSTANT, then the 24-bit (3 bytes) index
   // Apply AND bit by bit for the relevant part and get rid of the rest
-  writeChunk(chunk, (idx & 0xff0000) >> 16, line);
-  writeChunk(chunk, (idx & 0x00ff00) >> 8, line);
-  writeChunk(chunk, (idx & 0x0000ff), line);
+  uint8_t code[] = {OP_WIDE, OP_CONSTANT, (idx & 0xff0000) >> 16,
+                    (idx & 0x00ff00) >> 8, idx & 0x0000ff};
+  writeChunkBytes(chunk, code, 5, line, column);
 }
 
 int getInstructionLine(Chunk *chunk, int instrIdx) {
@@ -53,13 +169,217 @@ int getInstructionLine(Chunk *chunk, int instrIdx) {
   return line;
 }
 
+// Returns the column of the instruction, -1 if there's no such instruction.
+int getInstructionColumn(Chunk *chunk, int instrIdx) {
+  int line, column;
+  if (!getLinePosition(&chunk->lines, instrIdx, &line, &column))
+    return -1;
+  return column;
+}
+
+// Returns the static description of the given opcode, NULL if unknown.
+const OpInfo *getOpInfo(uint8_t op) {
+  if (op >= __OP_COUNT || opInfos[op].name == NULL)
+    return NULL;
+  return &opInfos[op];
+}
+
+// Returns the number of bytes of the instruction starting at offset, including
+// the OP_WIDE prefix and the operand.
+int instructionLength(Chunk *chunk, int offset) {
+  bool wide = chunk->code[offset] == OP_WIDE;
+  const OpInfo *info = getOpInfo(chunk->code[offset + (wide ? 1 : 0)]);
+  if (info == NULL)
+    return 1;
+
+  int length = wide ? 2 : 1;
+  switch (info->operand) {
+  case OPERAND_NONE:
+    return length;
+  case OPERAND_ARG_COUNT:
+    return length + 1;
+  case OPERAND_JUMP:
+  case OPERAND_LOOP:
+    return length + 2;
+  case OPERAND_SLOT_JUMP:
+  case OPERAND_SLOT_LOOP:
+    return length + 3;
+  case OPERAND_CONSTANT:
+  case OPERAND_SLOT:
+  case OPERAND_UPVALUE:
+  case OPERAND_IMMEDIATE:
+    return length + (wide ? 3 : 1);
+  case OPERAND_PROPERTY:
+    return length + (wide ? 3 : 1) + 2;
+  case OPERAND_INVOKE:
+    return length + (wide ? 3 : 1) + 3;
+  }
+
+  return length;
+}
+
 // Returns the index of the inserted element.
 int addConstant(Chunk *chunk, Value value) {
+  // Decoded instructions point into the constant pool, which may move.
+  if (chunk->decoded.code != NULL)
+    freeDecoded(&chunk->decoded);
+
   writeValueArray(&chunk->constants, value);
   return chunk->constants.count - 1;
 }
 
+static void freeDecoded(DecodedChunk *decoded) {
+  FREE_ARR(Instruction, decoded->code, decoded->count);
+  FREE_ARR(int, decoded->offsets, decoded->count);
+  FREE_ARR(InlineCache, decoded->caches, decoded->cacheCount);
+  decoded->count = 0;
+  decoded->code = NULL;
+  decoded->offsets = NULL;
+  decoded->caches = NULL;
+  decoded->cacheCount = 0;
+  decoded->maxStack = 0;
+  decoded->verified = false;
+}
+
+// Translates the bytecode into its decoded form (see Instruction).
+// Operands are read once here: wide prefixes are folded into the operand,
+// constants are resolved to pointers in the constant pool and jump offsets
+// (in bytes, backward for loops) become distances in instructions. The inline
+// caches start empty.
+//
+// The constant pool must not grow after this, as it would invalidate the
+// resolved pointers.
+//
+// Returns false if the bytecode is malformed.
+bool decodeChunk(Chunk *chunk) {
+  freeDecoded(&chunk->decoded);
+
+  // Map every bytecode offset to the index of the instruction starting there
+  // (-1 for offsets in the middle of an instruction), to resolve jumps.
+  int *indexes = ALLOCATE(int, chunk->count + 1);
+  int count = 0;
+  for (int offset = 0; offset <= chunk->count; offset++) {
+    indexes[offset] = -1;
+  }
+  for (int offset = 0; offset < chunk->count;) {
+    indexes[offset] = count++;
+    offset += instructionLength(chunk, offset);
+  }
+  // Jumping right past the last instruction is fine.
+  indexes[chunk->count] = count;
+
+  DecodedChunk *decoded = &chunk->decoded;
+  decoded->code = ALLOCATE(Instruction, count);
+  decoded->offsets = ALLOCATE(int, count);
+  decoded->count = count;
+  decoded->cacheCount = chunk->cacheCount;
+  decoded->caches = ALLOCATE(InlineCache, chunk->cacheCount);
+  if (chunk->cacheCount > 0)
+    memset(decoded->caches, 0, sizeof(InlineCache) * chunk->cacheCount);
+
+  bool ok = true;
+  for (int offset = 0, i = 0; offset < chunk->count; i++) {
+    int length = instructionLength(chunk, offset);
+    bool wide = chunk->code[offset] == OP_WIDE;
+    int operandOffset = offset + (wide ? 2 : 1);
+    uint8_t op = chunk->code[offset + (wide ? 1 : 0)];
+    const OpInfo *info = getOpInfo(op);
+
+    if (info == NULL || offset + length > chunk->count) {
+      ok = false;
+      break;
+    }
+
+    Instruction *instr = &decoded->code[i];
+    instr->op = op;
+    instr->argCount = 0;
+    instr->slot = 0;
+    instr->operand = 0;
+    instr->constant = NULL;
+    decoded->offsets[i] = offset;
+
+    switch (info->operand) {
+    case OPERAND_NONE:
+      break;
+    case OPERAND_CONSTANT:
+    case OPERAND_SLOT:
+    case OPERAND_UPVALUE:
+    case OPERAND_PROPERTY:
+    case OPERAND_INVOKE: {
+      uint32_t index = wide ? GET_WIDE_OPERAND(chunk, operandOffset)
+                            : chunk->code[operandOffset];
+      instr->operand = (int32_t)index;
+      if (info->operand == OPERAND_CONSTANT ||
+          info->operand == OPERAND_PROPERTY ||
+          info->operand == OPERAND_INVOKE) {
+        if ((int)index >= chunk->constants.count) {
+          ok = false;
+          break;
+        }
+        instr->constant = &chunk->constants.values[index];
+      }
+
+      if (info->operand == OPERAND_PROPERTY ||
+          info->operand == OPERAND_INVOKE) {
+        int cacheOffset = operandOffset + (wide ? 3 : 1);
+        instr->slot = (uint16_t)(chunk->code[cacheOffset] << 8) |
+                      chunk->code[cacheOffset + 1];
+        if (instr->slot >= chunk->cacheCount) {
+          ok = false;
+          break;
+        }
+        if (info->operand == OPERAND_INVOKE)
+          instr->argCount = chunk->code[cacheOffset + 2];
+      }
+      break;
+    }
+    case OPERAND_ARG_COUNT:
+      instr->operand = chunk->code[operandOffset];
+      break;
+    case OPERAND_IMMEDIATE:
+      instr->operand =
+          wide ? SIGN_EXTEND_24(GET_WIDE_OPERAND(chunk, operandOffset))
+               : (int8_t)chunk->code[operandOffset];
+      break;
+    case OPERAND_JUMP:
+    case OPERAND_LOOP:
+    case OPERAND_SLOT_JUMP:
+    case OPERAND_SLOT_LOOP: {
+      if (info->operand == OPERAND_SLOT_JUMP ||
+          info->operand == OPERAND_SLOT_LOOP) {
+        instr->slot = chunk->code[operandOffset++];
+      }
+
+      uint16_t jump = (uint16_t)(chunk->code[operandOffset] << 8) |
+                      chunk->code[operandOffset + 1];
+      bool forward = info->operand == OPERAND_JUMP ||
+                     info->operand == OPERAND_SLOT_JUMP;
+      int target = forward ? offset + length + jump : offset + length - jump;
+      if (target < 0 || target > chunk->count || indexes[target] == -1) {
+        ok = false;
+        break;
+      }
+      instr->operand = indexes[target] - (i + 1);
+      break;
+    }
+    }
+
+    if (!ok)
+      break;
+
+    offset += length;
+  }
+
+  FREE_ARR(int, indexes, chunk->count + 1);
+
+  if (!ok)
+    freeDecoded(decoded);
+
+  return ok;
+}
+
 void freeChunk(Chunk *chunk) {
+  freeDecoded(&chunk->decoded);
   FREE_ARR(uint8_t, chunk->code, chunk->cap);
   freeValueArray(&chunk->constants);
   freeLineArray(&chunk->lines);
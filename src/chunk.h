@@ -6,80 +6,264 @@
 #include "value.h"
 
 /*
- * Reads a 24-bit constant ID from a chunk's code array in a
- * platform-independent way. The bytes are read individually and combined using
- * bit shifts, ensuring consistent behavior regardless of the platform's
- * endianness.
+ * Reads a 24-bit operand from a chunk's code array in a platform-independent
+ * way. The bytes are read individually and combined using bit shifts, ensuring
+ * consistent behavior regardless of the platform's endianness.
  *
  * @param chunk  Pointer to the chunk structure containing the code array
- * @param offset Base offset into the code array where the constant ID starts
- * @return       24-bit constant ID value
+ * @param offset Offset into the code array where the operand starts
+ * @return       24-bit operand value
  */
-#define GET_CONSTANT_LONG_ID(chunk, offset)                                    \
-  ((uint32_t)((chunk)->code[(offset) + 1] & 0xFF) << 16 |                      \
-   (uint32_t)((chunk)->code[(offset) + 2] & 0xFF) << 8 |                       \
-   (uint32_t)((chunk)->code[(offset) + 3] & 0xFF))
+#define GET_WIDE_OPERAND(chunk, offset)                                        \
+  ((uint32_t)((chunk)->code[(offset)] & 0xFF) << 16 |                          \
+   (uint32_t)((chunk)->code[(offset) + 1] & 0xFF) << 8 |                       \
+   (uint32_t)((chunk)->code[(offset) + 2] & 0xFF))
+
+// Sign-extends a 24-bit two's complement operand to a 32-bit integer.
+#define SIGN_EXTEND_24(value) ((int32_t)((uint32_t)(value) << 8) >> 8)
+
+// Range of the signed immediate carried by OP_PUSH_SMALLINT, without and with
+// the OP_WIDE prefix.
+#define SMALLINT_MIN INT8_MIN
+#define SMALLINT_MAX INT8_MAX
+#define SMALLINT_WIDE_MIN (-(1 << 23))
+#define SMALLINT_WIDE_MAX ((1 << 23) - 1)
+
+// Largest operand that can be encoded with the OP_WIDE prefix.
+#define WIDE_OPERAND_MAX 0x00FFFFFF
 
 typedef enum {
   OP_ADD,
+  // Array literal of the elements on top of the stack.
+  OP_ARRAY,
+  OP_ARRAY_POP,
+  OP_ARRAY_PUSH,
   OP_BITWISE_AND,
   OP_BITWISE_NOT,
   OP_BITWISE_OR,
   OP_BITWISE_SHIFT_LEFT,
   OP_BITWISE_SHIFT_RIGHT,
   OP_BITWISE_XOR,
+  // Calls the function below the arguments, see vm.c.
+  OP_CALL,
+  // Creates a class named after the constant, see classDeclaration().
+  OP_CLASS,
+  // Moves the captured local on top of the stack to the heap, see vm.c.
+  OP_CLOSE_UPVALUE,
+  // Creates a closure of the function constant, capturing its upvalues.
+  OP_CLOSURE,
   OP_CONSTANT,
-  OP_CONSTANT_LONG,
   OP_DECREMENT,
   OP_DEFINE_GLOBAL,
-  OP_DEFINE_GLOBAL_LONG,
   OP_DIVIDE,
   OP_EQUAL,
   OP_FALSE,
+  // Builtin called by name (floor(x)), compiled to a single instruction.
+  OP_FLOOR,
+  // Loop over the array or generator in the 3 slots [iterable, index,
+  // variable], see vm.c.
+  OP_FOR_EACH,
+  // Counted loop over the 4 slots [counter, limit, step, variable], see vm.c.
+  OP_FOR_RANGE,
+  OP_FOR_RANGE_INIT,
+  // Reads a captured constant, copied by value into the closure.
+  OP_GET_CONST_UPVALUE,
   OP_GET_GLOBAL,
-  OP_GET_GLOBAL_LONG,
   OP_GET_LOCAL,
-  OP_GET_LOCAL_LONG, // NOTE: Not used at the moment
+  // instance.name, the operand is followed by an inline cache slot.
+  OP_GET_PROPERTY,
+  // super.name: method of the superclass bound to the receiver.
+  OP_GET_SUPER,
+  // Receiver of the method being executed, that sits in the callee slot.
+  OP_GET_THIS,
+  OP_GET_UPVALUE,
   OP_GREATER,
   OP_GREATER_EQUAL,
   OP_INCREMENT,
+  // array[index], the unchecked ones skip the bounds check when the compiler
+  // proved the index in range (see rangeForStatement()).
+  OP_INDEX_GET,
+  OP_INDEX_GET_UNCHECKED,
+  OP_INDEX_SET,
+  OP_INDEX_SET_UNCHECKED,
+  // Copies the methods of the superclass into the subclass.
+  OP_INHERIT,
+  // instance.name(args): method call without creating a bound method, with an
+  // inline cache slot and the argument count after the name.
+  OP_INVOKE,
   OP_JUMP,
+  // Switch dispatch on the popped value through a constant table giving the
+  // case k, see switchStatement(). A hit jumps by the k-th of the jumps
+  // following the instruction, skipping the first one, taken on a miss.
+  OP_JUMP_HASH,
+  // Jump if the value on top of the stack is falsey (or truthy for
+  // OP_JUMP_IF_TRUE), leaving it there: the value of `a and b` or `a or b`.
   OP_JUMP_IF_FALSE,
-  // OP_JUMP_IF_TRUE, // Not needed because it jumps directly
+  // Fused comparison and jump, popping both operands: jump if not a > b, etc.
+  OP_JUMP_IF_NOT_GREATER,
+  OP_JUMP_IF_NOT_GREATER_EQUAL,
+  OP_JUMP_IF_NOT_LESS,
+  OP_JUMP_IF_NOT_LESS_EQUAL,
+  OP_JUMP_IF_TRUE,
+  OP_JUMP_TABLE,
+  OP_LEN,
   OP_LESS,
   OP_LESS_EQUAL,
+  OP_LOOP,
+  // Collects n keys and values (n is even) into a map.
+  OP_MAP,
+  OP_MAP_DELETE,
+  OP_MAP_HAS,
+  // Adds the function on top of the stack to the class below as a method.
+  OP_METHOD,
   OP_MULTIPLY,
   OP_NEGATE,
   OP_NIL,
   OP_NOT,
   OP_NOT_EQUAL,
   OP_POP,
+  // Pop the value on top of the stack and jump if it's falsey (or truthy),
+  // the branches of conditions (see condition() in compiler.c).
+  OP_POP_JUMP_IF_FALSE,
+  OP_POP_JUMP_IF_TRUE,
   OP_PRINT,
+  OP_PUSH_ONE,
+  OP_PUSH_SMALLINT,
+  OP_PUSH_ZERO,
+  // Returns nil, or the value on top of the stack, to the caller.
   OP_RETURN,
+  OP_RETURN_VALUE,
   OP_SET_GLOBAL,
-  OP_SET_GLOBAL_LONG,
   OP_SET_LOCAL,
-  OP_SET_LOCAL_LONG, // NOTE: Not used at the moment
+  OP_SET_PROPERTY,
+  OP_SET_UPVALUE,
+  OP_SQRT,
   OP_SUBTRACT,
+  // super.name(args), like OP_INVOKE on the superclass popped from the top.
+  OP_SUPER_INVOKE,
+  // Call in tail position (return f(x)), reusing the frame, see vm.c.
+  OP_TAIL_CALL,
   OP_TRUE,
+  // Prefix: the operand of the following instruction is 3 bytes instead of 1.
+  OP_WIDE,
+  // Suspends the generator running, giving the popped value to its resumer.
+  OP_YIELD,
   __OP_DUP,         // Internally used to duplicate the top of the stack
   __OP_STACK_RESET, // Reset the stack
+  __OP_COUNT,       // Number of opcodes, keep it last
 } OpCode;
 
+// Kind of operand following an opcode in the bytecode.
+// Index-like operands are 1 byte, or 3 bytes when prefixed by OP_WIDE.
+typedef enum {
+  OPERAND_NONE,      // No operand
+  OPERAND_CONSTANT,  // Index in the chunk's constant pool
+  OPERAND_SLOT,      // Stack slot of a local variable
+  OPERAND_IMMEDIATE, // Signed integer immediate
+  OPERAND_JUMP,      // 16-bit forward jump offset (never widened)
+  OPERAND_LOOP,      // 16-bit backward jump offset (never widened)
+  OPERAND_SLOT_JUMP, // 1 byte stack slot, then a 16-bit forward jump offset
+  OPERAND_SLOT_LOOP, // 1 byte stack slot, then a 16-bit backward jump offset
+  OPERAND_ARG_COUNT, // 1 byte number of arguments (or elements), also popped
+  OPERAND_UPVALUE,   // Index in the upvalues of the running closure
+  OPERAND_PROPERTY,  // Name constant, then a 2 byte inline cache slot
+  OPERAND_INVOKE,    // Like OPERAND_PROPERTY, then the argument count
+} OperandType;
+
+typedef struct {
+  const char *name;
+  OperandType operand;
+  // Stack effect: number of values popped, then pushed.
+  // Values only peeked (e.g. OP_SET_LOCAL) count as popped and pushed back.
+  // OPERAND_ARG_COUNT and OPERAND_INVOKE instructions also pop the arguments
+  // (or elements).
+  int8_t pops;
+  int8_t pushes;
+} OpInfo;
+
+// Number of shapes an inline cache remembers. A property instruction seeing
+// more of them (megamorphic) replaces them in turn.
+#define INLINE_CACHE_WAYS 4
+
+// What a property instruction found on instances of a shape.
+typedef struct {
+  // NULL for an unused entry.
+  ObjShape *shape;
+  // Index of the field, -1 if the name is a method.
+  int field;
+  // Shape after adding the field, when OP_SET_PROPERTY adds it.
+  ObjShape *transition;
+  // Method of the class, when there's no such field.
+  Value method;
+} CacheEntry;
+
+// Inline cache of a property instruction (OPERAND_PROPERTY and
+// OPERAND_INVOKE): a hit on the shape of the instance gives the field index
+// or the method right away, instead of looking the name up in the shape and
+// in the class.
+typedef struct {
+  CacheEntry entries[INLINE_CACHE_WAYS];
+  // Entry replaced by the next miss once they're all used.
+  int next;
+} InlineCache;
+
+// Instruction decoded at load time from the bytecode, so that the VM doesn't
+// have to decode operands while executing.
+//
+// [..op..|..argCount..|..slot..|....operand....|.........constant.........]
+typedef struct {
+  uint8_t op;
+  // Argument count of OPERAND_INVOKE instructions.
+  uint8_t argCount;
+  // Stack slot of OPERAND_SLOT_JUMP/LOOP instructions, that also have a jump,
+  // or inline cache of OPERAND_PROPERTY/INVOKE ones (see DecodedChunk).
+  uint16_t slot;
+  // Local slot, upvalue, immediate value, argument count or jump distance
+  // (in instructions, relative to the next one, negative for loops). The
+  // OP_WIDE prefix is already folded in.
+  int32_t operand;
+  // Constant pool entry, resolved for OPERAND_CONSTANT instructions.
+  Value *constant;
+} Instruction;
+
+typedef struct {
+  int count;
+  Instruction *code;
+  // Bytecode offset of each instruction, for line lookup and tracing.
+  int *offsets;
+  // Inline caches of the property instructions, starting empty.
+  InlineCache *caches;
+  int cacheCount;
+  // Maximum stack depth reached while executing, set by verifyChunk().
+  int maxStack;
+  bool verified;
+} DecodedChunk;
+
 typedef struct {
   int count;
   int cap;
   uint8_t *code;
   LineArray lines;
   ValueArray constants;
+  // Inline cache slots used by the property instructions.
+  int cacheCount;
+  // Built by decodeChunk() once the chunk is complete, see Instruction.
+  // Writing to the chunk discards it.
+  DecodedChunk decoded;
 } Chunk;
 
 void initChunk(Chunk *chunk);
 void freeChunk(Chunk *chunk);
-void writeChunk(Chunk *chunk, uint8_t byte, int line);
-void writeConstant(Chunk *chunk, Value value, int line);
+void reserveChunk(Chunk *chunk, int count);
+void writeChunk(Chunk *chunk, uint8_t byte, int line, int column);
+void writeChunkBytes(Chunk *chunk, const uint8_t *bytes, int count, int line,
+                     int column);
+void writeConstant(Chunk *chunk, Value value, int line, int column);
 int addConstant(Chunk *chunk, Value value);
-int getConstantLong(Chunk *chunk, int offset);
 int getInstructionLine(Chunk *chunk, int instrIdx);
+int getInstructionColumn(Chunk *chunk, int instrIdx);
+const OpInfo *getOpInfo(uint8_t op);
+int instructionLength(Chunk *chunk, int offset);
+bool decodeChunk(Chunk *chunk);
 
 #endif
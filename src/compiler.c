@@ -5,7 +5,7 @@
 #include "scanner.h"
 #include "table.h"
 #include "value.h"
-#include <stdarg.h>
+#include <errno.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -17,28 +17,49 @@
 
 int debugIndent = 0;
 
+// Rough ratio of source to bytecode for top-level code, used to reserve the
+// script chunk in compile().
+#define SOURCE_BYTES_PER_CODE_BYTE 8
+
 static void grouping(Compiler *compiler, bool canAssign);
 static void unary(Compiler *compiler, bool canAssign);
 static void binary(Compiler *compiler, bool canAssign);
+static void and_(Compiler *compiler, bool canAssign);
+static void or_(Compiler *compiler, bool canAssign);
 static void number(Compiler *compiler, bool canAssign);
 static void literal(Compiler *compiler, bool canAssign);
 static void string(Compiler *compiler, bool canAssign);
 static void variable(Compiler *compiler, bool canAssign);
+static void namedVariable(Compiler *compiler, Token *name, bool canAssign);
 static void postfix(Compiler *compiler, bool canAssign);
+static void call(Compiler *compiler, bool canAssign);
+static void arrayLiteral(Compiler *compiler, bool canAssign);
+static void subscript(Compiler *compiler, bool canAssign);
+static void mapLiteral(Compiler *compiler, bool canAssign);
+static void dot(Compiler *compiler, bool canAssign);
+static void this_(Compiler *compiler, bool canAssign);
+static void super_(Compiler *compiler, bool canAssign);
 
 static void expression(Compiler *compiler);
 static void declaration(Compiler *compiler);
 static void statement(Compiler *compiler);
+static uint8_t argumentList(Compiler *compiler);
+static void parseOperators(Compiler *compiler, Precedence precedence,
+                           bool canAssign);
+static Value numberValue(Token *token);
 
 static ParseRule *getRule(TokenType type);
 
 ParseRule rules[] = {
-    [TOKEN_LEFT_PAREN] = {grouping, NULL, NULL, PREC_NONE},
+    [TOKEN_LEFT_PAREN] = {grouping, call, NULL, PREC_CALL},
     [TOKEN_RIGHT_PAREN] = {NULL, NULL, NULL, PREC_NONE},
-    [TOKEN_LEFT_BRACE] = {NULL, NULL, NULL, PREC_NONE},
+    [TOKEN_LEFT_BRACE] = {mapLiteral, NULL, NULL, PREC_NONE},
     [TOKEN_RIGHT_BRACE] = {NULL, NULL, NULL, PREC_NONE},
+    [TOKEN_LEFT_BRACKET] = {arrayLiteral, subscript, NULL, PREC_CALL},
+    [TOKEN_RIGHT_BRACKET] = {NULL, NULL, NULL, PREC_NONE},
     [TOKEN_COMMA] = {NULL, NULL, NULL, PREC_NONE},
-    [TOKEN_DOT] = {NULL, NULL, NULL, PREC_NONE},
+    [TOKEN_COLON] = {NULL, NULL, NULL, PREC_NONE},
+    [TOKEN_DOT] = {NULL, dot, NULL, PREC_CALL},
     [TOKEN_MINUS] = {unary, binary, NULL, PREC_TERM},
     [TOKEN_PLUS] = {NULL, binary, NULL, PREC_TERM},
     [TOKEN_SEMICOLON] = {NULL, NULL, NULL, PREC_NONE},
@@ -74,23 +95,27 @@ ParseRule rules[] = {
     // TOKEN_TEMPL_INTERP_END,   // Closing "}"
     // TOKEN_TEMPL_CONTENT,      // Non-expression content
     [TOKEN_NUMBER] = {number, NULL, NULL, PREC_NONE},
-    [TOKEN_AND] = {NULL, NULL, NULL, PREC_NONE},
+    [TOKEN_AND] = {NULL, and_, NULL, PREC_AND},
+    [TOKEN_CASE] = {NULL, NULL, NULL, PREC_NONE},
     [TOKEN_CLASS] = {NULL, NULL, NULL, PREC_NONE},
+    [TOKEN_DEFAULT] = {NULL, NULL, NULL, PREC_NONE},
     [TOKEN_ELSE] = {NULL, NULL, NULL, PREC_NONE},
     [TOKEN_FALSE] = {literal, NULL, NULL, PREC_NONE},
     [TOKEN_FOR] = {NULL, NULL, NULL, PREC_NONE},
     [TOKEN_FUN] = {NULL, NULL, NULL, PREC_NONE},
     [TOKEN_IF] = {NULL, NULL, NULL, PREC_NONE},
     [TOKEN_NIL] = {literal, NULL, NULL, PREC_NONE},
-    [TOKEN_OR] = {NULL, NULL, NULL, PREC_NONE},
+    [TOKEN_OR] = {NULL, or_, NULL, PREC_OR},
     [TOKEN_PRINT] = {NULL, NULL, NULL, PREC_NONE},
     [TOKEN_RETURN] = {NULL, NULL, NULL, PREC_NONE},
-    [TOKEN_SUPER] = {NULL, NULL, NULL, PREC_NONE},
-    [TOKEN_THIS] = {NULL, NULL, NULL, PREC_NONE},
+    [TOKEN_SUPER] = {super_, NULL, NULL, PREC_NONE},
+    [TOKEN_SWITCH] = {NULL, NULL, NULL, PREC_NONE},
+    [TOKEN_THIS] = {this_, NULL, NULL, PREC_NONE},
     [TOKEN_TRUE] = {literal, NULL, NULL, PREC_NONE},
     [TOKEN_VAR] = {NULL, NULL, NULL, PREC_NONE},
     [TOKEN_CONST] = {NULL, NULL, NULL, PREC_NONE},
     [TOKEN_WHILE] = {NULL, NULL, NULL, PREC_NONE},
+    [TOKEN_YIELD] = {NULL, NULL, NULL, PREC_NONE},
     [TOKEN_ERROR] = {NULL, NULL, NULL, PREC_NONE},
     [TOKEN_EOF] = {NULL, NULL, NULL, PREC_NONE},
 };
@@ -138,18 +163,53 @@ const char *precedenceTypeToString(Precedence type) {
   }
 }
 
+static void initFunctionState(FunctionState *state, FunctionState *enclosing,
+                              FunctionType type, ObjFunction *function) {
+  state->enclosing = enclosing;
+  state->function = function;
+  state->type = type;
+  state->localCount = 0;
+  state->scopeDepth = 0;
+  state->upvalueCount = 0;
+  state->knownConstantCount = 0;
+  initTable(&state->localNames);
+  initTable(&state->constantNames);
+  state->boundedLoop = NULL;
+  state->lastInstruction = -1;
+  state->lastJumpTarget = -1;
+}
+
+static void freeFunctionState(FunctionState *state) {
+  freeTable(&state->localNames);
+  freeTable(&state->constantNames);
+}
+
 Compiler *initCompiler(MemoryManager *mm) {
   // NOTE: Scanner gets initialized in compile() as it take the source code,
   // evaluate if improve it.
   Compiler *compiler = (Compiler *)malloc(sizeof(Compiler));
   compiler->parser = (Parser *)malloc(sizeof(Parser));
+  compiler->scanner = NULL;
   compiler->memoryManager = mm;
-  compiler->localCount = 0;
-  compiler->scopeDepth = 0;
+  initFunctionState(&compiler->script, NULL, TYPE_SCRIPT, NULL);
+  compiler->current = &compiler->script;
+  compiler->currentClass = NULL;
+  compiler->condition = NULL;
+  initTable(&compiler->knownGlobals);
+  initTable(&compiler->globalNames);
+  initTable(&compiler->newKnownGlobals);
+  initTable(&compiler->newConstants);
+  compiler->optimizationLevel = OPTIMIZATION_LEVEL_DEFAULT;
   return compiler;
 }
 
 void freeCompiler(Compiler *compiler) {
+  freeFunctionState(&compiler->script);
+  freeTable(&compiler->knownGlobals);
+  freeTable(&compiler->globalNames);
+  freeTable(&compiler->newKnownGlobals);
+  freeTable(&compiler->newConstants);
+
   free(compiler->parser);
   compiler->parser = NULL;
 
@@ -169,7 +229,7 @@ static void errorAt(Parser *parser, Token *token, const char *message) {
 
   parser->panicMode = true;
 
-  fprintf(stderr, "[Line %d] Error", token->line);
+  fprintf(stderr, "[Line %d:%d] Error", token->line, token->column);
 
   if (token->type == TOKEN_EOF) {
     fprintf(stderr, " at end");
@@ -225,37 +285,37 @@ static bool match(Compiler *compiler, TokenType type) {
   return true;
 }
 
-static void emitBytes(Compiler *compiler, int count, ...) {
+// Emits one instruction, made of count bytes (opcode and operands), appended
+// to the chunk at once.
+static void emitCode(Compiler *compiler, const uint8_t *code, int count) {
+  compiler->current->lastInstruction = compiler->currentChunk->count;
+
 #ifdef DEBUG_COMPILE_EXECUTION
   debugIndent++;
-  printf("%semitBytes(%d) = ",
+  printf("%semitCode(%d) = ",
          strfromnchars(DEBUG_COMPILE_INDENT_CHAR, debugIndent), count);
-#endif
-
-  va_list args;
-  va_start(args, count);
-
   for (int i = 0; i < count; i++) {
-    u_int8_t byte = (u_int8_t)va_arg(args, int);
-
-#ifdef DEBUG_COMPILE_EXECUTION
-    printf("%x ", byte);
-#endif
-
-    writeChunk(compiler->currentChunk, byte, compiler->parser->prev.line);
+    printf("%x ", code[i]);
   }
-
-  va_end(args);
-
-#ifdef DEBUG_COMPILE_EXECUTION
   printf("\n");
   debugIndent--;
 #endif
+
+  writeChunkBytes(compiler->currentChunk, code, count,
+                  compiler->parser->prev.line, compiler->parser->prev.column);
+}
+
+static void emitByte(Compiler *compiler, uint8_t byte) {
+  emitCode(compiler, &byte, 1);
+}
+
+static void emitBytes(Compiler *compiler, uint8_t byte1, uint8_t byte2) {
+  uint8_t code[] = {byte1, byte2};
+  emitCode(compiler, code, 2);
 }
 
-static int emitJump(Compiler *compiler, u_int8_t instruction) {
-  emitBytes(compiler, 1, instruction);
-  emitBytes(compiler, 2, 0xff, 0xff);
+static int emitJump(Compiler *compiler, uint8_t instruction) {
+  emitCode(compiler, (uint8_t[]){instruction, 0xff, 0xff}, 3);
   return compiler->currentChunk->count - 2;
 }
 
@@ -267,56 +327,188 @@ static void patchJump(Compiler *compiler, int offset) {
   }
   compiler->currentChunk->code[offset] = (jump >> 8) & 0xff;
   compiler->currentChunk->code[offset + 1] = jump & 0xff;
+  compiler->current->lastJumpTarget = compiler->currentChunk->count;
+}
+
+// Jumps backward to loopStart.
+static void emitLoop(Compiler *compiler, int loopStart) {
+  // +3 to jump over OP_LOOP itself and its operand too.
+  int offset = compiler->currentChunk->count - loopStart + 3;
+  if (offset > UINT16_MAX) {
+    error(compiler->parser, "Loop body too large.");
+  }
+  emitCode(compiler, (uint8_t[]){OP_LOOP, (offset >> 8) & 0xff, offset & 0xff},
+           3);
+}
+
+// Emits a jump popping the value just compiled, taken if it's false (or
+// true if onTrue), returning its offset to patch.
+//
+// If the value comes from a comparison, the comparison and a jump taken if
+// it's false are fused in a single instruction popping both operands (e.g.
+// `i < n` becomes OP_JUMP_IF_NOT_LESS). A jump taken if it's true isn't fused:
+// `a < b` isn't the same as `!(a >= b)` with NaN.
+static int emitBranch(Compiler *compiler, bool onTrue) {
+  Chunk *chunk = compiler->currentChunk;
+  int last = compiler->current->lastInstruction;
+
+  OpCode fused = onTrue ? OP_POP_JUMP_IF_TRUE : OP_POP_JUMP_IF_FALSE;
+  if (!onTrue && last == chunk->count - 1 &&
+      compiler->current->lastJumpTarget != chunk->count) {
+    switch (chunk->code[last]) {
+    case OP_GREATER:
+      fused = OP_JUMP_IF_NOT_GREATER;
+      break;
+    case OP_GREATER_EQUAL:
+      fused = OP_JUMP_IF_NOT_GREATER_EQUAL;
+      break;
+    case OP_LESS:
+      fused = OP_JUMP_IF_NOT_LESS;
+      break;
+    case OP_LESS_EQUAL:
+      fused = OP_JUMP_IF_NOT_LESS_EQUAL;
+      break;
+    default:
+      break;
+    }
+  }
+
+  if (fused == OP_POP_JUMP_IF_TRUE || fused == OP_POP_JUMP_IF_FALSE)
+    return emitJump(compiler, fused);
+
+  // Overwrite the comparison, the line info of its byte stays the same.
+  chunk->code[last] = fused;
+  emitBytes(compiler, 0xff, 0xff);
+  compiler->current->lastInstruction = last;
+  return chunk->count - 2;
+}
+
+// Patches the count jumps to land on the current end, emptying the list.
+static void patchJumps(Compiler *compiler, int *jumps, int *count) {
+  for (int i = 0; i < *count; i++) {
+    patchJump(compiler, jumps[i]);
+  }
+  *count = 0;
+}
+
+static void addJump(Compiler *compiler, int *jumps, int *count, int jump) {
+  if (*count == CONDITION_JUMPS_MAX) {
+    error(compiler->parser, "Too many operands in condition.");
+    return;
+  }
+  jumps[(*count)++] = jump;
 }
 
-// Emit the correct number of bytes depending on how many there are for the
-// given constant index.
+// Emit the instruction with the given constant index as operand, prefixing it
+// with OP_WIDE if the index doesn't fit in a single byte.
 static void emitConstantIndex(Compiler *compiler, ConstantIndex index,
-                              OpCode codeShort, OpCode codeLong) {
-  if (index.isLong) {
-    emitBytes(compiler, 4, codeLong, index.bytes[0], index.bytes[1],
-              index.bytes[2]);
+                              OpCode code) {
+  if (index.isWide) {
+    emitCode(compiler,
+             (uint8_t[]){OP_WIDE, code, index.bytes[0], index.bytes[1],
+                         index.bytes[2]},
+             5);
     return;
   }
 
-  emitBytes(compiler, 2, codeShort, index.bytes[0]);
+  emitBytes(compiler, code, index.bytes[0]);
 }
 
+// Initializers return the receiver.
 static void emitReturn(Compiler *compiler) {
-  emitBytes(compiler, 1, OP_RETURN);
+  if (compiler->current->type == TYPE_INITIALIZER) {
+    emitByte(compiler, OP_GET_THIS);
+    emitByte(compiler, OP_RETURN_VALUE);
+    return;
+  }
+
+  emitByte(compiler, OP_RETURN);
 }
 
 ConstantIndex makeConstant(Compiler *compiler, Value v) {
   ConstantIndex cidx;
   // Avoid compiler complaining.
-  cidx.isLong = false;
+  cidx.isWide = false;
 
   int idx = addConstant(compiler->currentChunk, v);
 
   if (idx <= UINT8_MAX) {
     cidx.bytes[0] = idx;
-    cidx.isLong = false;
+    cidx.isWide = false;
     return cidx;
   }
 
-  if (idx > 0x00FFFFFE) {
+  if (idx > WIDE_OPERAND_MAX) {
     error(compiler->parser, "Too many constants in one chunk.");
     return cidx;
   }
 
-  // Use OP_CONSTANT_LONG and write the 24-bit (3 bytes) applying AND bit by bit
-  // for the relevant part and get rid of the rest
+  // Use OP_WIDE and write the 24-bit (3 bytes) applying AND bit by bit for the
+  // relevant part and get rid of the rest
   cidx.bytes[0] = (idx & 0xff0000) >> 16;
   cidx.bytes[1] = (idx & 0x00ff00) >> 8;
   cidx.bytes[2] = (idx & 0x0000ff);
-  cidx.isLong = true;
+  cidx.isWide = true;
 
   return cidx;
 }
 
+// Emits a property instruction (see OPERAND_PROPERTY): the name constant, then
+// a new inline cache slot and, for invocations, the argument count.
+static void emitProperty(Compiler *compiler, OpCode code, ConstantIndex name,
+                         uint8_t argCount) {
+  Chunk *chunk = compiler->currentChunk;
+  if (chunk->cacheCount > UINT16_MAX) {
+    error(compiler->parser, "Too many property accesses in one function.");
+    return;
+  }
+
+  int cache = chunk->cacheCount++;
+  uint8_t high = (cache >> 8) & 0xff;
+  uint8_t low = cache & 0xff;
+  bool invoke = code == OP_INVOKE || code == OP_SUPER_INVOKE;
+
+  if (name.isWide) {
+    emitCode(compiler,
+             (uint8_t[]){OP_WIDE, code, name.bytes[0], name.bytes[1],
+                         name.bytes[2], high, low, argCount},
+             invoke ? 8 : 7);
+    return;
+  }
+
+  emitCode(compiler, (uint8_t[]){code, name.bytes[0], high, low, argCount},
+           invoke ? 5 : 4);
+}
+
 static void emitConstant(Compiler *compiler, Value v) {
   ConstantIndex cidx = makeConstant(compiler, v);
-  emitConstantIndex(compiler, cidx, OP_CONSTANT, OP_CONSTANT_LONG);
+  emitConstantIndex(compiler, cidx, OP_CONSTANT);
+}
+
+// Emit an integer literal, avoiding the constant pool for small integers, that
+// are encoded directly in the bytecode.
+static void emitInteger(Compiler *compiler, int64_t n) {
+  if (n < SMALLINT_WIDE_MIN || n > SMALLINT_WIDE_MAX) {
+    emitConstant(compiler, INT_VAL(n));
+    return;
+  }
+
+  if (n == 0) {
+    emitByte(compiler, OP_PUSH_ZERO);
+  } else if (n == 1) {
+    emitByte(compiler, OP_PUSH_ONE);
+  } else if (n >= SMALLINT_MIN && n <= SMALLINT_MAX) {
+    emitBytes(compiler, OP_PUSH_SMALLINT, (uint8_t)n);
+  } else if (compiler->currentChunk->constants.count > UINT8_MAX) {
+    // The constant would need a wide index anyway, so the wide immediate has
+    // the same size and doesn't take a slot in the constant pool.
+    emitCode(compiler,
+             (uint8_t[]){OP_WIDE, OP_PUSH_SMALLINT, (n >> 16) & 0xff,
+                         (n >> 8) & 0xff, n & 0xff},
+             5);
+  } else {
+    emitConstant(compiler, INT_VAL(n));
+  }
 }
 
 // Parses the expression with given precedence or higher.
@@ -339,6 +531,40 @@ static void emitConstant(Compiler *compiler, Value v) {
 //     - grouping() -> expression()
 //     - number() -> Consume byte.
 //
+// Compiles the postfix and infix operators following an operand that's
+// already compiled, as long as the precedence allows it.
+static void parseOperators(Compiler *compiler, Precedence precedence,
+                           bool canAssign) {
+  // Process any postfix operations immediately
+  while (true) {
+    ParseRule *rule = getRule(compiler->parser->curr.type);
+    if (rule->postfix == NULL || precedence > rule->precedence)
+      break;
+    advance(compiler);
+    rule->postfix(compiler, canAssign);
+  }
+
+  // If there is some infix rule, the prefix above might be an operand of it.
+  // Go ahead until, and only if, the precedence allows it.
+  while (precedence <= getRule(compiler->parser->curr.type)->precedence) {
+    advance(compiler);
+    ParseRule *r = getRule(compiler->parser->prev.type);
+
+#ifdef DEBUG_COMPILE_EXECUTION
+    printf("%sinfixRule for %s has precedence = %s\n",
+           strfromnchars(DEBUG_COMPILE_INDENT_CHAR, debugIndent),
+           tokenTypeToString(compiler->parser->prev.type),
+           precedenceTypeToString(r->precedence));
+#endif
+
+    r->infix(compiler, canAssign);
+  }
+
+  if (canAssign && match(compiler, TOKEN_EQUAL)) {
+    error(compiler->parser, "Invalid assignment target.");
+  }
+}
+
 static void parsePrecedence(Compiler *compiler, Precedence precedence) {
 #ifdef DEBUG_COMPILE_EXECUTION
   debugIndent++;
@@ -367,35 +593,7 @@ static void parsePrecedence(Compiler *compiler, Precedence precedence) {
   // of a low-precedence expression.
   bool canAssign = precedence <= PREC_ASSIGNMENT;
   rule->prefix(compiler, canAssign);
-
-  // Process any postfix operations immediately
-  while (true) {
-    rule = getRule(compiler->parser->curr.type);
-    if (rule->postfix == NULL || precedence > rule->precedence)
-      break;
-    advance(compiler);
-    rule->postfix(compiler, canAssign);
-  }
-
-  // If there is some infix rule, the prefix above might be an operand of it.
-  // Go ahead until, and only if, the precedence allows it.
-  while (precedence <= getRule(compiler->parser->curr.type)->precedence) {
-    advance(compiler);
-    ParseRule *r = getRule(compiler->parser->prev.type);
-
-#ifdef DEBUG_COMPILE_EXECUTION
-    printf("%sinfixRule for %s has precedence = %s\n",
-           strfromnchars(DEBUG_COMPILE_INDENT_CHAR, debugIndent),
-           tokenTypeToString(compiler->parser->prev.type),
-           precedenceTypeToString(r->precedence));
-#endif
-
-    r->infix(compiler, canAssign);
-  }
-
-  if (canAssign && match(compiler, TOKEN_EQUAL)) {
-    error(compiler->parser, "Invalid assignment target.");
-  }
+  parseOperators(compiler, precedence, canAssign);
 
 #ifdef DEBUG_COMPILE_EXECUTION
   printf("%s end parsePrecedence()\n",
@@ -416,49 +614,258 @@ bool identifiersEqual(Token *a, Token *b) {
           (memcmp(a->start, b->start, a->length) == 0));
 }
 
-static int resolveLocal(Compiler *compiler, Token *name) {
-  // Loop backward passing all the scope bottom up to resolve the first matching
-  // one.
-  for (int i = compiler->localCount - 1; i >= 0; i--) {
-    Local *local = &compiler->locals[i];
-    if (identifiersEqual(name, &local->name)) {
-      // When we resolve to a local variable we check the scope depth to see if
-      // it's fully defined (usage in `var a = a+3;`).
-      if (local->depth == -1) {
-        error(compiler->parser, "Can't read variable in it's own initializer.");
-      }
+// Turns the unchecked instructions of the loop back into checked ones, as
+// something in its body could break the bounds guarantee (see BoundedLoop).
+static void invalidateLoop(BoundedLoop *loop) {
+  if (!loop->valid)
+    return;
+
+  loop->valid = false;
+  for (int i = 0; i < loop->uncheckedCount; i++) {
+    uint8_t *op = &loop->chunk->code[loop->unchecked[i]];
+    *op = *op == OP_INDEX_GET_UNCHECKED ? OP_INDEX_GET : OP_INDEX_SET;
+  }
+}
+
+// Invalidates the loops of the function depending on the local slot, or all of
+// them if slot is -1 (e.g. a call could pop from any array).
+static void invalidateLoops(FunctionState *state, int slot) {
+  for (BoundedLoop *loop = state->boundedLoop; loop != NULL;
+       loop = loop->enclosing) {
+    if (slot == -1 || loop->variable == slot || loop->array == slot)
+      invalidateLoop(loop);
+  }
+}
+
+// Returns the loop proving array[variable] in bounds, if any.
+static BoundedLoop *findBoundedLoop(FunctionState *state, int array,
+                                    int variable) {
+  for (BoundedLoop *loop = state->boundedLoop; loop != NULL;
+       loop = loop->enclosing) {
+    if (loop->valid && loop->array == array && loop->variable == variable)
+      return loop;
+  }
+
+  return NULL;
+}
+
+// Builtins compiled to their own instruction when called by name, instead of
+// loading the native function and calling it. Some aren't pure (push(),
+// pop() and delete() change their argument), they can be emitted inline
+// because their global names can't be rebound: natives can't be assigned or
+// redefined, so a call by name reaches the builtin unless a local shadows it.
+typedef struct {
+  const char *name;
+  int arity;
+  OpCode op;
+} Intrinsic;
+
+static const Intrinsic intrinsics[] = {
+    {"delete", 2, OP_MAP_DELETE},
+    {"floor", 1, OP_FLOOR},
+    {"has", 2, OP_MAP_HAS},
+    {"len", 1, OP_LEN},
+    {"pop", 1, OP_ARRAY_POP},
+    {"push", 2, OP_ARRAY_PUSH},
+    {"sqrt", 1, OP_SQRT},
+};
+
+static const Intrinsic *findIntrinsic(Token *name) {
+  for (size_t i = 0; i < sizeof(intrinsics) / sizeof(intrinsics[0]); i++) {
+    if ((int)strlen(intrinsics[i].name) == name->length &&
+        memcmp(intrinsics[i].name, name->start, name->length) == 0)
+      return &intrinsics[i];
+  }
+
+  return NULL;
+}
+
+// Sources of pipelines, see pipeline(). Reserved like intrinsics.
+static bool isPipeSource(Token *name) {
+  return (name->length == 5 && memcmp(name->start, "range", 5) == 0) ||
+         (name->length == 4 && memcmp(name->start, "each", 4) == 0);
+}
+
+static ObjString *internName(Compiler *compiler, Token *name) {
+  return copyString(compiler->memoryManager, name->start, name->length);
+}
+
+// Index of the innermost variable with the name in a table of
+// FunctionState, -1 if none.
+static int lookupName(Table *names, ObjString *name) {
+  Value index;
+  return tableGet(names, name, &index) ? (int)AS_INT(index) : -1;
+}
+
+// Makes a variable the innermost one of its name, returning the index of the
+// one it shadows.
+static int pushName(Table *names, ObjString *name, int index) {
+  int shadowed = lookupName(names, name);
+  tableSet(names, name, INT_VAL(index));
+  return shadowed;
+}
+
+// Puts back the variable shadowed by the one going out of scope.
+static void popName(Table *names, ObjString *name, int shadowed) {
+  if (shadowed == -1) {
+    tableDelete(names, name);
+  } else {
+    tableSet(names, name, INT_VAL(shadowed));
+  }
+}
+
+static void popLocal(FunctionState *state) {
+  Local *local = &state->locals[--state->localCount];
+  popName(&state->localNames, local->id, local->shadowed);
+}
+
+static void popKnownConstant(FunctionState *state) {
+  KnownConstant *constant = &state->knownConstants[--state->knownConstantCount];
+  popName(&state->constantNames, constant->id, constant->shadowed);
+}
+
+static int resolveLocal(Compiler *compiler, FunctionState *state,
+                        ObjString *name) {
+  // The innermost one, shadowing the others.
+  int i = lookupName(&state->localNames, name);
+
+  // When we resolve to a local variable we check the scope depth to see if
+  // it's fully defined (usage in `var a = a+3;`).
+  if (i != -1 && state->locals[i].depth == -1) {
+    error(compiler->parser, "Can't read variable in it's own initializer.");
+  }
+  return i;
+}
+
+// Adds the variable to the upvalues of the function, unless it's already there,
+// returning its index.
+static int addUpvalue(Compiler *compiler, FunctionState *state, uint8_t kind,
+                      uint8_t index, bool isConst) {
+  for (int i = 0; i < state->upvalueCount; i++) {
+    Capture *capture = &state->upvalues[i].capture;
+    if (capture->kind == kind && capture->index == index)
       return i;
-    }
   }
 
+  if (state->upvalueCount == UINT8_COUNT) {
+    error(compiler->parser, "Too many closure variables in function.");
+    return 0;
+  }
+
+  Upvalue *upvalue = &state->upvalues[state->upvalueCount];
+  upvalue->capture.kind = kind;
+  upvalue->capture.index = index;
+  upvalue->isConst = isConst;
+  return state->upvalueCount++;
+}
+
+// Resolves a variable of the enclosing functions, adding it to the upvalues of
+// every function in between so that closures are flat (-1 if not found ->
+// global).
+//
+// This is where escape analysis happens: only the mutable locals captured
+// here are marked as captured, all the others stay on the stack for their
+// whole life. Constants are copied by value as they can't change.
+static int resolveUpvalue(Compiler *compiler, FunctionState *state,
+                          ObjString *name) {
+  if (state->enclosing == NULL)
+    return -1;
+
+  int local = resolveLocal(compiler, state->enclosing, name);
+  if (local != -1) {
+    Local *captured = &state->enclosing->locals[local];
+    if (captured->isConst)
+      return addUpvalue(compiler, state, CAPTURE_LOCAL_VALUE, local, true);
+
+    captured->isCaptured = true;
+    // The closure could assign it at any time.
+    invalidateLoops(state->enclosing, local);
+    return addUpvalue(compiler, state, CAPTURE_LOCAL, local, false);
+  }
+
+  int upvalue = resolveUpvalue(compiler, state->enclosing, name);
+  if (upvalue != -1)
+    return addUpvalue(compiler, state, CAPTURE_UPVALUE, upvalue,
+                      state->enclosing->upvalues[upvalue].isConst);
+
   return -1;
 }
 
+// Looks up a global constant known at compile time, declared by the source
+// being compiled or by a previous one.
+static bool getKnownGlobal(Compiler *compiler, ObjString *name, Value *value) {
+  return tableGet(&compiler->newKnownGlobals, name, value) ||
+         tableGet(&compiler->knownGlobals, name, value);
+}
+
+// Resolves a constant whose value is known at compile time (see
+// KnownConstant), local to the function being compiled or an enclosing one, or
+// global. Returns false if there's no such constant, or if a variable with
+// the same name shadows it.
+static bool resolveKnownConstant(Compiler *compiler, ObjString *name,
+                                 Value *value) {
+  for (FunctionState *state = compiler->current; state != NULL;
+       state = state->enclosing) {
+    int index = lookupName(&state->localNames, name);
+    Local *local = index == -1 ? NULL : &state->locals[index];
+    // A local still being initialized is in the innermost scope.
+    int localDepth = local == NULL        ? -1
+                     : local->depth == -1 ? state->scopeDepth
+                                          : local->depth;
+
+    index = lookupName(&state->constantNames, name);
+    if (index != -1) {
+      KnownConstant *constant = &state->knownConstants[index];
+      if (local != NULL && constant->depth <= localDepth)
+        return false;
+      *value = constant->value;
+      return true;
+    }
+
+    if (local != NULL)
+      return false;
+  }
+
+  return getKnownGlobal(compiler, name, value);
+}
+
 // Records the existence of temporary local variable in the compiler.
 static void addLocal(Compiler *compiler, Token name, bool isConstant) {
-  if (compiler->localCount >= UINT8_COUNT) {
+  if (compiler->current->localCount >= UINT8_COUNT) {
     error(compiler->parser, "Too many local variables in function.");
     return;
   }
 
-  Local *local = &compiler->locals[compiler->localCount++];
+  FunctionState *current = compiler->current;
+  Local *local = &current->locals[current->localCount];
   local->name = name;
+  local->id = internName(compiler, &name);
+  local->shadowed =
+      pushName(&current->localNames, local->id, current->localCount++);
   // We are initializing the variable, and we need to prevent its usage in the
   // expression, see defineVariable() comment in the if statement for details.
   local->depth = -1;
   local->isConst = isConstant;
+  local->isCaptured = false;
 }
 
 // Declare: when a variable is added to the scope (define is when it's ready to
 // use).
 static void declareVariable(Compiler *compiler, bool isConstant) {
+  Token *name = &compiler->parser->prev;
+
   // Global variable, just return as it's late bound and present in global
-  // table.
-  if (compiler->scopeDepth == 0)
+  // table. A known constant can't be redefined though, its value has been
+  // compiled in place of its uses.
+  ObjString *id = internName(compiler, name);
+  if (compiler->current->scopeDepth == 0) {
+    Value value;
+    if (getKnownGlobal(compiler, id, &value))
+      error(compiler->parser, "Already a constant with this name.");
     return;
+  }
 
   // Local variable.
-  Token *name = &compiler->parser->prev;
 
   // Not allowing redeclaring the same variable name in the same scope.
   // e.g.
@@ -467,18 +874,17 @@ static void declareVariable(Compiler *compiler, bool isConstant) {
   //  var a = 2;
   // }
   //
-  // We start from the end as in the compiler the last scope is on top, so we
-  // can iterate backward and stop when reached the end on our scope.
-  for (int i = compiler->localCount - 1; i >= 0; i--) {
-    Local *local = &compiler->locals[i];
-    if (local->depth != -1 && local->depth < compiler->scopeDepth) {
-      break;
-    }
-
-    if (identifiersEqual(name, &local->name)) {
-      error(compiler->parser,
-            "Already a variable with this name in this scope.");
-    }
+  // Only the innermost variable of the name can be in this scope, the ones it
+  // shadows are further out.
+  FunctionState *current = compiler->current;
+  int local = lookupName(&current->localNames, id);
+  int constant = lookupName(&current->constantNames, id);
+  if ((local != -1 && (current->locals[local].depth == -1 ||
+                       current->locals[local].depth >= current->scopeDepth)) ||
+      (constant != -1 &&
+       current->knownConstants[constant].depth >= current->scopeDepth)) {
+    error(compiler->parser,
+          "Already a variable with this name in this scope.");
   }
 
   addLocal(compiler, *name, isConstant);
@@ -498,43 +904,73 @@ ConstantIndex parseVariable(Compiler *compiler, const char *message,
 
   // If it's a local variable we don't really care as it will remain on the
   // stack, so the index won't be used to lookup in global table.
-  if (compiler->scopeDepth > 0) {
-    ConstantIndex res = {.isLong = false, {0, 0, 0}};
+  if (compiler->current->scopeDepth > 0) {
+    ConstantIndex res = {.isWide = false, {0, 0, 0}};
     return res;
   }
 
+  // Calls to intrinsics and pipelines are compiled without looking up the
+  // global.
+  if (findIntrinsic(&compiler->parser->prev) != NULL ||
+      isPipeSource(&compiler->parser->prev)) {
+    error(compiler->parser, "Can't redefine a builtin function.");
+  }
+
   return identifierConstant(compiler, &compiler->parser->prev);
 }
 
 // See description comment in defineVariable() on why we need this.
 static void markInitialized(Compiler *compiler) {
-  compiler->locals[compiler->localCount - 1].depth = compiler->scopeDepth;
+  FunctionState *current = compiler->current;
+  current->locals[current->localCount - 1].depth = current->scopeDepth;
 }
 
 static void endCompiler(Compiler *compiler) {
   emitReturn(compiler);
 
+  if (!compiler->parser->hadError) {
+    ObjFunction *function = compiler->current->function;
+    optimizeChunk(compiler->currentChunk,
+                  function != NULL ? function->arity : 0,
+                  compiler->optimizationLevel);
+  }
+
 #ifdef DEBUG_PRINT_CODE
   if (!compiler->parser->hadError) {
-    disassembleChunk(compiler->currentChunk, "code");
+    ObjFunction *function = compiler->current->function;
+    disassembleChunk(compiler->currentChunk,
+                     function != NULL ? function->name->str : "code");
   }
 #endif
 }
 
 // Increment the current scope depth of the compiler.
-static void beginScope(Compiler *compiler) { compiler->scopeDepth++; }
+static void beginScope(Compiler *compiler) { compiler->current->scopeDepth++; }
 
 // Decrement the current scope depth of the compiler and empty the stack from
 // the remaining local variables.
 static void endScope(Compiler *compiler) {
-  compiler->scopeDepth--;
+  compiler->current->scopeDepth--;
 
   // TODO: Implement a OP_POP_N operator that pops N elements for performance.
-  while (compiler->localCount > 0 &&
-         compiler->locals[compiler->localCount - 1].depth >
-             compiler->scopeDepth) {
-    emitBytes(compiler, 1, OP_POP);
-    compiler->localCount--;
+  while (compiler->current->localCount > 0 &&
+         compiler->current->locals[compiler->current->localCount - 1].depth >
+             compiler->current->scopeDepth) {
+    // Captured locals outlive the scope, moved to the heap.
+    if (compiler->current->locals[compiler->current->localCount - 1]
+            .isCaptured) {
+      emitByte(compiler, OP_CLOSE_UPVALUE);
+    } else {
+      emitByte(compiler, OP_POP);
+    }
+    popLocal(compiler->current);
+  }
+
+  while (compiler->current->knownConstantCount > 0 &&
+         compiler->current
+                 ->knownConstants[compiler->current->knownConstantCount - 1]
+                 .depth > compiler->current->scopeDepth) {
+    popKnownConstant(compiler->current);
   }
 }
 
@@ -588,49 +1024,49 @@ static void binary(Compiler *compiler, bool canAssign) {
 
   switch (t) {
   case TOKEN_PLUS:
-    emitBytes(compiler, 1, OP_ADD);
+    emitByte(compiler, OP_ADD);
     break;
   case TOKEN_MINUS:
-    emitBytes(compiler, 1, OP_SUBTRACT);
+    emitByte(compiler, OP_SUBTRACT);
     break;
   case TOKEN_STAR:
-    emitBytes(compiler, 1, OP_MULTIPLY);
+    emitByte(compiler, OP_MULTIPLY);
     break;
   case TOKEN_SLASH:
-    emitBytes(compiler, 1, OP_DIVIDE);
+    emitByte(compiler, OP_DIVIDE);
     break;
   case TOKEN_EQUAL_EQUAL:
-    emitBytes(compiler, 1, OP_EQUAL);
+    emitByte(compiler, OP_EQUAL);
     break;
   case TOKEN_GREATER:
-    emitBytes(compiler, 1, OP_GREATER);
+    emitByte(compiler, OP_GREATER);
     break;
   case TOKEN_LESS:
-    emitBytes(compiler, 1, OP_LESS);
+    emitByte(compiler, OP_LESS);
     break;
   case TOKEN_BANG_EQUAL:
-    emitBytes(compiler, 1, OP_NOT_EQUAL);
+    emitByte(compiler, OP_NOT_EQUAL);
     break;
   case TOKEN_GREATER_EQUAL:
-    emitBytes(compiler, 1, OP_GREATER_EQUAL);
+    emitByte(compiler, OP_GREATER_EQUAL);
     break;
   case TOKEN_LESS_EQUAL:
-    emitBytes(compiler, 1, OP_LESS_EQUAL);
+    emitByte(compiler, OP_LESS_EQUAL);
     break;
   case TOKEN_GREATER_GREATER:
-    emitBytes(compiler, 1, OP_BITWISE_SHIFT_RIGHT);
+    emitByte(compiler, OP_BITWISE_SHIFT_RIGHT);
     break;
   case TOKEN_LESS_LESS:
-    emitBytes(compiler, 1, OP_BITWISE_SHIFT_LEFT);
+    emitByte(compiler, OP_BITWISE_SHIFT_LEFT);
     break;
   case TOKEN_AMPERSEND:
-    emitBytes(compiler, 1, OP_BITWISE_AND);
+    emitByte(compiler, OP_BITWISE_AND);
     break;
   case TOKEN_PIPE:
-    emitBytes(compiler, 1, OP_BITWISE_OR);
+    emitByte(compiler, OP_BITWISE_OR);
     break;
   case TOKEN_CARET:
-    emitBytes(compiler, 1, OP_BITWISE_XOR);
+    emitByte(compiler, OP_BITWISE_XOR);
     break;
 
   // Unreachable case
@@ -639,6 +1075,47 @@ static void binary(Compiler *compiler, bool canAssign) {
   }
 }
 
+// a and b: b is evaluated only if a is truthy. In a condition a branches to
+// where the condition is false, otherwise the value is a if it's falsey, b if
+// not.
+static void and_(Compiler *compiler, bool canAssign) {
+  UNUSED(canAssign);
+
+  Condition *condition = compiler->condition;
+  if (condition != NULL) {
+    addJump(compiler, condition->falseJumps, &condition->falseCount,
+            emitBranch(compiler, false));
+    parsePrecedence(compiler, (Precedence)(PREC_AND + 1));
+    return;
+  }
+
+  int endJump = emitJump(compiler, OP_JUMP_IF_FALSE);
+  emitByte(compiler, OP_POP);
+  parsePrecedence(compiler, (Precedence)(PREC_AND + 1));
+  patchJump(compiler, endJump);
+}
+
+// a or b: b is evaluated only if a is falsey. In a condition a branches to
+// where the condition is true, and the operands of `and` before it that were
+// false go on with b. Otherwise the value is a if it's truthy, b if not.
+static void or_(Compiler *compiler, bool canAssign) {
+  UNUSED(canAssign);
+
+  Condition *condition = compiler->condition;
+  if (condition != NULL) {
+    addJump(compiler, condition->trueJumps, &condition->trueCount,
+            emitBranch(compiler, true));
+    patchJumps(compiler, condition->falseJumps, &condition->falseCount);
+    parsePrecedence(compiler, (Precedence)(PREC_OR + 1));
+    return;
+  }
+
+  int endJump = emitJump(compiler, OP_JUMP_IF_TRUE);
+  emitByte(compiler, OP_POP);
+  parsePrecedence(compiler, (Precedence)(PREC_OR + 1));
+  patchJump(compiler, endJump);
+}
+
 static void expression(Compiler *compiler) {
 #ifdef DEBUG_COMPILE_EXECUTION
   debugIndent++;
@@ -647,7 +1124,12 @@ static void expression(Compiler *compiler) {
 #endif
 
   // This way we parse all the possible expression, being ASSIGNMENT the lowest.
+  // A nested expression (e.g. in parentheses or an argument) inside a
+  // condition produces a value, see condition().
+  Condition *condition = compiler->condition;
+  compiler->condition = NULL;
   parsePrecedence(compiler, PREC_ASSIGNMENT);
+  compiler->condition = condition;
 
 #ifdef DEBUG_COMPILE_EXECUTION
   printf("%send expression()\n",
@@ -664,6 +1146,14 @@ static void block(Compiler *compiler) {
   consume(compiler, TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
+// Name of a global variable, from its index in the chunk's constants table.
+static ObjString *globalName(Compiler *compiler, ConstantIndex variable) {
+  int index = variable.isWide ? (variable.bytes[0] << 16) |
+                                    (variable.bytes[1] << 8) | variable.bytes[2]
+                              : variable.bytes[0];
+  return AS_STRING(compiler->currentChunk->constants.values[index]);
+}
+
 // Define: when a variable is available and ready to use, after it's been
 // declared.
 //
@@ -688,7 +1178,7 @@ static void defineVariable(Compiler *compiler, ConstantIndex variable,
   //
   // Bytecode: [OP_CONSTANT(1), OP_CONSTANT(2), OP_ADD, OP_CONSTANT(4)]
   // Stack: [1], [1, 2], [3 (var a)], [3 (var a), 4 (var b)]
-  if (compiler->scopeDepth > 0) {
+  if (compiler->current->scopeDepth > 0) {
     // If we're declaring a local variable, we could meet a situation where it's
     // used in the expression, but referring to the one of the previous scope.
     // This is not correct, so we need to prevent it, marking it temporarily
@@ -700,20 +1190,134 @@ static void defineVariable(Compiler *compiler, ConstantIndex variable,
     return;
   }
 
-  emitConstantIndex(compiler, variable, OP_DEFINE_GLOBAL,
-                    OP_DEFINE_GLOBAL_LONG);
+  emitConstantIndex(compiler, variable, OP_DEFINE_GLOBAL);
 
   // If it's a constant, we should also add it there for runtime check.
   // TODO: Is there maybe a better/more efficient way?
   if (isConstant) {
-    Chunk *chunk = compiler->currentChunk;
-    int index = variable.isLong
-                    ? (variable.bytes[0] << 16) | (variable.bytes[1] << 8) |
-                          variable.bytes[2]
-                    : variable.bytes[0];
-    ObjString *name = AS_STRING(chunk->constants.values[index]);
     // Just store a dummy nil value to keep it.
-    tableSet(&compiler->memoryManager->constants, name, NIL_VAL);
+    tableSet(&compiler->newConstants, globalName(compiler, variable), NIL_VAL);
+  }
+}
+
+// Emits the instruction pushing a value known at compile time.
+static void emitValue(Compiler *compiler, Value value) {
+  if (IS_NIL(value)) {
+    emitByte(compiler, OP_NIL);
+  } else if (IS_BOOL(value)) {
+    emitByte(compiler, AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+  } else if (IS_INT(value)) {
+    emitInteger(compiler, AS_INT(value));
+  } else {
+    emitConstant(compiler, value);
+  }
+}
+
+// Parses an expression. If it's a literal (a number, possibly negative, a
+// string, true, false or nil) or a constant known at compile time, its value
+// is returned in *value without emitting anything. Any other expression is
+// compiled, returning false.
+static bool constantExpression(Compiler *compiler, Value *value) {
+  Parser *parser = compiler->parser;
+
+  bool negate = match(compiler, TOKEN_MINUS);
+  if (negate && !check(compiler, TOKEN_NUMBER)) {
+    unary(compiler, true);
+    parseOperators(compiler, PREC_ASSIGNMENT, true);
+    return false;
+  }
+
+  switch (parser->curr.type) {
+  case TOKEN_NUMBER:
+  case TOKEN_STRING:
+  case TOKEN_TRUE:
+  case TOKEN_FALSE:
+  case TOKEN_NIL:
+  case TOKEN_IDENTIFIER:
+    advance(compiler);
+    break;
+  default:
+    expression(compiler);
+    return false;
+  }
+
+  // The literal starts a larger expression, e.g. `case 1 + n:`.
+  Token *token = &parser->prev;
+  TokenType next = parser->curr.type;
+  bool ends = next == TOKEN_SEMICOLON || next == TOKEN_COLON ||
+              next == TOKEN_COMMA || next == TOKEN_RIGHT_PAREN;
+  if (!ends || (token->type == TOKEN_IDENTIFIER &&
+                !resolveKnownConstant(compiler, internName(compiler, token),
+                                      value))) {
+    getRule(token->type)->prefix(compiler, true);
+    if (negate)
+      emitByte(compiler, OP_NEGATE);
+    parseOperators(compiler, PREC_ASSIGNMENT, true);
+    return false;
+  }
+
+  switch (token->type) {
+  case TOKEN_NUMBER:
+    *value = numberValue(token);
+    if (negate)
+      *value = IS_INT(*value) ? INT_VAL(-AS_INT(*value))
+                              : NUMBER_VAL(-AS_NUMBER(*value));
+    break;
+  case TOKEN_STRING:
+    *value = OBJ_VAL(copyString(compiler->memoryManager, token->start + 1,
+                                token->length - 2));
+    break;
+  case TOKEN_NIL:
+    *value = NIL_VAL;
+    break;
+  case TOKEN_IDENTIFIER:
+    // Resolved above.
+    break;
+  default:
+    *value = BOOL_VAL(token->type == TOKEN_TRUE);
+    break;
+  }
+  return true;
+}
+
+// Defines a constant whose initializer is a value known at compile time (see
+// KnownConstant). A local one is only kept in the compiler, in place of the
+// local declared for it. A global one is defined at runtime only if code
+// compiled before it reads it by name.
+static void defineKnownConstant(Compiler *compiler, ConstantIndex variable,
+                                Value value) {
+  FunctionState *current = compiler->current;
+  if (current->scopeDepth > 0) {
+    if (current->knownConstantCount == UINT8_COUNT) {
+      error(compiler->parser, "Too many local constants in function.");
+      return;
+    }
+    Local *local = &current->locals[current->localCount - 1];
+    KnownConstant *constant =
+        &current->knownConstants[current->knownConstantCount];
+    constant->name = local->name;
+    constant->id = local->id;
+    constant->shadowed = pushName(&current->constantNames, constant->id,
+                                  current->knownConstantCount++);
+    constant->depth = current->scopeDepth;
+    constant->value = value;
+    popLocal(current);
+    return;
+  }
+
+  // Redefining a known constant has been reported by declareVariable(), the
+  // value compiled in place of its uses stays the first one.
+  ObjString *name = globalName(compiler, variable);
+  Value previous;
+  if (getKnownGlobal(compiler, name, &previous))
+    return;
+  tableSet(&compiler->newKnownGlobals, name, value);
+  tableSet(&compiler->newConstants, name, NIL_VAL);
+
+  Value unused;
+  if (tableGet(&compiler->globalNames, name, &unused)) {
+    emitValue(compiler, value);
+    emitConstantIndex(compiler, variable, OP_DEFINE_GLOBAL);
   }
 }
 
@@ -729,7 +1333,15 @@ static void varDeclaration(Compiler *compiler, bool isConstant) {
   ConstantIndex global =
       parseVariable(compiler, "Expect variable name.", isConstant);
 
-  if (match(compiler, TOKEN_EQUAL)) {
+  Value value;
+  if (isConstant && match(compiler, TOKEN_EQUAL)) {
+    if (constantExpression(compiler, &value)) {
+      consume(compiler, TOKEN_SEMICOLON,
+              "Expect ';' after variable declaration.");
+      defineKnownConstant(compiler, global, value);
+      return;
+    }
+  } else if (match(compiler, TOKEN_EQUAL)) {
     // Get the variable value.
     expression(compiler);
   } else if (isConstant) {
@@ -738,7 +1350,7 @@ static void varDeclaration(Compiler *compiler, bool isConstant) {
   } else {
     // Otherwise empty initialization, set nil.
     // Syntactic sugar for `var a = nil`;
-    emitBytes(compiler, 1, OP_NIL);
+    emitByte(compiler, OP_NIL);
   }
 
   consume(compiler, TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
@@ -746,40 +1358,715 @@ static void varDeclaration(Compiler *compiler, bool isConstant) {
   defineVariable(compiler, global, isConstant);
 }
 
-static void expressionStatement(Compiler *compiler) {
-  expression(compiler);
-  consume(compiler, TOKEN_SEMICOLON, "Expect ';' after value.");
-  emitBytes(compiler, 1, OP_POP);
+// Compiles the parameters and the body of a function, named after the previous
+// token, into a new function object with its own chunk. The function is then
+// loaded as a constant of the enclosing chunk, or wrapped in a closure by
+// OP_CLOSURE if it uses variables of the enclosing functions.
+static void function(Compiler *compiler, FunctionType type) {
+  ObjFunction *function = newFunction(compiler->memoryManager);
+  function->name = copyString(compiler->memoryManager,
+                              compiler->parser->prev.start,
+                              compiler->parser->prev.length);
+
+  FunctionState state;
+  initFunctionState(&state, compiler->current, type, function);
+  compiler->current = &state;
+  Chunk *enclosingChunk = compiler->currentChunk;
+  compiler->currentChunk = &function->chunk;
+
+  // The parameters are the first locals, the VM leaves the arguments there.
+  beginScope(compiler);
+  consume(compiler, TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+  if (!check(compiler, TOKEN_RIGHT_PAREN)) {
+    do {
+      function->arity++;
+      if (function->arity > UINT8_MAX) {
+        errorAtCurrent(compiler->parser,
+                       "Can't have more than 255 parameters.");
+      }
+      ConstantIndex param =
+          parseVariable(compiler, "Expect parameter name.", false);
+      defineVariable(compiler, param, false);
+    } while (match(compiler, TOKEN_COMMA));
+  }
+  consume(compiler, TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+  consume(compiler, TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+  block(compiler);
+
+  // No need to end the scope, returning discards the whole stack window (and
+  // closes its upvalues).
+  endCompiler(compiler);
+
+  freeFunctionState(&state);
+  compiler->current = state.enclosing;
+  compiler->currentChunk = enclosingChunk;
+
+  if (state.upvalueCount == 0) {
+    emitConstant(compiler, OBJ_VAL(function));
+    return;
+  }
+
+  function->upvalueCount = state.upvalueCount;
+  function->captures = ALLOCATE(Capture, state.upvalueCount);
+  for (int i = 0; i < state.upvalueCount; i++) {
+    function->captures[i] = state.upvalues[i].capture;
+  }
+  emitConstantIndex(compiler, makeConstant(compiler, OBJ_VAL(function)),
+                    OP_CLOSURE);
+}
+
+static void funDeclaration(Compiler *compiler) {
+  ConstantIndex global =
+      parseVariable(compiler, "Expect function name.", false);
+  // A local function can refer to itself, it's initialized before its body.
+  if (compiler->current->scopeDepth > 0)
+    markInitialized(compiler);
+  function(compiler, TYPE_FUNCTION);
+  defineVariable(compiler, global, false);
+}
+
+static void method(Compiler *compiler) {
+  consume(compiler, TOKEN_IDENTIFIER, "Expect method name.");
+  Token *name = &compiler->parser->prev;
+  ConstantIndex constant = identifierConstant(compiler, name);
+
+  FunctionType type = TYPE_METHOD;
+  if (name->length == 4 && memcmp(name->start, "init", 4) == 0)
+    type = TYPE_INITIALIZER;
+  function(compiler, type);
+  emitConstantIndex(compiler, constant, OP_METHOD);
+}
+
+// class Name < Superclass { method() { ... } ... }
+//
+// The class is created and bound to its name, then the methods are added to
+// it one by one while it sits on the stack. Inherited methods are copied into
+// the class before its own ones, that can override them. The superclass is
+// kept in a constant hidden local named "super" around the class body, so the
+// methods capture it like any other constant.
+static void classDeclaration(Compiler *compiler) {
+  consume(compiler, TOKEN_IDENTIFIER, "Expect class name.");
+  Token className = compiler->parser->prev;
+  ConstantIndex nameConstant = identifierConstant(compiler, &className);
+  if (compiler->current->scopeDepth == 0 &&
+      (findIntrinsic(&className) != NULL || isPipeSource(&className))) {
+    error(compiler->parser, "Can't redefine a builtin function.");
+  }
+  declareVariable(compiler, false);
+
+  emitConstantIndex(compiler, nameConstant, OP_CLASS);
+  defineVariable(compiler, nameConstant, false);
+
+  ClassState classState;
+  classState.enclosing = compiler->currentClass;
+  classState.hasSuperclass = false;
+  compiler->currentClass = &classState;
+
+  if (match(compiler, TOKEN_LESS)) {
+    consume(compiler, TOKEN_IDENTIFIER, "Expect superclass name.");
+    variable(compiler, false);
+    if (identifiersEqual(&className, &compiler->parser->prev)) {
+      error(compiler->parser, "A class can't inherit from itself.");
+    }
+
+    beginScope(compiler);
+    Token super = compiler->parser->prev;
+    super.start = "super";
+    super.length = 5;
+    addLocal(compiler, super, true);
+    markInitialized(compiler);
+
+    namedVariable(compiler, &className, false);
+    emitByte(compiler, OP_INHERIT);
+    classState.hasSuperclass = true;
+  }
+
+  namedVariable(compiler, &className, false);
+  consume(compiler, TOKEN_LEFT_BRACE, "Expect '{' before class body.");
+  while (!check(compiler, TOKEN_RIGHT_BRACE) && !check(compiler, TOKEN_EOF)) {
+    method(compiler);
+  }
+  consume(compiler, TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
+  emitByte(compiler, OP_POP);
+
+  if (classState.hasSuperclass)
+    endScope(compiler);
+  compiler->currentClass = classState.enclosing;
+}
+
+static void expressionStatement(Compiler *compiler) {
+  expression(compiler);
+  consume(compiler, TOKEN_SEMICOLON, "Expect ';' after value.");
+  emitByte(compiler, OP_POP);
+}
+
+// Compiles the condition of an if, while or for statement as branches,
+// leaving nothing on the stack. The code following it runs when the condition
+// is true, the jumps left in condition->falseJumps are taken when it's false.
+//
+// The `and`/`or` operators at the top of the condition (see and_() and or_())
+// don't compute a boolean: `a and b or c` is compiled as
+//
+//   <a> jump if false -> c
+//   <b> jump if true -> then
+//   <c> jump if false -> else
+//   then: ...
+//
+// Each operand is tested once, and a comparison operand is fused with its
+// jump (see emitBranch()).
+static void condition(Compiler *compiler, Condition *condition) {
+  condition->falseCount = 0;
+  condition->trueCount = 0;
+
+  Condition *enclosing = compiler->condition;
+  compiler->condition = condition;
+  parsePrecedence(compiler, PREC_ASSIGNMENT);
+  compiler->condition = enclosing;
+
+  addJump(compiler, condition->falseJumps, &condition->falseCount,
+          emitBranch(compiler, false));
+  patchJumps(compiler, condition->trueJumps, &condition->trueCount);
 }
 
 static void ifStatement(Compiler *compiler) {
   consume(compiler, TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
-  expression(compiler);
+  Condition cond;
+  condition(compiler, &cond);
   consume(compiler, TOKEN_RIGHT_PAREN, "Expect ')' at the end of condition.");
 
-  // Backpatching: emit the jump instruction first with a placeholder offset
-  // operand. We keep track of where that half-finished instruction is. Next, we
-  // compile the then body. Once that's done, we know how far to jump. So we go
-  // back and replace that placeholder offset with the real one now that we can
-  // calculate it.
-  int thenJump = emitJump(compiler, OP_JUMP_IF_FALSE);
-  emitBytes(compiler, 1, OP_POP);
+  // Backpatching: the jumps to the else branch are emitted first with a
+  // placeholder offset operand. We keep track of where those half-finished
+  // instructions are. Next, we compile the then body. Once that's done, we
+  // know how far to jump. So we go back and replace the placeholder offsets
+  // with the real one now that we can calculate it.
   statement(compiler);
 
+  // Nothing to skip at the end of the then branch.
+  if (!check(compiler, TOKEN_ELSE)) {
+    patchJumps(compiler, cond.falseJumps, &cond.falseCount);
+    return;
+  }
+
   int elseJump = emitJump(compiler, OP_JUMP);
-  patchJump(compiler, thenJump);
-  emitBytes(compiler, 1, OP_POP);
+  patchJumps(compiler, cond.falseJumps, &cond.falseCount);
 
-  if (match(compiler, TOKEN_ELSE))
-    statement(compiler);
+  advance(compiler);
+  statement(compiler);
 
   patchJump(compiler, elseJump);
 }
 
+static void whileStatement(Compiler *compiler) {
+  int loopStart = compiler->currentChunk->count;
+
+  consume(compiler, TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
+  Condition cond;
+  condition(compiler, &cond);
+  consume(compiler, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+
+  statement(compiler);
+  emitLoop(compiler, loopStart);
+
+  patchJumps(compiler, cond.falseJumps, &cond.falseCount);
+}
+
+// Adds a local for a value the compiler keeps on the stack, with a name that
+// can't clash with user variables.
+static void addHiddenLocal(Compiler *compiler, const char *name) {
+  Token token = compiler->parser->prev;
+  token.start = name;
+  token.length = (int)strlen(name);
+  addLocal(compiler, token, false);
+  markInitialized(compiler);
+}
+
+// Returns true if all that was compiled since offset is a small integer
+// literal (see emitInteger()), setting its value.
+static bool compiledSmallInt(Compiler *compiler, int offset, int *value) {
+  Chunk *chunk = compiler->currentChunk;
+  int length = chunk->count - offset;
+  if (length == 1 && chunk->code[offset] == OP_PUSH_ZERO) {
+    *value = 0;
+    return true;
+  }
+  if (length == 1 && chunk->code[offset] == OP_PUSH_ONE) {
+    *value = 1;
+    return true;
+  }
+  if (length == 2 && chunk->code[offset] == OP_PUSH_SMALLINT) {
+    *value = (int8_t)chunk->code[offset + 1];
+    return true;
+  }
+  return false;
+}
+
+static bool isStep(Token *token) {
+  return token->type == TOKEN_IDENTIFIER && token->length == 4 &&
+         memcmp(token->start, "step", 4) == 0;
+}
+
+// for x in iterable body
+//
+// The array or generator, already compiled, and the index in the array are
+// kept in hidden locals right below the loop variable:
+//
+//   <iterable> 0 nil
+// loop:
+//   OP_FOR_EACH slot -> exit
+//   <body>
+//   OP_LOOP -> loop
+// exit:
+static void eachLoop(Compiler *compiler, Token name, int slot) {
+  addHiddenLocal(compiler, "(iterable)");
+  emitByte(compiler, OP_PUSH_ZERO);
+  addHiddenLocal(compiler, "(index)");
+  emitByte(compiler, OP_NIL);
+  addLocal(compiler, name, false);
+  markInitialized(compiler);
+
+  // A generator runs code that could pop from any array.
+  invalidateLoops(compiler->current, -1);
+
+  int loopStart = compiler->currentChunk->count;
+  emitCode(compiler, (uint8_t[]){OP_FOR_EACH, slot, 0xff, 0xff}, 4);
+  int exitJump = compiler->currentChunk->count - 2;
+
+  statement(compiler);
+  emitLoop(compiler, loopStart);
+  patchJump(compiler, exitJump);
+}
+
+// for i in start..end [step s] body
+//
+// The end is excluded, the step is 1 by default and can be negative. The
+// counter, end and step are kept in hidden locals right below the loop
+// variable, so that the whole loop is driven by two instructions:
+//
+//   <start> <end> <step> nil
+//   OP_FOR_RANGE_INIT slot -> exit
+// body:
+//   <body>
+//   OP_FOR_RANGE slot -> body
+// exit:
+//
+// `step` is not a keyword, it is only recognized after the end.
+//
+// When the loop is `for i in 0..len(a)`, with a non negative start and a
+// positive step, a[i] is compiled unchecked in the body (see BoundedLoop).
+static void rangeForStatement(Compiler *compiler) {
+  beginScope(compiler);
+
+  consume(compiler, TOKEN_IDENTIFIER, "Expect loop variable name.");
+  Token name = compiler->parser->prev;
+  consume(compiler, TOKEN_IN, "Expect 'in' after loop variable.");
+
+  int slot = compiler->current->localCount;
+  if (slot + 4 > UINT8_COUNT) {
+    error(compiler->parser, "Too many local variables in function.");
+    return;
+  }
+
+  Chunk *chunk = compiler->currentChunk;
+  int start, step = 1;
+
+  int code = chunk->count;
+  expression(compiler);
+  if (!check(compiler, TOKEN_DOT_DOT)) {
+    eachLoop(compiler, name, slot);
+    endScope(compiler);
+    return;
+  }
+  bool bounded = compiledSmallInt(compiler, code, &start) && start >= 0;
+  addHiddenLocal(compiler, "(range counter)");
+  consume(compiler, TOKEN_DOT_DOT, "Expect '..' after range start.");
+
+  // The end must be len(a), a being a local.
+  code = chunk->count;
+  expression(compiler);
+  bounded = bounded && chunk->count == code + 3 &&
+            chunk->code[code] == OP_GET_LOCAL &&
+            chunk->code[code + 2] == OP_LEN;
+  int array = bounded ? chunk->code[code + 1] : -1;
+  addHiddenLocal(compiler, "(range end)");
+
+  if (isStep(&compiler->parser->curr)) {
+    advance(compiler);
+    code = chunk->count;
+    expression(compiler);
+    bounded = bounded && compiledSmallInt(compiler, code, &step);
+  } else {
+    emitByte(compiler, OP_PUSH_ONE);
+  }
+  bounded = bounded && step > 0;
+  addHiddenLocal(compiler, "(range step)");
+
+  // The loop variable, set by the range instructions.
+  emitByte(compiler, OP_NIL);
+  addLocal(compiler, name, false);
+  markInitialized(compiler);
+
+  emitCode(compiler, (uint8_t[]){OP_FOR_RANGE_INIT, slot, 0xff, 0xff}, 4);
+  int exitJump = compiler->currentChunk->count - 2;
+  int bodyStart = compiler->currentChunk->count;
+
+  BoundedLoop loop;
+  if (bounded) {
+    loop.enclosing = compiler->current->boundedLoop;
+    loop.chunk = chunk;
+    loop.variable = slot + 3;
+    loop.array = array;
+    loop.valid = true;
+    loop.uncheckedCount = 0;
+    compiler->current->boundedLoop = &loop;
+  }
+
+  statement(compiler);
+
+  if (bounded)
+    compiler->current->boundedLoop = loop.enclosing;
+
+  // +4 to jump over OP_FOR_RANGE itself and its operands too.
+  int offset = compiler->currentChunk->count - bodyStart + 4;
+  if (offset > UINT16_MAX) {
+    error(compiler->parser, "Loop body too large.");
+  }
+  emitCode(compiler,
+           (uint8_t[]){OP_FOR_RANGE, slot, (offset >> 8) & 0xff, offset & 0xff},
+           4);
+
+  patchJump(compiler, exitJump);
+  endScope(compiler);
+}
+
+// for (initializer; condition; increment) body
+//
+// The increment is compiled before the body, as we're single pass, so the
+// flow is: initializer -> condition -> body -> increment -> condition ...
+static void forStatement(Compiler *compiler) {
+  if (check(compiler, TOKEN_IDENTIFIER)) {
+    rangeForStatement(compiler);
+    return;
+  }
+
+  // The variable declared in the initializer is scoped to the loop.
+  beginScope(compiler);
+
+  consume(compiler, TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
+  if (match(compiler, TOKEN_SEMICOLON)) {
+    // No initializer.
+  } else if (match(compiler, TOKEN_VAR)) {
+    varDeclaration(compiler, false);
+  } else {
+    expressionStatement(compiler);
+  }
+
+  int loopStart = compiler->currentChunk->count;
+
+  // No exit jumps without a condition.
+  Condition cond = {.falseCount = 0};
+  if (!match(compiler, TOKEN_SEMICOLON)) {
+    condition(compiler, &cond);
+    consume(compiler, TOKEN_SEMICOLON, "Expect ';' after loop condition.");
+  }
+
+  if (!match(compiler, TOKEN_RIGHT_PAREN)) {
+    int bodyJump = emitJump(compiler, OP_JUMP);
+    int incrementStart = compiler->currentChunk->count;
+    expression(compiler);
+    emitByte(compiler, OP_POP);
+    consume(compiler, TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
+
+    emitLoop(compiler, loopStart);
+    loopStart = incrementStart;
+    patchJump(compiler, bodyJump);
+  }
+
+  statement(compiler);
+  emitLoop(compiler, loopStart);
+
+  patchJumps(compiler, cond.falseJumps, &cond.falseCount);
+
+  endScope(compiler);
+}
+
+// Patches the forward jump at offset to land on target, an earlier position
+// than the current end.
+static void patchJumpTo(Compiler *compiler, int offset, int target) {
+  int jump = target - offset - 2;
+  if (jump > UINT16_MAX) {
+    error(compiler->parser, "Too much code to jump over.");
+  }
+  compiler->currentChunk->code[offset] = (jump >> 8) & 0xff;
+  compiler->currentChunk->code[offset + 1] = jump & 0xff;
+}
+
+// Emits the dispatch of the constant cases: OP_JUMP_TABLE when they're all
+// integers covering at least half of their range, OP_JUMP_HASH otherwise.
+// The case index is looked up from the value (see switchStatement()).
+static void emitSwitchDispatch(Compiler *compiler, ObjMap *constants) {
+  Table *table = &constants->table;
+  bool dense = true;
+  int64_t min = INT64_MAX, max = INT64_MIN;
+  for (int i = 0; i < table->cap && dense; i++) {
+    Value key = table->entries[i].key;
+    if (IS_NIL(key))
+      continue;
+    if (!IS_INT(key)) {
+      dense = false;
+    } else {
+      min = AS_INT(key) < min ? AS_INT(key) : min;
+      max = AS_INT(key) > max ? AS_INT(key) : max;
+    }
+  }
+  dense = dense &&
+          (uint64_t)max - (uint64_t)min < 2 * (uint64_t)constants->count;
+
+  if (!dense) {
+    emitConstantIndex(compiler, makeConstant(compiler, OBJ_VAL(constants)),
+                      OP_JUMP_HASH);
+    return;
+  }
+
+  // [min, case of min, case of min + 1, ..., case of max], -1 for no case.
+  int range = (int)(max - min + 1);
+  ObjArray *jumpTable = newArray(compiler->memoryManager);
+  writeValueArray(&jumpTable->elements, INT_VAL(min));
+  for (int i = 0; i < range; i++) {
+    writeValueArray(&jumpTable->elements, INT_VAL(-1));
+  }
+  for (int i = 0; i < table->cap; i++) {
+    Entry *entry = &table->entries[i];
+    if (!IS_NIL(entry->key))
+      jumpTable->elements.values[AS_INT(entry->key) - min + 1] = entry->value;
+  }
+  emitConstantIndex(compiler, makeConstant(compiler, OBJ_VAL(jumpTable)),
+                    OP_JUMP_TABLE);
+}
+
+// switch (value) { case a, b: ... case c: ... default: ... }
+//
+// There's no fallthrough between cases, and `default` must be the last one.
+// The bodies are compiled first, as they're parsed, the dispatch is placed
+// after them:
+//
+//   <value>                           hidden local
+//   OP_JUMP dispatch
+// case0:
+//   <body> OP_JUMP end
+// test1:                              non constant value
+//   <value> OP_GET_LOCAL OP_EQUAL OP_JUMP_IF_FALSE next OP_POP OP_JUMP case1
+// next:
+//   OP_POP OP_JUMP (next test, default or end)
+// case1:
+//   <body> OP_JUMP end
+// default:
+//   <body> OP_JUMP end
+// dispatch:
+//   OP_GET_LOCAL OP_JUMP_TABLE/OP_JUMP_HASH
+//   OP_LOOP (first test, default or end)
+//   OP_LOOP case0
+//   OP_LOOP case1
+// end:
+//
+// The constant values (see constantExpression()) before the first other one
+// are found with a single lookup. From that one on, every value is tested in
+// order, so the case run is always the first one whose value matches.
+static void switchStatement(Compiler *compiler) {
+  Chunk *chunk = compiler->currentChunk;
+  beginScope(compiler);
+
+  consume(compiler, TOKEN_LEFT_PAREN, "Expect '(' after 'switch'.");
+  expression(compiler);
+  consume(compiler, TOKEN_RIGHT_PAREN, "Expect ')' after value.");
+  int subject = compiler->current->localCount;
+  addHiddenLocal(compiler, "(switch value)");
+  consume(compiler, TOKEN_LEFT_BRACE, "Expect '{' before switch cases.");
+
+  int dispatchJump = emitJump(compiler, OP_JUMP);
+
+  // Constant value -> index of the case in caseStarts.
+  ObjMap *constants = newMap(compiler->memoryManager);
+  int caseStarts[UINT8_COUNT];
+  int caseCount = 0;
+  int endJumps[UINT8_COUNT];
+  int endJumpCount = 0;
+  // Where the tests start, and the jump taken when the last ones failed.
+  int firstTest = -1;
+  int missJump = -1;
+  int defaultStart = -1;
+
+  while (match(compiler, TOKEN_CASE) || match(compiler, TOKEN_DEFAULT)) {
+    if (defaultStart != -1) {
+      error(compiler->parser, "Can't have a case after 'default'.");
+    }
+    if (endJumpCount == UINT8_COUNT) {
+      error(compiler->parser, "Too many cases in switch.");
+      break;
+    }
+
+    int bodyJumps[UINT8_COUNT];
+    int bodyJumpCount = 0;
+    int index = -1;
+
+    if (compiler->parser->prev.type == TOKEN_DEFAULT) {
+      if (missJump != -1) {
+        patchJump(compiler, missJump);
+        missJump = -1;
+      }
+      defaultStart = chunk->count;
+    } else {
+      do {
+        // A test may be jumped to, keep its code apart from what precedes.
+        int testStart = chunk->count;
+        compiler->current->lastJumpTarget = testStart;
+        Value value;
+        // nil can't be a key of the constants, it's tested like expressions.
+        bool constant = constantExpression(compiler, &value);
+        Value existing;
+        if (constant && !IS_NIL(value) &&
+            tableGetValue(&constants->table, value, &existing)) {
+          error(compiler->parser, "Duplicate case value.");
+        }
+        // After a tested value, a constant one could match after it while
+        // coming first in the lookup.
+        if (constant && (IS_NIL(value) || firstTest != -1)) {
+          emitValue(compiler, value);
+          constant = false;
+        }
+        if (constant) {
+          if (index == -1)
+            index = caseCount++;
+          if (tableSetValue(&constants->table, value, INT_VAL(index)))
+            constants->count++;
+          continue;
+        }
+
+        // The first test is reached from the dispatch, the others when the
+        // tests of the previous case failed.
+        if (missJump != -1) {
+          patchJumpTo(compiler, missJump, testStart);
+          missJump = -1;
+        } else if (firstTest == -1) {
+          firstTest = testStart;
+        }
+
+        if (bodyJumpCount == UINT8_COUNT) {
+          error(compiler->parser, "Too many values in case.");
+          break;
+        }
+        emitBytes(compiler, OP_GET_LOCAL, subject);
+        emitByte(compiler, OP_EQUAL);
+        int nextJump = emitJump(compiler, OP_JUMP_IF_FALSE);
+        emitByte(compiler, OP_POP);
+        bodyJumps[bodyJumpCount++] = emitJump(compiler, OP_JUMP);
+        patchJump(compiler, nextJump);
+        emitByte(compiler, OP_POP);
+      } while (match(compiler, TOKEN_COMMA));
+
+      if (bodyJumpCount > 0)
+        missJump = emitJump(compiler, OP_JUMP);
+    }
+    consume(compiler, TOKEN_COLON, "Expect ':' after case.");
+
+    for (int i = 0; i < bodyJumpCount; i++) {
+      patchJump(compiler, bodyJumps[i]);
+    }
+    if (index != -1)
+      caseStarts[index] = chunk->count;
+    compiler->current->lastJumpTarget = chunk->count;
+
+    beginScope(compiler);
+    while (!check(compiler, TOKEN_CASE) && !check(compiler, TOKEN_DEFAULT) &&
+           !check(compiler, TOKEN_RIGHT_BRACE) && !check(compiler, TOKEN_EOF)) {
+      declaration(compiler);
+    }
+    endScope(compiler);
+    endJumps[endJumpCount++] = emitJump(compiler, OP_JUMP);
+  }
+  consume(compiler, TOKEN_RIGHT_BRACE, "Expect '}' after switch cases.");
+
+  patchJump(compiler, dispatchJump);
+  int missTarget = firstTest != -1 ? firstTest : defaultStart;
+  int endMiss = -1;
+  if (caseCount > 0) {
+    emitBytes(compiler, OP_GET_LOCAL, subject);
+    emitSwitchDispatch(compiler, constants);
+    if (missTarget == -1)
+      endMiss = emitJump(compiler, OP_JUMP);
+    else
+      emitLoop(compiler, missTarget);
+    for (int i = 0; i < caseCount; i++) {
+      emitLoop(compiler, caseStarts[i]);
+    }
+  } else if (missTarget != -1) {
+    emitLoop(compiler, missTarget);
+  }
+
+  for (int i = 0; i < endJumpCount; i++) {
+    patchJump(compiler, endJumps[i]);
+  }
+  if (endMiss != -1)
+    patchJump(compiler, endMiss);
+  if (missJump != -1)
+    patchJump(compiler, missJump);
+  endScope(compiler);
+}
+
+// `return;` returns nil, like reaching the end of the function.
+static void returnStatement(Compiler *compiler) {
+  if (compiler->current->type == TYPE_SCRIPT) {
+    error(compiler->parser, "Can't return from top-level code.");
+  }
+
+  if (match(compiler, TOKEN_SEMICOLON)) {
+    emitReturn(compiler);
+    return;
+  }
+
+  if (compiler->current->type == TYPE_INITIALIZER) {
+    error(compiler->parser, "Can't return a value from an initializer.");
+  }
+
+  expression(compiler);
+  consume(compiler, TOKEN_SEMICOLON, "Expect ';' after return value.");
+
+  // Returning the result of a call: the callee can reuse the frame.
+  Chunk *chunk = compiler->currentChunk;
+  int last = compiler->current->lastInstruction;
+  if (last == chunk->count - 2 && chunk->code[last] == OP_CALL)
+    chunk->code[last] = OP_TAIL_CALL;
+  emitByte(compiler, OP_RETURN_VALUE);
+}
+
+// yield value; or yield; for nil
+//
+// The function becomes a generator function. A yield suspends the generator
+// and resumes the loop iterating over it.
+static void yieldStatement(Compiler *compiler) {
+  if (compiler->current->type == TYPE_SCRIPT) {
+    error(compiler->parser, "Can't yield from top-level code.");
+  } else if (compiler->current->type == TYPE_INITIALIZER) {
+    error(compiler->parser, "Can't yield from an initializer.");
+  } else {
+    compiler->current->function->isGenerator = true;
+  }
+
+  if (match(compiler, TOKEN_SEMICOLON)) {
+    emitByte(compiler, OP_NIL);
+  } else {
+    expression(compiler);
+    consume(compiler, TOKEN_SEMICOLON, "Expect ';' after yield value.");
+  }
+  emitByte(compiler, OP_YIELD);
+
+  // The loop resumed could pop from any array.
+  invalidateLoops(compiler->current, -1);
+}
+
 static void printStatement(Compiler *compiler) {
   expression(compiler);
   consume(compiler, TOKEN_SEMICOLON, "Expect ';' after value.");
-  emitBytes(compiler, 1, OP_PRINT);
+  emitByte(compiler, OP_PRINT);
 }
 
 // Synchronization phase, avoid in case of error of propagating.
@@ -798,8 +2085,10 @@ static void synchronize(Compiler *compiler) {
     case TOKEN_FOR:
     case TOKEN_IF:
     case TOKEN_WHILE:
+    case TOKEN_SWITCH:
     case TOKEN_PRINT:
     case TOKEN_RETURN:
+    case TOKEN_YIELD:
       // End of statement, return.
       return;
       // Do nothing here.
@@ -811,7 +2100,11 @@ static void synchronize(Compiler *compiler) {
 }
 
 static void declaration(Compiler *compiler) {
-  if (match(compiler, TOKEN_VAR)) {
+  if (match(compiler, TOKEN_CLASS)) {
+    classDeclaration(compiler);
+  } else if (match(compiler, TOKEN_FUN)) {
+    funDeclaration(compiler);
+  } else if (match(compiler, TOKEN_VAR)) {
     varDeclaration(compiler, false);
   } else if (match(compiler, TOKEN_CONST)) {
     varDeclaration(compiler, true);
@@ -829,6 +2122,16 @@ static void statement(Compiler *compiler) {
     printStatement(compiler);
   } else if (match(compiler, TOKEN_IF)) {
     ifStatement(compiler);
+  } else if (match(compiler, TOKEN_RETURN)) {
+    returnStatement(compiler);
+  } else if (match(compiler, TOKEN_YIELD)) {
+    yieldStatement(compiler);
+  } else if (match(compiler, TOKEN_WHILE)) {
+    whileStatement(compiler);
+  } else if (match(compiler, TOKEN_FOR)) {
+    forStatement(compiler);
+  } else if (match(compiler, TOKEN_SWITCH)) {
+    switchStatement(compiler);
   } else if (match(compiler, TOKEN_LEFT_BRACE)) {
     beginScope(compiler);
     block(compiler);
@@ -878,13 +2181,13 @@ static void unary(Compiler *compiler, bool canAssign) {
     // When parsing the operand to unary -, we need to compile only expressions
     // at a certain precedence level or higher.
   case TOKEN_MINUS:
-    emitBytes(compiler, 1, OP_NEGATE);
+    emitByte(compiler, OP_NEGATE);
     break;
   case TOKEN_BANG:
-    emitBytes(compiler, 1, OP_NOT);
+    emitByte(compiler, OP_NOT);
     break;
   case TOKEN_TILDE:
-    emitBytes(compiler, 1, OP_BITWISE_NOT);
+    emitByte(compiler, OP_BITWISE_NOT);
     break;
   // Unreachable case
   default:
@@ -893,19 +2196,38 @@ static void unary(Compiler *compiler, bool canAssign) {
   }
 }
 
+// Literals without a decimal point are integers, unless they don't fit in 64
+// bits.
+static Value numberValue(Token *token) {
+  if (memchr(token->start, '.', token->length) == NULL) {
+    errno = 0;
+    long long n = strtoll(token->start, NULL, 10);
+    if (errno != ERANGE)
+      return INT_VAL(n);
+  }
+
+  return NUMBER_VAL(strtod(token->start, NULL));
+}
+
 static void number(Compiler *compiler, bool canAssign) {
   UNUSED(canAssign);
 
-  double v = strtod(compiler->parser->prev.start, NULL);
+  Token *token = &compiler->parser->prev;
 
 #ifdef DEBUG_COMPILE_EXECUTION
   debugIndent++;
-  printf("%snumber(%.2f)\n",
-         strfromnchars(DEBUG_COMPILE_INDENT_CHAR, debugIndent), v);
+  printf("%snumber(%.*s)\n",
+         strfromnchars(DEBUG_COMPILE_INDENT_CHAR, debugIndent), token->length,
+         token->start);
   debugIndent--;
 #endif
 
-  emitConstant(compiler, NUMBER_VAL(v));
+  Value value = numberValue(token);
+  if (IS_INT(value)) {
+    emitInteger(compiler, AS_INT(value));
+  } else {
+    emitConstant(compiler, value);
+  }
 }
 
 static void string(Compiler *compiler, bool canAssign) {
@@ -928,6 +2250,328 @@ static void string(Compiler *compiler, bool canAssign) {
                                   compiler->parser->prev.length - 2)));
 }
 
+// Lazy pipelines: a source, range(start, end[, step]) or each(iterable),
+// followed by stages .map(f), .filter(f) and .take(n), and optionally by a
+// terminal operation: .sum(), .count(), .toArray() or .reduce(f, initial).
+//
+// The whole chain is fused into a single loop over the source, compiled into
+// a function of its own that takes the operands of the chain as arguments,
+// and the chain compiles to a call to it. Nothing is collected between the
+// stages: each element goes through all of them before the next one is
+// produced, and take() stops the loop before producing more.
+//
+// Without a terminal operation the function is a generator yielding what
+// comes out of the last stage, so the pipeline stays lazy until something
+// loops over it (it can be the source of another pipeline with each()).
+typedef enum {
+  PIPE_COUNT,
+  PIPE_FILTER,
+  PIPE_MAP,
+  PIPE_REDUCE,
+  PIPE_SUM,
+  PIPE_TAKE,
+  PIPE_TO_ARRAY,
+} PipeOp;
+
+typedef struct {
+  const char *name;
+  int arity;
+  PipeOp op;
+  bool terminal;
+} PipeOperation;
+
+static const PipeOperation pipeOperations[] = {
+    {"count", 0, PIPE_COUNT, true},     {"filter", 1, PIPE_FILTER, false},
+    {"map", 1, PIPE_MAP, false},        {"reduce", 2, PIPE_REDUCE, true},
+    {"sum", 0, PIPE_SUM, true},         {"take", 1, PIPE_TAKE, false},
+    {"toArray", 0, PIPE_TO_ARRAY, true},
+};
+
+#define PIPE_STAGES_MAX 16
+
+typedef struct {
+  PipeOp op;
+  // Argument of the pipeline function with the operand of the stage.
+  int param;
+  // Local counting the elements that went through take().
+  int counter;
+} PipeStage;
+
+static const PipeOperation *findPipeOperation(Token *name) {
+  for (size_t i = 0; i < sizeof(pipeOperations) / sizeof(pipeOperations[0]);
+       i++) {
+    if ((int)strlen(pipeOperations[i].name) == name->length &&
+        memcmp(pipeOperations[i].name, name->start, name->length) == 0)
+      return &pipeOperations[i];
+  }
+
+  return NULL;
+}
+
+static void emitLocal(Compiler *compiler, OpCode code, int slot) {
+  emitBytes(compiler, code, slot);
+}
+
+// Jumps out of the loop (recorded in exits) once a take() got all its
+// elements, checked before producing the next one.
+static void emitTakeChecks(Compiler *compiler, PipeStage *stages,
+                           int stageCount, int *exits, int *exitCount) {
+  for (int i = 0; i < stageCount; i++) {
+    if (stages[i].op != PIPE_TAKE)
+      continue;
+    emitLocal(compiler, OP_GET_LOCAL, stages[i].counter);
+    emitLocal(compiler, OP_GET_LOCAL, stages[i].param);
+    exits[(*exitCount)++] = emitJump(compiler, OP_JUMP_IF_NOT_LESS);
+  }
+}
+
+// Compiles the loop of the pipeline into function, whose arguments are the
+// source operands (start, end and step, or the iterable), then the operands
+// of the stages and of the terminal operation. Its locals are:
+//
+//   [arguments] [result] [take() counters] [loop locals, variable last]
+//
+// and the loop, over a range (over an iterable it's OP_FOR_EACH at the top
+// and OP_LOOP at the bottom):
+//
+//   <take() checks -> exit>
+//   OP_FOR_RANGE_INIT -> exit
+// body:
+//   <stages, each one updating the variable or jumping to miss>
+//   <terminal operation, or OP_YIELD>
+//   OP_JUMP -> next
+// miss:
+//   OP_POP                      the false condition of filter()
+// next:
+//   <take() checks -> exit>
+//   OP_FOR_RANGE -> body
+// exit:
+//   return the result
+static void pipelineFunction(Compiler *compiler, ObjFunction *function,
+                             bool isRange, PipeStage *stages, int stageCount,
+                             const PipeOperation *terminal, int terminalParam) {
+  FunctionState state;
+  initFunctionState(&state, compiler->current, TYPE_FUNCTION, function);
+  compiler->current = &state;
+  Chunk *enclosingChunk = compiler->currentChunk;
+  compiler->currentChunk = &function->chunk;
+
+  int slot = function->arity;
+  int result = slot;
+  if (terminal == NULL) {
+    function->isGenerator = true;
+  } else if (terminal->op == PIPE_REDUCE) {
+    emitLocal(compiler, OP_GET_LOCAL, terminalParam + 1);
+    slot++;
+  } else if (terminal->op == PIPE_TO_ARRAY) {
+    emitBytes(compiler, OP_ARRAY, 0);
+    slot++;
+  } else {
+    emitByte(compiler, OP_PUSH_ZERO);
+    slot++;
+  }
+
+  for (int i = 0; i < stageCount; i++) {
+    if (stages[i].op == PIPE_TAKE) {
+      stages[i].counter = slot++;
+      emitByte(compiler, OP_PUSH_ZERO);
+    }
+  }
+
+  int loop = slot;
+  if (isRange) {
+    emitLocal(compiler, OP_GET_LOCAL, 0);
+    emitLocal(compiler, OP_GET_LOCAL, 1);
+    emitLocal(compiler, OP_GET_LOCAL, 2);
+  } else {
+    emitLocal(compiler, OP_GET_LOCAL, 0);
+    emitByte(compiler, OP_PUSH_ZERO);
+  }
+  emitByte(compiler, OP_NIL);
+  int variable = isRange ? loop + 3 : loop + 2;
+  if (variable > UINT8_MAX)
+    error(compiler->parser, "Too many operands in pipeline.");
+
+  int exits[PIPE_STAGES_MAX * 2 + 1];
+  int exitCount = 0;
+  int loopStart = compiler->currentChunk->count;
+  emitTakeChecks(compiler, stages, stageCount, exits, &exitCount);
+  emitCode(compiler,
+           (uint8_t[]){isRange ? OP_FOR_RANGE_INIT : OP_FOR_EACH, loop, 0xff,
+                       0xff},
+           4);
+  exits[exitCount++] = compiler->currentChunk->count - 2;
+  int bodyStart = compiler->currentChunk->count;
+
+  int misses[PIPE_STAGES_MAX];
+  int missCount = 0;
+  for (int i = 0; i < stageCount; i++) {
+    switch (stages[i].op) {
+    case PIPE_MAP:
+      emitLocal(compiler, OP_GET_LOCAL, stages[i].param);
+      emitLocal(compiler, OP_GET_LOCAL, variable);
+      emitBytes(compiler, OP_CALL, 1);
+      emitLocal(compiler, OP_SET_LOCAL, variable);
+      emitByte(compiler, OP_POP);
+      break;
+    case PIPE_FILTER:
+      emitLocal(compiler, OP_GET_LOCAL, stages[i].param);
+      emitLocal(compiler, OP_GET_LOCAL, variable);
+      emitBytes(compiler, OP_CALL, 1);
+      misses[missCount++] = emitJump(compiler, OP_JUMP_IF_FALSE);
+      emitByte(compiler, OP_POP);
+      break;
+    case PIPE_TAKE:
+      emitLocal(compiler, OP_GET_LOCAL, stages[i].counter);
+      emitByte(compiler, OP_INCREMENT);
+      emitLocal(compiler, OP_SET_LOCAL, stages[i].counter);
+      emitByte(compiler, OP_POP);
+      break;
+    default:
+      break;
+    }
+  }
+
+  switch (terminal != NULL ? terminal->op : PIPE_MAP) {
+  case PIPE_COUNT:
+    emitLocal(compiler, OP_GET_LOCAL, result);
+    emitByte(compiler, OP_INCREMENT);
+    break;
+  case PIPE_REDUCE:
+    emitLocal(compiler, OP_GET_LOCAL, terminalParam);
+    emitLocal(compiler, OP_GET_LOCAL, result);
+    emitLocal(compiler, OP_GET_LOCAL, variable);
+    emitBytes(compiler, OP_CALL, 2);
+    break;
+  case PIPE_SUM:
+    emitLocal(compiler, OP_GET_LOCAL, result);
+    emitLocal(compiler, OP_GET_LOCAL, variable);
+    emitByte(compiler, OP_ADD);
+    break;
+  case PIPE_TO_ARRAY:
+    emitLocal(compiler, OP_GET_LOCAL, result);
+    emitLocal(compiler, OP_GET_LOCAL, variable);
+    emitByte(compiler, OP_ARRAY_PUSH);
+    break;
+  default:
+    emitLocal(compiler, OP_GET_LOCAL, variable);
+    emitByte(compiler, OP_YIELD);
+    break;
+  }
+  if (terminal != NULL && terminal->op != PIPE_TO_ARRAY) {
+    emitLocal(compiler, OP_SET_LOCAL, result);
+    emitByte(compiler, OP_POP);
+  } else if (terminal != NULL) {
+    emitByte(compiler, OP_POP);
+  }
+
+  if (missCount > 0) {
+    int next = emitJump(compiler, OP_JUMP);
+    for (int i = 0; i < missCount; i++) {
+      patchJump(compiler, misses[i]);
+    }
+    emitByte(compiler, OP_POP);
+    patchJump(compiler, next);
+  }
+
+  if (isRange) {
+    emitTakeChecks(compiler, stages, stageCount, exits, &exitCount);
+    // +4 to jump over OP_FOR_RANGE itself and its operands too.
+    int offset = compiler->currentChunk->count - bodyStart + 4;
+    if (offset > UINT16_MAX) {
+      error(compiler->parser, "Loop body too large.");
+    }
+    emitCode(compiler,
+             (uint8_t[]){OP_FOR_RANGE, loop, (offset >> 8) & 0xff,
+                         offset & 0xff},
+             4);
+  } else {
+    emitLoop(compiler, loopStart);
+  }
+
+  for (int i = 0; i < exitCount; i++) {
+    patchJump(compiler, exits[i]);
+  }
+  if (terminal != NULL) {
+    emitLocal(compiler, OP_GET_LOCAL, result);
+    emitByte(compiler, OP_RETURN_VALUE);
+  }
+  endCompiler(compiler);
+
+  freeFunctionState(&state);
+  compiler->current = state.enclosing;
+  compiler->currentChunk = enclosingChunk;
+}
+
+// Compiles the pipeline starting with the source name just consumed, as a
+// call to its own function (see pipelineFunction()).
+static void pipeline(Compiler *compiler, Token *source) {
+  bool isRange = source->length == 5;
+  ObjFunction *function = newFunction(compiler->memoryManager);
+  function->name = copyString(compiler->memoryManager, source->start,
+                              source->length);
+  emitConstant(compiler, OBJ_VAL(function));
+
+  consume(compiler, TOKEN_LEFT_PAREN, "Expect '(' after pipeline source.");
+  int argCount = argumentList(compiler);
+  if (isRange && argCount == 2) {
+    emitByte(compiler, OP_PUSH_ONE);
+    argCount++;
+  } else if (argCount != (isRange ? 3 : 1)) {
+    error(compiler->parser, "Wrong number of arguments for builtin.");
+    return;
+  }
+
+  PipeStage stages[PIPE_STAGES_MAX];
+  int stageCount = 0;
+  const PipeOperation *terminal = NULL;
+  int terminalParam = 0;
+  while (terminal == NULL && match(compiler, TOKEN_DOT)) {
+    consume(compiler, TOKEN_IDENTIFIER, "Expect pipeline operation after '.'.");
+    const PipeOperation *operation =
+        findPipeOperation(&compiler->parser->prev);
+    if (operation == NULL) {
+      error(compiler->parser, "Unknown pipeline operation.");
+      return;
+    }
+
+    consume(compiler, TOKEN_LEFT_PAREN, "Expect '(' after operation name.");
+    int param = argCount;
+    argCount += argumentList(compiler);
+    if (argCount - param != operation->arity) {
+      error(compiler->parser,
+            "Wrong number of arguments for pipeline operation.");
+      return;
+    }
+
+    if (operation->terminal) {
+      terminal = operation;
+      terminalParam = param;
+    } else if (stageCount == PIPE_STAGES_MAX) {
+      error(compiler->parser, "Too many pipeline stages.");
+      return;
+    } else {
+      stages[stageCount].op = operation->op;
+      stages[stageCount].param = param;
+      stages[stageCount].counter = -1;
+      stageCount++;
+    }
+  }
+
+  if (argCount > UINT8_MAX) {
+    error(compiler->parser, "Too many operands in pipeline.");
+    return;
+  }
+
+  // The stages call functions that could pop from any array.
+  invalidateLoops(compiler->current, -1);
+  emitBytes(compiler, OP_CALL, argCount);
+
+  function->arity = argCount;
+  pipelineFunction(compiler, function, isRange, stages, stageCount, terminal,
+                   terminalParam);
+}
+
 static void namedVariable(Compiler *compiler, Token *name, bool canAssign) {
 #ifdef DEBUG_COMPILE_EXECUTION
   debugIndent++;
@@ -939,79 +2583,137 @@ static void namedVariable(Compiler *compiler, Token *name, bool canAssign) {
   debugIndent--;
 #endif
 
+  TokenType next = compiler->parser->curr.type;
+  bool assignment = canAssign && (next == TOKEN_EQUAL ||
+                                  next == TOKEN_PLUS_EQUAL ||
+                                  next == TOKEN_MINUS_EQUAL ||
+                                  next == TOKEN_STAR_EQUAL ||
+                                  next == TOKEN_SLASH_EQUAL);
+
+  // A constant known at compile time is replaced by its value.
+  ObjString *id = internName(compiler, name);
+  Value known;
+  if (resolveKnownConstant(compiler, id, &known)) {
+    if (assignment) {
+      error(compiler->parser, "Cannot reassign to constant variable.");
+      return;
+    }
+    emitValue(compiler, known);
+    return;
+  }
+
   // If it's a global variable will store it's index in the chunk's constant
   // identifiers.
   ConstantIndex cidx;
 
   // If it a local variable, get the index of the position in the stack instead
-  // (-1 otherwise -> global).
-  int localIdx = resolveLocal(compiler, name);
+  // (-1 otherwise -> upvalue or global).
+  int localIdx = resolveLocal(compiler, compiler->current, id);
+  int upvalueIdx = -1;
+  if (localIdx == -1)
+    upvalueIdx = resolveUpvalue(compiler, compiler->current, id);
 
-  OpCode shortCodeSet, shortCodeGet, longCodeSet, longCodeGet;
+  OpCode codeSet, codeGet;
 
   // Check if it's a constant local variable being reassigned.
   bool constReassignment =
-      canAssign && localIdx != -1 && compiler->locals[localIdx].isConst;
+      canAssign &&
+      ((localIdx != -1 && compiler->current->locals[localIdx].isConst) ||
+       (upvalueIdx != -1 && compiler->current->upvalues[upvalueIdx].isConst));
+
+  // A builtin called directly, unless a local or upvalue shadows it.
+  const Intrinsic *intrinsic = NULL;
+  if (localIdx == -1 && upvalueIdx == -1 &&
+      check(compiler, TOKEN_LEFT_PAREN)) {
+    if (isPipeSource(name)) {
+      pipeline(compiler, name);
+      return;
+    }
+    intrinsic = findIntrinsic(name);
+  }
+  if (intrinsic != NULL) {
+    advance(compiler);
+    if (argumentList(compiler) != intrinsic->arity) {
+      error(compiler->parser, "Wrong number of arguments for builtin.");
+      return;
+    }
+    if (intrinsic->op == OP_ARRAY_POP)
+      invalidateLoops(compiler->current, -1);
+    emitByte(compiler, intrinsic->op);
+    return;
+  }
+
+  // Upvalue case, constants are read from the closure directly.
+  if (upvalueIdx != -1) {
+    cidx.bytes[0] = upvalueIdx;
+    cidx.isWide = false;
 
+    codeGet = compiler->current->upvalues[upvalueIdx].isConst
+                  ? OP_GET_CONST_UPVALUE
+                  : OP_GET_UPVALUE;
+    codeSet = OP_SET_UPVALUE;
+  } else
   // Global variable case.
   if (localIdx == -1) {
-    cidx = identifierConstant(compiler, name);
+    cidx = makeConstant(compiler, OBJ_VAL(id));
+    // A known constant declared later must exist at runtime for this access.
+    tableSet(&compiler->globalNames, globalName(compiler, cidx), NIL_VAL);
 
-    shortCodeGet = OP_GET_GLOBAL;
-    longCodeGet = OP_GET_GLOBAL_LONG;
-    shortCodeSet = OP_SET_GLOBAL;
-    longCodeSet = OP_SET_GLOBAL_LONG;
+    codeGet = OP_GET_GLOBAL;
+    codeSet = OP_SET_GLOBAL;
   } else
   // Local variable case.
   {
     // Trick to avoid having a lot branches and duplication in the code.
     cidx.bytes[0] = localIdx;
-    cidx.isLong = false;
+    cidx.isWide = false;
 
-    shortCodeGet = OP_GET_LOCAL;
-    longCodeGet = OP_GET_LOCAL_LONG;
-    shortCodeSet = OP_SET_LOCAL;
-    longCodeSet = OP_SET_LOCAL_LONG;
+    codeGet = OP_GET_LOCAL;
+    codeSet = OP_SET_LOCAL;
   }
 
+  // Assigning a local breaks the loops indexing with it, see BoundedLoop.
+  if (assignment && localIdx != -1)
+    invalidateLoops(compiler->current, localIdx);
+
   // If we are on an assignment token, this is a setter, so we consume first.
   if (canAssign && match(compiler, TOKEN_EQUAL)) {
     if (constReassignment)
       goto reassignmentError;
     expression(compiler);
-    emitConstantIndex(compiler, cidx, shortCodeSet, longCodeSet);
+    emitConstantIndex(compiler, cidx, codeSet);
   } else if (canAssign && match(compiler, TOKEN_PLUS_EQUAL)) {
     if (constReassignment)
       goto reassignmentError;
-    emitConstantIndex(compiler, cidx, shortCodeGet, longCodeGet);
+    emitConstantIndex(compiler, cidx, codeGet);
     expression(compiler);
-    emitBytes(compiler, 1, OP_ADD);
-    emitConstantIndex(compiler, cidx, shortCodeSet, longCodeSet);
+    emitByte(compiler, OP_ADD);
+    emitConstantIndex(compiler, cidx, codeSet);
   } else if (canAssign && match(compiler, TOKEN_MINUS_EQUAL)) {
     if (constReassignment)
       goto reassignmentError;
-    emitConstantIndex(compiler, cidx, shortCodeGet, longCodeGet);
+    emitConstantIndex(compiler, cidx, codeGet);
     expression(compiler);
-    emitBytes(compiler, 1, OP_SUBTRACT);
-    emitConstantIndex(compiler, cidx, shortCodeSet, longCodeSet);
+    emitByte(compiler, OP_SUBTRACT);
+    emitConstantIndex(compiler, cidx, codeSet);
   } else if (canAssign && match(compiler, TOKEN_STAR_EQUAL)) {
     if (constReassignment)
       goto reassignmentError;
-    emitConstantIndex(compiler, cidx, shortCodeGet, longCodeGet);
+    emitConstantIndex(compiler, cidx, codeGet);
     expression(compiler);
-    emitBytes(compiler, 1, OP_MULTIPLY);
-    emitConstantIndex(compiler, cidx, shortCodeSet, longCodeSet);
+    emitByte(compiler, OP_MULTIPLY);
+    emitConstantIndex(compiler, cidx, codeSet);
   } else if (canAssign && match(compiler, TOKEN_SLASH_EQUAL)) {
     if (constReassignment)
       goto reassignmentError;
-    emitConstantIndex(compiler, cidx, shortCodeGet, longCodeGet);
+    emitConstantIndex(compiler, cidx, codeGet);
     expression(compiler);
-    emitBytes(compiler, 1, OP_DIVIDE);
-    emitConstantIndex(compiler, cidx, shortCodeSet, longCodeSet);
+    emitByte(compiler, OP_DIVIDE);
+    emitConstantIndex(compiler, cidx, codeSet);
   } else
   // Otherwise we are on a getter, so we just emit bytecode for that.
   {
-    emitConstantIndex(compiler, cidx, shortCodeGet, longCodeGet);
+    emitConstantIndex(compiler, cidx, codeGet);
   }
 
   return;
@@ -1031,7 +2733,7 @@ static void postfix(Compiler *compiler, bool canAssign) {
   Chunk *currChunk = compiler->currentChunk;
 
   // At this point, the variable value is already on the stack
-  // Due to the GET_LOCAL/GLOBAL(_LONG) emitted by the variable prefix function
+  // Due to the (wide) GET_LOCAL/GLOBAL emitted by the variable prefix function
 
   // Check that we have at least compiled the variable operator.
   if (currChunk->count < 2) {
@@ -1040,55 +2742,53 @@ static void postfix(Compiler *compiler, bool canAssign) {
   }
 
   // Check if the previous op was a variable load
-  // 1. First try looking back 2 bytes (GET_GLOBAL/LOCAL case, 1 operand byte +
+  // 1. First try looking back 2 bytes (GET_GLOBAL/LOCAL case, 1 opcode byte +
   // 1 index byte)
   uint8_t lastOp = currChunk->code[currChunk->count - 2];
+  bool isWide = false;
 
-  // 2. If not a normal GET_LOCAL/GLOBAL, try looking back 4 bytes
-  // (GET_GLOBAL_LONG, 1 operand byte + 3 index bytes)
-  if (lastOp != OP_GET_LOCAL && lastOp != OP_GET_GLOBAL) {
+  // 2. If not a normal GET_LOCAL/GLOBAL, try looking back 5 bytes (wide
+  // GET_GLOBAL, 1 OP_WIDE byte + 1 opcode byte + 3 index bytes)
+  if (lastOp != OP_GET_LOCAL && lastOp != OP_GET_GLOBAL &&
+      lastOp != OP_GET_UPVALUE && currChunk->count >= 5 &&
+      currChunk->code[currChunk->count - 5] == OP_WIDE) {
     lastOp = currChunk->code[currChunk->count - 4];
+    isWide = true;
   }
 
-  if (lastOp != OP_GET_GLOBAL && lastOp != OP_GET_GLOBAL_LONG &&
-      lastOp != OP_GET_LOCAL) {
+  if (lastOp != OP_GET_GLOBAL && lastOp != OP_GET_LOCAL &&
+      lastOp != OP_GET_UPVALUE) {
     error(compiler->parser, "Can only apply postfix operators to a variable");
     return;
   }
 
-  int localIdx = -1;
+  // The index of the variable (stack slot or constant) follows the opcode and
+  // is at the end of the chunk.
   ConstantIndex varIndex;
-
-  if (lastOp == OP_GET_LOCAL) {
-    // The local variable index must be the one right after the operand
-    // OP_GET_LOCAL.
-    localIdx = currChunk->code[currChunk->count - 1];
-  } else if (lastOp == OP_GET_GLOBAL) {
-    // Short constant index case
-    varIndex.bytes[0] = currChunk->code[currChunk->count - 1];
-    varIndex.isLong = false;
-  } else {
-    // Long constant index case
+  varIndex.isWide = isWide;
+  if (isWide) {
     varIndex.bytes[0] = currChunk->code[currChunk->count - 3];
     varIndex.bytes[1] = currChunk->code[currChunk->count - 2];
     varIndex.bytes[2] = currChunk->code[currChunk->count - 1];
-    varIndex.isLong = true;
+  } else {
+    varIndex.bytes[0] = currChunk->code[currChunk->count - 1];
   }
 
-  emitBytes(compiler, 1, __OP_DUP);
+  if (lastOp == OP_GET_LOCAL)
+    invalidateLoops(compiler->current, varIndex.bytes[0]);
+
+  emitByte(compiler, __OP_DUP);
 
   // Determine the operation based on the token type
   switch (compiler->parser->prev.type) {
   case TOKEN_PLUS_PLUS:
     // Add 1 to the duplicate
-    emitConstant(compiler, NUMBER_VAL(1));
-    emitBytes(compiler, 1, OP_ADD);
+    emitByte(compiler, OP_INCREMENT);
     break;
 
   case TOKEN_MINUS_MINUS:
     // Subtract 1 from the duplicate
-    emitConstant(compiler, NUMBER_VAL(1));
-    emitBytes(compiler, 1, OP_SUBTRACT);
+    emitByte(compiler, OP_DECREMENT);
     break;
 
   default:
@@ -1097,14 +2797,243 @@ static void postfix(Compiler *compiler, bool canAssign) {
   }
 
   // Store back to the variable
-  if (localIdx != -1) {
-    emitBytes(compiler, 2, OP_SET_LOCAL, (uint8_t)localIdx);
+  OpCode setOp = lastOp == OP_GET_LOCAL     ? OP_SET_LOCAL
+                 : lastOp == OP_GET_UPVALUE ? OP_SET_UPVALUE
+                                            : OP_SET_GLOBAL;
+  emitConstantIndex(compiler, varIndex, setOp);
+
+  // Pop the stored value, leaving the original
+  emitByte(compiler, OP_POP);
+}
+
+static uint8_t argumentList(Compiler *compiler) {
+  uint8_t argCount = 0;
+  if (!check(compiler, TOKEN_RIGHT_PAREN)) {
+    do {
+      expression(compiler);
+      if (argCount == UINT8_MAX) {
+        error(compiler->parser, "Can't have more than 255 arguments.");
+      }
+      argCount++;
+    } while (match(compiler, TOKEN_COMMA));
+  }
+
+  consume(compiler, TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+  return argCount;
+}
+
+// Infix expression: the callee is on the stack and "(" has been consumed.
+// The arguments are pushed right above the callee.
+static void call(Compiler *compiler, bool canAssign) {
+  UNUSED(canAssign);
+
+  uint8_t argCount = argumentList(compiler);
+  // The callee could pop from any array.
+  invalidateLoops(compiler->current, -1);
+  emitBytes(compiler, OP_CALL, argCount);
+}
+
+// Infix expression: the instance is on the stack and "." has been consumed.
+//
+// A call right after the name is a single OP_INVOKE, that doesn't create a
+// bound method. Compound assignments read the property from a copy of the
+// instance, so it's evaluated once.
+static void dot(Compiler *compiler, bool canAssign) {
+  consume(compiler, TOKEN_IDENTIFIER, "Expect property name after '.'.");
+  ConstantIndex name = identifierConstant(compiler, &compiler->parser->prev);
+
+  OpCode compound = OP_WIDE;
+  if (canAssign && match(compiler, TOKEN_EQUAL)) {
+    expression(compiler);
+    emitProperty(compiler, OP_SET_PROPERTY, name, 0);
+    return;
+  } else if (canAssign && match(compiler, TOKEN_PLUS_EQUAL)) {
+    compound = OP_ADD;
+  } else if (canAssign && match(compiler, TOKEN_MINUS_EQUAL)) {
+    compound = OP_SUBTRACT;
+  } else if (canAssign && match(compiler, TOKEN_STAR_EQUAL)) {
+    compound = OP_MULTIPLY;
+  } else if (canAssign && match(compiler, TOKEN_SLASH_EQUAL)) {
+    compound = OP_DIVIDE;
+  } else if (match(compiler, TOKEN_LEFT_PAREN)) {
+    uint8_t argCount = argumentList(compiler);
+    // The method could pop from any array.
+    invalidateLoops(compiler->current, -1);
+    emitProperty(compiler, OP_INVOKE, name, argCount);
+    return;
   } else {
-    emitConstantIndex(compiler, varIndex, OP_SET_GLOBAL, OP_SET_GLOBAL_LONG);
+    emitProperty(compiler, OP_GET_PROPERTY, name, 0);
+    return;
   }
 
-  // Pop the stored value, leaving the original
-  emitBytes(compiler, 1, OP_POP);
+  emitByte(compiler, __OP_DUP);
+  emitProperty(compiler, OP_GET_PROPERTY, name, 0);
+  expression(compiler);
+  emitByte(compiler, compound);
+  emitProperty(compiler, OP_SET_PROPERTY, name, 0);
+}
+
+// Returns the upvalue of a function nested in a method holding the receiver
+// of the method, captured by value.
+static int resolveThis(Compiler *compiler, FunctionState *state) {
+  FunctionState *enclosing = state->enclosing;
+  if (enclosing->type == TYPE_METHOD || enclosing->type == TYPE_INITIALIZER)
+    return addUpvalue(compiler, state, CAPTURE_THIS, 0, true);
+
+  return addUpvalue(compiler, state, CAPTURE_UPVALUE,
+                    resolveThis(compiler, enclosing), true);
+}
+
+// The receiver is in the callee slot of methods (see OP_GET_THIS), functions
+// declared in a method capture it.
+static void emitThis(Compiler *compiler) {
+  FunctionType type = compiler->current->type;
+  if (type == TYPE_METHOD || type == TYPE_INITIALIZER) {
+    emitByte(compiler, OP_GET_THIS);
+    return;
+  }
+
+  emitBytes(compiler, OP_GET_CONST_UPVALUE,
+            resolveThis(compiler, compiler->current));
+}
+
+static void this_(Compiler *compiler, bool canAssign) {
+  UNUSED(canAssign);
+
+  if (compiler->currentClass == NULL) {
+    error(compiler->parser, "Can't use 'this' outside of a class.");
+    return;
+  }
+
+  emitThis(compiler);
+}
+
+// super.name is the method of the superclass bound to the receiver, and
+// super.name(args) calls it right away.
+static void super_(Compiler *compiler, bool canAssign) {
+  UNUSED(canAssign);
+
+  if (compiler->currentClass == NULL) {
+    error(compiler->parser, "Can't use 'super' outside of a class.");
+  } else if (!compiler->currentClass->hasSuperclass) {
+    error(compiler->parser, "Can't use 'super' in a class with no superclass.");
+  }
+
+  consume(compiler, TOKEN_DOT, "Expect '.' after 'super'.");
+  consume(compiler, TOKEN_IDENTIFIER, "Expect superclass method name.");
+  Token super = compiler->parser->prev;
+  ConstantIndex name = identifierConstant(compiler, &super);
+  super.start = "super";
+  super.length = 5;
+
+  if (compiler->parser->hadError)
+    return;
+
+  emitThis(compiler);
+  if (match(compiler, TOKEN_LEFT_PAREN)) {
+    uint8_t argCount = argumentList(compiler);
+    namedVariable(compiler, &super, false);
+    invalidateLoops(compiler->current, -1);
+    emitProperty(compiler, OP_SUPER_INVOKE, name, argCount);
+  } else {
+    namedVariable(compiler, &super, false);
+    emitConstantIndex(compiler, name, OP_GET_SUPER);
+  }
+}
+
+// [a, b, c]: the elements are pushed, then collected by OP_ARRAY.
+static void arrayLiteral(Compiler *compiler, bool canAssign) {
+  UNUSED(canAssign);
+
+  int count = 0;
+  if (!check(compiler, TOKEN_RIGHT_BRACKET)) {
+    do {
+      // Trailing comma.
+      if (check(compiler, TOKEN_RIGHT_BRACKET))
+        break;
+      expression(compiler);
+      if (count == UINT8_MAX) {
+        error(compiler->parser, "Can't have more than 255 elements in an "
+                                "array literal.");
+      }
+      count++;
+    } while (match(compiler, TOKEN_COMMA));
+  }
+
+  consume(compiler, TOKEN_RIGHT_BRACKET, "Expect ']' after array elements.");
+  emitBytes(compiler, OP_ARRAY, count);
+}
+
+// {k: v, ...}: the keys are expressions, each key is pushed before its value,
+// then they're collected by OP_MAP. Only reached in expression position, a
+// statement starting with "{" is a block.
+static void mapLiteral(Compiler *compiler, bool canAssign) {
+  UNUSED(canAssign);
+
+  int count = 0;
+  if (!check(compiler, TOKEN_RIGHT_BRACE)) {
+    do {
+      // Trailing comma.
+      if (check(compiler, TOKEN_RIGHT_BRACE))
+        break;
+      expression(compiler);
+      consume(compiler, TOKEN_COLON, "Expect ':' after map key.");
+      expression(compiler);
+      // The operand counts both keys and values.
+      if (count == UINT8_MAX - 1) {
+        error(compiler->parser, "Can't have more than 127 entries in a map "
+                                "literal.");
+      }
+      count += 2;
+    } while (match(compiler, TOKEN_COMMA));
+  }
+
+  consume(compiler, TOKEN_RIGHT_BRACE, "Expect '}' after map entries.");
+  emitBytes(compiler, OP_MAP, count);
+}
+
+// Infix expression: the array is on the stack and "[" has been consumed.
+//
+// Indexing a local array with a local index, proved in range by a loop, is
+// compiled to an unchecked instruction (see BoundedLoop).
+static void subscript(Compiler *compiler, bool canAssign) {
+  Chunk *chunk = compiler->currentChunk;
+  FunctionState *current = compiler->current;
+
+  int array = -1;
+  int last = current->lastInstruction;
+  if (last == chunk->count - 2 && current->lastJumpTarget != chunk->count &&
+      chunk->code[last] == OP_GET_LOCAL)
+    array = chunk->code[last + 1];
+
+  int indexStart = chunk->count;
+  expression(compiler);
+  consume(compiler, TOKEN_RIGHT_BRACKET, "Expect ']' after index.");
+
+  int variable = -1;
+  if (chunk->count == indexStart + 2 &&
+      current->lastJumpTarget != chunk->count &&
+      chunk->code[indexStart] == OP_GET_LOCAL)
+    variable = chunk->code[indexStart + 1];
+
+  OpCode op = OP_INDEX_GET;
+  OpCode unchecked = OP_INDEX_GET_UNCHECKED;
+  if (canAssign && match(compiler, TOKEN_EQUAL)) {
+    expression(compiler);
+    op = OP_INDEX_SET;
+    unchecked = OP_INDEX_SET_UNCHECKED;
+  }
+
+  // Looked up after the value, that could have invalidated the loop.
+  BoundedLoop *loop = NULL;
+  if (array != -1 && variable != -1)
+    loop = findBoundedLoop(current, array, variable);
+
+  if (loop != NULL && loop->uncheckedCount < UNCHECKED_MAX) {
+    loop->unchecked[loop->uncheckedCount++] = chunk->count;
+    op = unchecked;
+  }
+  emitByte(compiler, op);
 }
 
 static void literal(Compiler *compiler, bool canAssign) {
@@ -1120,13 +3049,13 @@ static void literal(Compiler *compiler, bool canAssign) {
 
   switch (compiler->parser->prev.type) {
   case TOKEN_NIL:
-    emitBytes(compiler, 1, OP_NIL);
+    emitByte(compiler, OP_NIL);
     break;
   case TOKEN_TRUE:
-    emitBytes(compiler, 1, OP_TRUE);
+    emitByte(compiler, OP_TRUE);
     break;
   case TOKEN_FALSE:
-    emitBytes(compiler, 1, OP_FALSE);
+    emitByte(compiler, OP_FALSE);
     break;
   default:
     error(compiler->parser, "Unexpected literal");
@@ -1143,10 +3072,20 @@ bool compile(Compiler *compiler, const char *source) {
 
   // TODO: Move this in an upper level initialization and remember to call
   // freeXXX functions of them too
+  freeScanner(compiler->scanner);
   compiler->scanner = initScanner(source);
 
   compiler->parser->hadError = false;
   compiler->parser->panicMode = false;
+  compiler->current = &compiler->script;
+  compiler->currentClass = NULL;
+  compiler->current->lastInstruction = -1;
+  compiler->current->lastJumpTarget = -1;
+
+  // Size the chunk up front from the source, so that emitting code rarely has
+  // to grow it. Function bodies are compiled into chunks of their own.
+  reserveChunk(compiler->currentChunk,
+               (int)(strlen(source) / SOURCE_BYTES_PER_CODE_BYTE));
 
   advance(compiler);
 
@@ -1155,6 +3094,14 @@ bool compile(Compiler *compiler, const char *source) {
   }
   endCompiler(compiler);
 
+  // The global constants declared only exist if the source is run.
+  if (!compiler->parser->hadError) {
+    tableAddAll(&compiler->newKnownGlobals, &compiler->knownGlobals);
+    tableAddAll(&compiler->newConstants, &compiler->memoryManager->constants);
+  }
+  freeTable(&compiler->newKnownGlobals);
+  freeTable(&compiler->newConstants);
+
 #ifdef DEBUG_COMPILE_EXECUTION
   printf("\n======== compile end() ========\n\n");
 #endif
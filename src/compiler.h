@@ -4,12 +4,15 @@
 #include "chunk.h"
 #include "common.h"
 #include "memory.h"
+#include "object.h"
+#include "optimizer.h"
 #include "scanner.h"
 
 typedef struct {
-  bool isLong;
+  bool isWide;
   uint8_t bytes[3]; // For short constant, only bytes[0] is used
-                    // For long constant, all three bytes are used
+                    // For wide constant (OP_WIDE prefix), all three bytes are
+                    // used
 } ConstantIndex;
 
 typedef struct {
@@ -43,20 +46,161 @@ typedef enum {
 
 typedef struct {
   Token name;
+  // Interned name, see FunctionState.localNames.
+  ObjString *id;
+  // Local with the same name it shadows in the function, -1 if none.
+  int shadowed;
   int depth;
   bool isConst;
+  // Captured by reference by a closure, so it must be moved to the heap when
+  // it goes out of scope. Constants are captured by value and never are.
+  bool isCaptured;
 } Local;
 
+// Constant local whose value is known at compile time, initialized with a
+// literal or another such constant: its uses are compiled to the value itself,
+// and it doesn't take a stack slot.
 typedef struct {
-  MemoryManager *memoryManager;
+  Token name;
+  // Interned name and shadowed constant, like for locals.
+  ObjString *id;
+  int shadowed;
+  int depth;
+  Value value;
+} KnownConstant;
 
+// Variable of an enclosing function used by the function being compiled.
+typedef struct {
+  // Where OP_CLOSURE takes it from, copied into the function once compiled.
+  Capture capture;
+  // Captured by value, read with OP_GET_CONST_UPVALUE.
+  bool isConst;
+} Upvalue;
+
+// Maximum number of unchecked instructions in a BoundedLoop, the following
+// ones are checked.
+#define UNCHECKED_MAX 32
+
+// Range loop `for i in 0..len(a)` over a local array a: in the body a[i] is
+// always in bounds, as long as i and a aren't assigned and no array shrinks
+// (a call could pop from it). Indexing is then compiled to unchecked
+// instructions, the bounds check being hoisted to the loop header.
+//
+// The compiler is single pass, so it doesn't know what follows in the body:
+// when it finds something breaking the guarantee, the unchecked instructions
+// already emitted are turned back into checked ones.
+typedef struct BoundedLoop {
+  struct BoundedLoop *enclosing;
+  Chunk *chunk;
+  // Local slots of the loop variable and of the array.
+  int variable;
+  int array;
+  bool valid;
+  // Offsets of the unchecked instructions emitted so far.
+  int unchecked[UNCHECKED_MAX];
+  int uncheckedCount;
+} BoundedLoop;
+
+typedef enum {
+  TYPE_FUNCTION,
+  // init() method, returning the receiver.
+  TYPE_INITIALIZER,
+  TYPE_METHOD,
+  TYPE_SCRIPT,
+} FunctionType;
+
+// State of the function being compiled. Function declarations nest them, the
+// script being the outermost one.
+typedef struct FunctionState {
+  struct FunctionState *enclosing;
+  // Function being compiled, NULL for the script.
+  ObjFunction *function;
+  FunctionType type;
+
+  // Locals live in the function's stack window, the parameters first.
   Local locals[UINT8_COUNT];
   int localCount;
   int scopeDepth;
 
+  Upvalue upvalues[UINT8_COUNT];
+  int upvalueCount;
+
+  // Constant locals with no slot, see KnownConstant.
+  KnownConstant knownConstants[UINT8_COUNT];
+  int knownConstantCount;
+
+  // Index of the innermost local and known constant of each name in scope,
+  // keyed by interned name: resolving a name is a single lookup. Each one
+  // links to the one it shadows, which is back in the table when it goes out
+  // of scope.
+  Table localNames;
+  Table constantNames;
+
+  // Innermost range loop being compiled with unchecked indexing, see
+  // BoundedLoop.
+  BoundedLoop *boundedLoop;
+
+  // Offset of the last instruction emitted, and the last offset a jump has
+  // been patched to land on (-1 if none). An instruction can be rewritten
+  // together with the following one only if no jump lands between them.
+  int lastInstruction;
+  int lastJumpTarget;
+} FunctionState;
+
+// Maximum number of pending jumps of a Condition, each `and`/`or` adding one.
+#define CONDITION_JUMPS_MAX UINT8_COUNT
+
+// Condition of an if, while or for statement being compiled. Its `and` and
+// `or` operands don't produce a value: each one branches right away to where
+// the result is known, the jumps waiting here for their target.
+typedef struct {
+  // Jumps taken when the condition is false, to the else branch or loop exit,
+  // or to the right operand of the next `or`.
+  int falseJumps[CONDITION_JUMPS_MAX];
+  int falseCount;
+  // Jumps taken when the condition is true, to the then branch or loop body.
+  int trueJumps[CONDITION_JUMPS_MAX];
+  int trueCount;
+} Condition;
+
+// Class being compiled. Classes can be declared in methods of other classes.
+typedef struct ClassState {
+  struct ClassState *enclosing;
+  // Its methods can use `super`, a hidden local around the class body.
+  bool hasSuperclass;
+} ClassState;
+
+typedef struct {
+  MemoryManager *memoryManager;
+
+  FunctionState script;
+  FunctionState *current;
+  // Innermost class being compiled, NULL outside of classes.
+  ClassState *currentClass;
+  // Condition whose `and`/`or` operators are being compiled as branches, NULL
+  // where they must produce a value.
+  Condition *condition;
+
   Scanner *scanner;
   Parser *parser;
+  // Chunk of the current function.
   Chunk *currentChunk;
+
+  // Global constants known at compile time (name -> value), see
+  // KnownConstant, and the names of the globals read or assigned by name so
+  // far: a known constant among them is still defined at runtime for them.
+  // Both last as long as the VM, so that REPL lines see the previous ones.
+  Table knownGlobals;
+  Table globalNames;
+  // The global constants declared by the source being compiled: the known
+  // ones (name -> value) and the names to protect from assignment at runtime
+  // (see OP_SET_GLOBAL). They are only added to knownGlobals and to the
+  // memory manager's constants if the source compiles.
+  Table newKnownGlobals;
+  Table newConstants;
+
+  // Passes run on the bytecode of each function once compiled.
+  OptimizationLevel optimizationLevel;
 } Compiler;
 
 typedef void (*ParseFn)(Compiler *compiler, bool canAssign);
@@ -1,5 +1,6 @@
 #include "debug.h"
 #include "chunk.h"
+#include "object.h"
 #include <stdint.h>
 #include <stdio.h>
 
@@ -16,30 +17,90 @@ static int jumpInstruction(const char *name, int sign, Chunk *chunk,
   return offset + 3;
 }
 
-static int byteInstruction(const char *name, Chunk *chunk, int offset) {
+// Slot then jump offset, the target is printed the same way as jumps.
+static int slotJumpInstruction(const char *name, int sign, Chunk *chunk,
+                               int offset) {
   uint8_t slot = chunk->code[offset + 1];
+  uint16_t jump = (uint16_t)(chunk->code[offset + 2] << 8);
+  jump |= chunk->code[offset + 3];
+  printf("%-16s %4d %4d -> %d\n", name, slot, offset,
+         offset + 4 + sign * jump);
+  return offset + 4;
+}
+
+// Operands of index-like instructions are 1 byte, or 3 bytes when the
+// instruction is prefixed by OP_WIDE. The offset is the one of the operand.
+static uint32_t readOperand(Chunk *chunk, int offset, bool wide) {
+  return wide ? GET_WIDE_OPERAND(chunk, offset) : chunk->code[offset];
+}
+
+static int slotInstruction(const char *name, Chunk *chunk, int offset,
+                           bool wide) {
+  uint32_t slot = readOperand(chunk, offset + 1, wide);
   printf("%-16s %4d\n", name, slot);
+  return offset + 1 + (wide ? 3 : 1);
+}
+
+static int immediateInstruction(const char *name, Chunk *chunk, int offset,
+                                bool wide) {
+  int32_t value = wide ? SIGN_EXTEND_24(GET_WIDE_OPERAND(chunk, offset + 1))
+                       : (int8_t)chunk->code[offset + 1];
+  printf("%-16s %4d\n", name, value);
+  return offset + 1 + (wide ? 3 : 1);
+}
+
+static int argCountInstruction(const char *name, Chunk *chunk, int offset) {
+  printf("%-16s %4d\n", name, chunk->code[offset + 1]);
   return offset + 2;
 }
 
-static int constantInstruction(const char *name, Chunk *chunk, int offset) {
-  uint8_t constant = chunk->code[offset + 1];
+static int constantInstruction(const char *name, Chunk *chunk, int offset,
+                               bool wide) {
+  uint32_t constant = readOperand(chunk, offset + 1, wide);
 
   printf("%-16s %4d '", name, constant);
   printValue(chunk->constants.values[constant], "", "'\n");
 
-  // 1 byte opcode + 1 byte operand
-  return offset + 2;
+  // 1 byte opcode + 1 (or 3 if wide) bytes operand
+  return offset + 1 + (wide ? 3 : 1);
 }
 
-static int constantLongInstruction(const char *name, Chunk *chunk, int offset) {
-  uint32_t constant = GET_CONSTANT_LONG_ID(chunk, offset);
+// Name constant, inline cache slot and, for invocations, argument count.
+static int propertyInstruction(const char *name, Chunk *chunk, int offset,
+                               bool wide, bool invoke) {
+  uint32_t constant = readOperand(chunk, offset + 1, wide);
+  int cacheOffset = offset + 1 + (wide ? 3 : 1);
+  int cache = (chunk->code[cacheOffset] << 8) | chunk->code[cacheOffset + 1];
 
   printf("%-16s %4d '", name, constant);
-  printValue(chunk->constants.values[constant], "", "'\n");
+  printValue(chunk->constants.values[constant], "", "'");
+  printf(" cache %d", cache);
+  if (invoke)
+    printf(" (%d args)", chunk->code[cacheOffset + 2]);
+  printf("\n");
 
-  // 1 byte opcode + 3 bytes operand
-  return offset + 4;
+  return cacheOffset + (invoke ? 3 : 2);
+}
+
+// The variables the closure captures follow, one per line.
+static int closureInstruction(const char *name, Chunk *chunk, int offset,
+                              bool wide) {
+  uint32_t constant = readOperand(chunk, offset + 1, wide);
+  int next = constantInstruction(name, chunk, offset, wide);
+
+  static const char *kinds[] = {
+      [CAPTURE_LOCAL] = "local",
+      [CAPTURE_LOCAL_VALUE] = "local value",
+      [CAPTURE_UPVALUE] = "upvalue",
+      [CAPTURE_THIS] = "this",
+  };
+  ObjFunction *function = AS_FUNCTION(chunk->constants.values[constant]);
+  for (int i = 0; i < function->upvalueCount; i++) {
+    printf("                |                  %s %d\n",
+           kinds[function->captures[i].kind], function->captures[i].index);
+  }
+
+  return next;
 }
 
 int disassembleInstruction(Chunk *chunk, int offset) {
@@ -54,92 +115,49 @@ int disassembleInstruction(Chunk *chunk, int offset) {
     printf("line: %4d ", currLine);
   }
 
-  u_int8_t instr = chunk->code[offset];
-  switch (instr) {
-  case __OP_STACK_RESET:
-    return simpleInstruction("__OP_STACK_RESET", offset);
-  case __OP_DUP:
-    return simpleInstruction("__OP_DUP", offset);
-  case OP_NEGATE:
-    return simpleInstruction("OP_NEGATE", offset);
-  case OP_PRINT:
-    return simpleInstruction("OP_PRINT", offset);
-  case OP_ADD:
-    return simpleInstruction("OP_ADD", offset);
-  case OP_SUBTRACT:
-    return simpleInstruction("OP_SUBTRACT", offset);
-  case OP_MULTIPLY:
-    return simpleInstruction("OP_MULTIPLY", offset);
-  case OP_DIVIDE:
-    return simpleInstruction("OP_DIVIDE", offset);
-  case OP_NIL:
-    return simpleInstruction("OP_NIL", offset);
-  case OP_TRUE:
-    return simpleInstruction("OP_TRUE", offset);
-  case OP_FALSE:
-    return simpleInstruction("OP_FALSE", offset);
-  case OP_NOT:
-    return simpleInstruction("OP_NOT", offset);
-  case OP_RETURN:
-    return simpleInstruction("OP_RETURN", offset);
-  case OP_EQUAL:
-    return simpleInstruction("OP_EQUAL", offset);
-  case OP_GREATER:
-    return simpleInstruction("OP_GREATER", offset);
-  case OP_LESS:
-    return simpleInstruction("OP_LESS", offset);
-  case OP_NOT_EQUAL:
-    return simpleInstruction("OP_NOT_EQUAL", offset);
-  case OP_GREATER_EQUAL:
-    return simpleInstruction("OP_GREATER_EQUAL", offset);
-  case OP_LESS_EQUAL:
-    return simpleInstruction("OP_LESS_EQUAL", offset);
-  case OP_POP:
-    return simpleInstruction("OP_POP", offset);
-  case OP_INCREMENT:
-    return simpleInstruction("OP_INCREMENT", offset);
-  case OP_DECREMENT:
-    return simpleInstruction("OP_DECREMENT", offset);
-  case OP_BITWISE_SHIFT_RIGHT:
-    return simpleInstruction("OP_BITWISE_SHIFT_RIGHT", offset);
-  case OP_BITWISE_SHIFT_LEFT:
-    return simpleInstruction("OP_BITWISE_SHIFT_LEFT", offset);
-  case OP_BITWISE_NOT:
-    return simpleInstruction("OP_BITWISE_NOT", offset);
-  case OP_BITWISE_AND:
-    return simpleInstruction("OP_BITWISE_AND", offset);
-  case OP_BITWISE_OR:
-    return simpleInstruction("OP_BITWISE_OR", offset);
-  case OP_BITWISE_XOR:
-    return simpleInstruction("OP_BITWISE_XOR", offset);
-  case OP_CONSTANT:
-    return constantInstruction("OP_CONSTANT", chunk, offset);
-  case OP_CONSTANT_LONG:
-    return constantLongInstruction("OP_CONSTANT_LONG", chunk, offset);
-  case OP_GET_GLOBAL:
-    return constantInstruction("OP_GET_GLOBAL", chunk, offset);
-  case OP_GET_GLOBAL_LONG:
-    return constantLongInstruction("OP_GET_GLOBAL_LONG", chunk, offset);
-  case OP_SET_GLOBAL:
-    return constantInstruction("OP_SET_GLOBAL", chunk, offset);
-  case OP_SET_GLOBAL_LONG:
-    return constantLongInstruction("OP_SET_GLOBAL_LONG", chunk, offset);
-  case OP_DEFINE_GLOBAL:
-    return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
-  case OP_DEFINE_GLOBAL_LONG:
-    return constantLongInstruction("OP_DEFINE_GLOBAL_LONG", chunk, offset);
-  case OP_GET_LOCAL:
-    return byteInstruction("OP_GET_LOCAL", chunk, offset);
-  case OP_SET_LOCAL:
-    return byteInstruction("OP_SET_LOCAL", chunk, offset);
-  case OP_JUMP:
-    return jumpInstruction("OP_JUMP", 1, chunk, offset);
-  case OP_JUMP_IF_FALSE:
-    return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
-  default:
+  // The wide prefix is printed together with the instruction it widens.
+  bool wide = chunk->code[offset] == OP_WIDE;
+  if (wide) {
+    printf("OP_WIDE ");
+    offset++;
+  }
+
+  uint8_t instr = chunk->code[offset];
+  const OpInfo *info = getOpInfo(instr);
+  if (info == NULL) {
     printf("Unknown opcode %d\n", instr);
     return offset + 1;
   }
+
+  switch (info->operand) {
+  case OPERAND_NONE:
+    return simpleInstruction(info->name, offset);
+  case OPERAND_CONSTANT:
+    if (instr == OP_CLOSURE)
+      return closureInstruction(info->name, chunk, offset, wide);
+    return constantInstruction(info->name, chunk, offset, wide);
+  case OPERAND_SLOT:
+  case OPERAND_UPVALUE:
+    return slotInstruction(info->name, chunk, offset, wide);
+  case OPERAND_IMMEDIATE:
+    return immediateInstruction(info->name, chunk, offset, wide);
+  case OPERAND_ARG_COUNT:
+    return argCountInstruction(info->name, chunk, offset);
+  case OPERAND_JUMP:
+    return jumpInstruction(info->name, 1, chunk, offset);
+  case OPERAND_LOOP:
+    return jumpInstruction(info->name, -1, chunk, offset);
+  case OPERAND_SLOT_JUMP:
+    return slotJumpInstruction(info->name, 1, chunk, offset);
+  case OPERAND_SLOT_LOOP:
+    return slotJumpInstruction(info->name, -1, chunk, offset);
+  case OPERAND_PROPERTY:
+    return propertyInstruction(info->name, chunk, offset, wide, false);
+  case OPERAND_INVOKE:
+    return propertyInstruction(info->name, chunk, offset, wide, true);
+  }
+
+  return offset + 1;
 }
 
 void disassembleChunk(Chunk *chunk, const char *name) {
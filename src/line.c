@@ -7,69 +7,167 @@
 void initLineArray(LineArray *array) {
   array->cap = 0;
   array->count = 0;
-  array->values = NULL;
+  array->bytes = NULL;
+
+  array->runCount = 0;
+  array->checkpointCap = 0;
+  array->checkpointCount = 0;
+  array->checkpoints = NULL;
+
+  array->last.pc = 0;
+  array->last.line = 0;
+  array->last.column = 0;
+  array->last.next = 0;
+  array->pcCount = 0;
 }
 
-int emptyLineArray(LineArray *array) { return (array->count == 0); }
+// A varint takes at most 5 bytes for 32 bits, a run is three of them.
+#define RUN_BYTES_MAX 15
 
-// Returns the line given the index of an instruction, -1 otherwise
-int getLine(LineArray *array, int idx) {
-  // Loop through the linearray and count until the index is reached
-  // e.g.
-  // [Line 12, Count 3] -> [Line 13, Count 2] -> [Line 15, Count 4]
-  // getLine(array, 4) -> Line 13
-  int count = 0;
+static void reserveRun(LineArray *array) {
+  if (array->cap >= array->count + RUN_BYTES_MAX)
+    return;
+
+  int oldCap = array->cap;
+  while (array->cap < array->count + RUN_BYTES_MAX) {
+    array->cap = GROW_CAP(array->cap);
+  }
+  array->bytes = GROW_ARR(uint8_t, array->bytes, oldCap, array->cap);
+}
+
+// LEB128: 7 bits per byte, the high bit tells if more bytes follow. The room
+// is reserved by reserveRun().
+static void writeVarint(LineArray *array, uint32_t value) {
+  while (value >= 0x80) {
+    array->bytes[array->count++] = (uint8_t)(value | 0x80);
+    value >>= 7;
+  }
+  array->bytes[array->count++] = (uint8_t)value;
+}
+
+static uint32_t readVarint(const uint8_t *bytes, int *offset) {
+  uint32_t value = 0;
+  int shift = 0;
+  uint8_t byte;
+  do {
+    byte = bytes[(*offset)++];
+    value |= (uint32_t)(byte & 0x7f) << shift;
+    shift += 7;
+  } while (byte & 0x80);
+  return value;
+}
+
+// Zigzag encoding maps small negative deltas to small unsigned numbers:
+// 0 -> 0, -1 -> 1, 1 -> 2, -2 -> 3...
+static uint32_t zigzagEncode(int32_t value) {
+  return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+static int32_t zigzagDecode(uint32_t value) {
+  return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+}
 
-  for (int i = 0; i < array->count; i++) {
-    Line curr = array->values[i];
+// Decodes the run encoded at run->next, applying its deltas to run.
+static void decodeRun(LineArray *array, LineRun *run) {
+  int offset = run->next;
+  run->pc += (int)readVarint(array->bytes, &offset);
+  run->line += zigzagDecode(readVarint(array->bytes, &offset));
+  run->column += zigzagDecode(readVarint(array->bytes, &offset));
+  run->next = offset;
+}
 
-    if (idx >= count && idx < count + curr.count)
-      return curr.num;
+// Returns in line and column the source position of the instruction at pc.
+// Returns false if there is no such instruction.
+bool getLinePosition(LineArray *array, int pc, int *line, int *column) {
+  if (pc < 0 || pc >= array->pcCount)
+    return false;
 
-    count += curr.count;
+  // Binary search the last checkpoint starting at or before pc.
+  int lo = 0;
+  int hi = array->checkpointCount - 1;
+  while (lo < hi) {
+    int mid = lo + (hi - lo + 1) / 2;
+    if (array->checkpoints[mid].pc <= pc) {
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
   }
 
-  return -1;
+  // Then decode the following runs until the one containing pc.
+  LineRun run = array->checkpoints[lo];
+  while (run.next < array->count) {
+    LineRun next = run;
+    decodeRun(array, &next);
+    if (next.pc > pc)
+      break;
+    run = next;
+  }
+
+  *line = run.line;
+  *column = run.column;
+  return true;
+}
+
+// Returns the line given the index of an instruction, -1 otherwise
+int getLine(LineArray *array, int pc) {
+  int line, column;
+  if (!getLinePosition(array, pc, &line, &column))
+    return -1;
+  return line;
 }
 
 void printLine(LineArray *array) {
   printf("== line ==\n");
-  for (int i = 0; i < array->count; i++) {
-    printf("(%d): %d\n", array->values[i].num, array->values[i].count);
+  LineRun run = {0, 0, 0, 0};
+  while (run.next < array->count) {
+    decodeRun(array, &run);
+    printf("(%d:%d): from %d\n", run.line, run.column, run.pc);
   }
 }
 
-void setLine(LineArray *array, int lineNum) {
-  // If there are no lines yet, create the first and init to 1
-  if (emptyLineArray(array)) {
-    array->cap = GROW_CAP(0);
-    array->values = GROW_ARR(Line, array->values, 0, array->cap);
-    array->values[0].num = lineNum;
-    array->values[0].count = 1;
+void setLine(LineArray *array, int line, int column) {
+  setLines(array, line, column, 1);
+}
 
-    array->count = 1;
+// Maps the next count instructions (bytes) to the same position, extending or
+// starting a single run for all of them.
+void setLines(LineArray *array, int line, int column, int count) {
+  // If the last run has the same position, the instructions just extend it.
+  if (array->runCount > 0 && array->last.line == line &&
+      array->last.column == column) {
+    array->pcCount += count;
     return;
   }
 
-  // If the last line inserted is the same of the passed one, just increment it
-  if (array->values[array->count - 1].num == lineNum) {
-    array->values[array->count - 1].count++;
-    return;
-  }
+  // Otherwise start a new run at this instruction, encoded as deltas.
+  int pc = array->pcCount;
+  reserveRun(array);
+  writeVarint(array, (uint32_t)(pc - array->last.pc));
+  writeVarint(array, zigzagEncode(line - array->last.line));
+  writeVarint(array, zigzagEncode(column - array->last.column));
+
+  array->last.pc = pc;
+  array->last.line = line;
+  array->last.column = column;
+  array->last.next = array->count;
 
-  // Otherwise create a new Line
-  if (array->cap < array->count + 1) {
-    int oldCap = array->cap;
-    array->cap = GROW_CAP(oldCap);
-    array->values = GROW_ARR(Line, array->values, oldCap, array->cap);
+  if (array->runCount % LINE_CHECKPOINT_INTERVAL == 0) {
+    if (array->checkpointCap < array->checkpointCount + 1) {
+      int oldCap = array->checkpointCap;
+      array->checkpointCap = GROW_CAP(oldCap);
+      array->checkpoints = GROW_ARR(LineRun, array->checkpoints, oldCap,
+                                    array->checkpointCap);
+    }
+    array->checkpoints[array->checkpointCount++] = array->last;
   }
 
-  array->values[array->count].num = lineNum;
-  array->values[array->count].count = 1;
-  array->count++;
+  array->runCount++;
+  array->pcCount += count;
 }
 
 void freeLineArray(LineArray *array) {
-  FREE_ARR(Line, array->values, array->cap);
+  FREE_ARR(uint8_t, array->bytes, array->cap);
+  FREE_ARR(LineRun, array->checkpoints, array->checkpointCap);
   initLineArray(array);
 }
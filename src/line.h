@@ -3,21 +3,51 @@
 
 #include "common.h"
 
+// A checkpoint is saved every LINE_CHECKPOINT_INTERVAL runs, so a lookup
+// decodes at most this many runs after the binary search.
+#define LINE_CHECKPOINT_INTERVAL 16
+
+// Source position of a run of instructions, i.e. the decoding state after it.
 typedef struct {
-  int num;
-  int count;
-} Line;
+  int pc;
+  int line;
+  int column;
+  // Offset in LineArray.bytes where the following run is encoded.
+  int next;
+} LineRun;
 
+// Maps every instruction (pc) to its source line and column.
+//
+// Consecutive instructions with the same line and column form a run. Each run
+// is encoded in `bytes` as three varints, all deltas from the previous run:
+// the starting pc and the zigzag-encoded line and column (they can go back).
+//
+// [pc delta|line delta|column delta][pc delta|line delta|column delta]...
+//
+// Since runs can only be decoded sequentially, a sparse index of checkpoints
+// (sorted by pc) allows to binary search the closest one and decode from
+// there.
 typedef struct {
   int cap;
   int count;
-  Line *values;
+  uint8_t *bytes;
+
+  int runCount;
+  int checkpointCap;
+  int checkpointCount;
+  LineRun *checkpoints;
+
+  // The run being extended and the number of instructions mapped so far.
+  LineRun last;
+  int pcCount;
 } LineArray;
 
 void initLineArray(LineArray *array);
 void freeLineArray(LineArray *array);
-void setLine(LineArray *array, int line);
-int getLine(LineArray *array, int idx);
+void setLine(LineArray *array, int line, int column);
+void setLines(LineArray *array, int line, int column, int count);
+int getLine(LineArray *array, int pc);
+bool getLinePosition(LineArray *array, int pc, int *line, int *column);
 void printLine(LineArray *array);
 
 #endif
@@ -36,8 +36,9 @@ static char *readFile(const char *path) {
   return buffer;
 }
 
-static void runFile(const char *path) {
+static void runFile(const char *path, OptimizationLevel level) {
   VM *vm = initVM();
+  vm->compiler->optimizationLevel = level;
 
   char *source = readFile(path);
 
@@ -60,14 +61,35 @@ int main(int argc, char **argv) {
   // testAdd();
   // testArithmetics();
   // testNegate();
+  // testVerifier();
+  // testTailCall();
+  // testConstPropagation();
+  // testOptimizer();
+  // testDeadBranches();
+  // testLocalPropagation();
+  // testBoundsHoisting();
+  // benchLineTable();
+  // benchDispatch();
+  // benchBitwise();
+  // benchCompileLocals();
+  // benchCompileThroughput();
   // return 0;
 
+  // -O0, -O1 or -O2 before the file (see OptimizationLevel).
+  OptimizationLevel level = OPTIMIZATION_LEVEL_DEFAULT;
+  if (argc > 1 && strlen(argv[1]) == 3 && strncmp(argv[1], "-O", 2) == 0 &&
+      argv[1][2] >= '0' && argv[1][2] <= '2') {
+    level = (OptimizationLevel)(argv[1][2] - '0');
+    argc--;
+    argv++;
+  }
+
   if (argc == 1) {
-    repl();
+    repl(level);
   } else if (argc == 2) {
-    runFile(argv[1]);
+    runFile(argv[1], level);
   } else {
-    fprintf(stderr, "Usage: nrk [path/file.nrk]\n\n");
+    fprintf(stderr, "Usage: nrk [-O0|-O1|-O2] [path/file.nrk]\n\n");
     exit(64);
   }
 
@@ -7,6 +7,7 @@
 
 MemoryManager *initMemoryManager() {
   MemoryManager *mm = (MemoryManager *)malloc(sizeof(MemoryManager));
+  mm->objects = NULL;
   initTable(&mm->strings);
   initTable(&mm->globals);
   initTable(&mm->constants);
@@ -15,6 +16,67 @@ MemoryManager *initMemoryManager() {
 
 void freeObject(struct Obj *obj) {
   switch (obj->type) {
+  case OBJ_ARRAY: {
+    ObjArray *array = (ObjArray *)obj;
+    freeValueArray(&array->elements);
+    FREE(ObjArray, obj);
+    break;
+  }
+  case OBJ_BOUND_METHOD:
+    FREE(ObjBoundMethod, obj);
+    break;
+  case OBJ_CLASS:
+    freeTable(&((ObjClass *)obj)->methods);
+    FREE(ObjClass, obj);
+    break;
+  case OBJ_CLOSURE: {
+    ObjClosure *closure = (ObjClosure *)obj;
+    reallocate(obj, sizeof(ObjClosure) + sizeof(Value) * closure->upvalueCount,
+               0);
+    break;
+  }
+  case OBJ_COROUTINE: {
+    ObjCoroutine *coroutine = (ObjCoroutine *)obj;
+    FREE_ARR(CallFrame, coroutine->frames, coroutine->frameCap);
+    FREE_ARR(Value, coroutine->stack, coroutine->stackCap);
+    FREE(ObjCoroutine, obj);
+    break;
+  }
+  case OBJ_FLOAT64_ARRAY:
+    reallocate(obj,
+               sizeof(ObjFloat64Array) +
+                   sizeof(double) * ((ObjFloat64Array *)obj)->count,
+               0);
+    break;
+  case OBJ_FUNCTION: {
+    ObjFunction *function = (ObjFunction *)obj;
+    FREE_ARR(Capture, function->captures, function->upvalueCount);
+    freeChunk(&function->chunk);
+    FREE(ObjFunction, obj);
+    break;
+  }
+  case OBJ_INSTANCE: {
+    ObjInstance *instance = (ObjInstance *)obj;
+    FREE_ARR(Value, instance->fields, instance->fieldCap);
+    FREE(ObjInstance, obj);
+    break;
+  }
+  case OBJ_MAP: {
+    ObjMap *map = (ObjMap *)obj;
+    freeTable(&map->table);
+    FREE(ObjMap, obj);
+    break;
+  }
+  case OBJ_NATIVE:
+    FREE(ObjNative, obj);
+    break;
+  case OBJ_SHAPE: {
+    ObjShape *shape = (ObjShape *)obj;
+    freeTable(&shape->fields);
+    freeTable(&shape->transitions);
+    FREE(ObjShape, obj);
+    break;
+  }
   case OBJ_STRING: {
     FREE(Obj, obj);
     // Using Flexible Array Member (FAM), we don't need to do this anymore as
@@ -26,6 +88,9 @@ void freeObject(struct Obj *obj) {
     // FREE(ObjString, obj);
     break;
   }
+  case OBJ_UPVALUE:
+    FREE(ObjUpvalue, obj);
+    break;
   }
 }
 
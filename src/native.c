@@ -0,0 +1,226 @@
+#include "native.h"
+#include "object.h"
+#include "simd.h"
+#include "vm.h"
+#include <inttypes.h>
+#include <limits.h>
+#include <math.h>
+#include <time.h>
+
+// The natives below are also emitted as opcodes when called by name (see
+// OP_SQRT), the two must behave the same.
+
+Value floorValue(Value number) {
+  if (IS_INT(number))
+    return number;
+
+  double floored = floor(AS_NUMBER(number));
+  // Exact bounds of int64_t, NaN and infinities fail both comparisons.
+  if (floored >= -9223372036854775808.0 && floored < 9223372036854775808.0)
+    return INT_VAL((int64_t)floored);
+  return NUMBER_VAL(floored);
+}
+
+// Seconds of processor time since the program started, to time scripts.
+static Value clockNative(VM *vm, int argCount, Value *args) {
+  UNUSED(vm);
+  UNUSED(argCount);
+  UNUSED(args);
+  return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+}
+
+static Value sqrtNative(VM *vm, int argCount, Value *args) {
+  UNUSED(argCount);
+  if (!IS_NUMBER(args[0]))
+    return nativeError(vm, "sqrt() argument must be a number.");
+  return NUMBER_VAL(sqrt(AS_NUMBER(args[0])));
+}
+
+static Value floorNative(VM *vm, int argCount, Value *args) {
+  UNUSED(argCount);
+  if (!IS_NUMBER(args[0]))
+    return nativeError(vm, "floor() argument must be a number.");
+  return floorValue(args[0]);
+}
+
+static Value lenNative(VM *vm, int argCount, Value *args) {
+  UNUSED(argCount);
+  if (IS_ARRAY(args[0]))
+    return INT_VAL(AS_ARRAY(args[0])->elements.count);
+  if (IS_STRING(args[0]))
+    return INT_VAL(AS_STRING(args[0])->length);
+  if (IS_MAP(args[0]))
+    return INT_VAL(AS_MAP(args[0])->count);
+  if (IS_FLOAT64_ARRAY(args[0]))
+    return INT_VAL(AS_FLOAT64_ARRAY(args[0])->count);
+  return nativeError(vm, "len() argument must be an array, a map or a string.");
+}
+
+// Appends the value, returning the new length.
+static Value pushNative(VM *vm, int argCount, Value *args) {
+  UNUSED(argCount);
+  if (!IS_ARRAY(args[0]))
+    return nativeError(vm, "push() argument must be an array.");
+
+  ValueArray *elements = &AS_ARRAY(args[0])->elements;
+  writeValueArray(elements, args[1]);
+  return INT_VAL(elements->count);
+}
+
+// Removes the last element, returning it.
+static Value popNative(VM *vm, int argCount, Value *args) {
+  UNUSED(argCount);
+  if (!IS_ARRAY(args[0]))
+    return nativeError(vm, "pop() argument must be an array.");
+
+  ValueArray *elements = &AS_ARRAY(args[0])->elements;
+  if (elements->count == 0)
+    return nativeError(vm, "Can't pop from an empty array.");
+  return elements->values[--elements->count];
+}
+
+static Value hasNative(VM *vm, int argCount, Value *args) {
+  UNUSED(argCount);
+  if (!IS_MAP(args[0]))
+    return nativeError(vm, "has() argument must be a map.");
+
+  Value value;
+  return BOOL_VAL(tableGetValue(&AS_MAP(args[0])->table, args[1], &value));
+}
+
+// Removes the key, returning whether it was there.
+static Value deleteNative(VM *vm, int argCount, Value *args) {
+  UNUSED(argCount);
+  if (!IS_MAP(args[0]))
+    return nativeError(vm, "delete() argument must be a map.");
+
+  ObjMap *map = AS_MAP(args[0]);
+  bool deleted = tableDeleteValue(&map->table, args[1]);
+  if (deleted)
+    map->count--;
+  return BOOL_VAL(deleted);
+}
+
+// The keys of a map as a new array, in table order.
+static Value keysNative(VM *vm, int argCount, Value *args) {
+  UNUSED(argCount);
+  if (!IS_MAP(args[0]))
+    return nativeError(vm, "keys() argument must be a map.");
+
+  Table *table = &AS_MAP(args[0])->table;
+  ObjArray *array = newArray(vm->memoryManager);
+  for (int i = 0; i < table->cap; i++) {
+    if (!IS_NIL(table->entries[i].key))
+      writeValueArray(&array->elements, table->entries[i].key);
+  }
+  return OBJ_VAL(array);
+}
+
+// Float64Array(n) has n zeros, Float64Array(array) the numbers of the array.
+static Value float64ArrayNative(VM *vm, int argCount, Value *args) {
+  UNUSED(argCount);
+  if (IS_INT(args[0])) {
+    int64_t count = AS_INT(args[0]);
+    if (count < 0 || count > INT_MAX / (int64_t)sizeof(double))
+      return nativeError(vm, "Float64Array length %" PRId64 " out of range.",
+                         count);
+    return OBJ_VAL(newFloat64Array(vm->memoryManager, (int)count));
+  }
+  if (!IS_ARRAY(args[0]))
+    return nativeError(
+        vm, "Float64Array() expects a length or an array of numbers.");
+
+  ValueArray *elements = &AS_ARRAY(args[0])->elements;
+  ObjFloat64Array *array = newFloat64Array(vm->memoryManager, elements->count);
+  for (int i = 0; i < elements->count; i++) {
+    if (!IS_NUMBER(elements->values[i]))
+      return nativeError(vm, "Float64Array elements must be numbers.");
+    array->values[i] = AS_NUMBER(elements->values[i]);
+  }
+  return OBJ_VAL(array);
+}
+
+static Value sumNative(VM *vm, int argCount, Value *args) {
+  UNUSED(argCount);
+  if (!IS_FLOAT64_ARRAY(args[0]))
+    return nativeError(vm, "sum() argument must be a Float64Array.");
+
+  ObjFloat64Array *array = AS_FLOAT64_ARRAY(args[0]);
+  return NUMBER_VAL(float64Sum(array->values, array->count));
+}
+
+static Value dotNative(VM *vm, int argCount, Value *args) {
+  UNUSED(argCount);
+  if (!IS_FLOAT64_ARRAY(args[0]) || !IS_FLOAT64_ARRAY(args[1]))
+    return nativeError(vm, "dot() arguments must be Float64Arrays.");
+
+  ObjFloat64Array *a = AS_FLOAT64_ARRAY(args[0]);
+  ObjFloat64Array *b = AS_FLOAT64_ARRAY(args[1]);
+  if (a->count != b->count)
+    return nativeError(vm, "Float64Array lengths differ (%d and %d).",
+                       a->count, b->count);
+  return NUMBER_VAL(float64Dot(a->values, b->values, a->count));
+}
+
+// NaN if any element is NaN.
+static Value minNative(VM *vm, int argCount, Value *args) {
+  UNUSED(argCount);
+  if (!IS_FLOAT64_ARRAY(args[0]))
+    return nativeError(vm, "min() argument must be a Float64Array.");
+
+  ObjFloat64Array *array = AS_FLOAT64_ARRAY(args[0]);
+  if (array->count == 0)
+    return nativeError(vm, "min() of an empty Float64Array.");
+  return NUMBER_VAL(float64Min(array->values, array->count));
+}
+
+static Value maxNative(VM *vm, int argCount, Value *args) {
+  UNUSED(argCount);
+  if (!IS_FLOAT64_ARRAY(args[0]))
+    return nativeError(vm, "max() argument must be a Float64Array.");
+
+  ObjFloat64Array *array = AS_FLOAT64_ARRAY(args[0]);
+  if (array->count == 0)
+    return nativeError(vm, "max() of an empty Float64Array.");
+  return NUMBER_VAL(float64Max(array->values, array->count));
+}
+
+// substr(string, start, length): the range is clamped to the string.
+static Value substrNative(VM *vm, int argCount, Value *args) {
+  UNUSED(argCount);
+  if (!IS_STRING(args[0]) || !IS_INT(args[1]) || !IS_INT(args[2]))
+    return nativeError(vm, "substr() expects a string and two integers.");
+
+  ObjString *string = AS_STRING(args[0]);
+  int64_t start = AS_INT(args[1]);
+  int64_t length = AS_INT(args[2]);
+  if (start < 0)
+    start = 0;
+  if (start > string->length)
+    start = string->length;
+  if (length < 0)
+    length = 0;
+  if (length > string->length - start)
+    length = string->length - start;
+
+  return OBJ_VAL(copyString(vm->memoryManager, string->str + start,
+                            (int)length));
+}
+
+void defineNatives(VM *vm) {
+  defineNative(vm, "Float64Array", float64ArrayNative, 1);
+  defineNative(vm, "clock", clockNative, 0);
+  defineNative(vm, "delete", deleteNative, 2);
+  defineNative(vm, "dot", dotNative, 2);
+  defineNative(vm, "floor", floorNative, 1);
+  defineNative(vm, "has", hasNative, 2);
+  defineNative(vm, "keys", keysNative, 1);
+  defineNative(vm, "len", lenNative, 1);
+  defineNative(vm, "max", maxNative, 1);
+  defineNative(vm, "min", minNative, 1);
+  defineNative(vm, "pop", popNative, 1);
+  defineNative(vm, "push", pushNative, 2);
+  defineNative(vm, "sqrt", sqrtNative, 1);
+  defineNative(vm, "substr", substrNative, 3);
+  defineNative(vm, "sum", sumNative, 1);
+}
@@ -0,0 +1,16 @@
+#ifndef nrk_native_h
+#define nrk_native_h
+
+#include "value.h"
+
+struct VM;
+
+// Registers the builtin functions (clock, sqrt, floor, len, push, has...) as
+// globals of the VM.
+void defineNatives(struct VM *vm);
+
+// Rounds the number down, to an integer when it fits. Shared by the floor()
+// native and OP_FLOOR.
+Value floorValue(Value number);
+
+#endif
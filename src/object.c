@@ -22,6 +22,135 @@ Obj *allocateObject(MemoryManager *mm, size_t size, ObjType type) {
   return obj;
 }
 
+ObjArray *newArray(MemoryManager *mm) {
+  ObjArray *array = ALLOCATE_OBJ(mm, ObjArray, OBJ_ARRAY);
+  initValueArray(&array->elements);
+  return array;
+}
+
+ObjFunction *newFunction(MemoryManager *mm) {
+  ObjFunction *function = ALLOCATE_OBJ(mm, ObjFunction, OBJ_FUNCTION);
+  function->arity = 0;
+  function->upvalueCount = 0;
+  function->captures = NULL;
+  function->name = NULL;
+  function->isGenerator = false;
+  initChunk(&function->chunk);
+  return function;
+}
+
+ObjMap *newMap(MemoryManager *mm) {
+  ObjMap *map = ALLOCATE_OBJ(mm, ObjMap, OBJ_MAP);
+  initTable(&map->table);
+  map->count = 0;
+  return map;
+}
+
+// The elements start at zero.
+ObjFloat64Array *newFloat64Array(MemoryManager *mm, int count) {
+  ObjFloat64Array *array = (ObjFloat64Array *)allocateObject(
+      mm, sizeof(ObjFloat64Array) + sizeof(double) * count, OBJ_FLOAT64_ARRAY);
+  array->count = count;
+  memset(array->values, 0, sizeof(double) * count);
+  return array;
+}
+
+// The upvalues are filled by OP_CLOSURE.
+ObjClosure *newClosure(MemoryManager *mm, ObjFunction *function) {
+  size_t allocSize =
+      sizeof(ObjClosure) + sizeof(Value) * function->upvalueCount;
+  ObjClosure *closure =
+      (ObjClosure *)allocateObject(mm, allocSize, OBJ_CLOSURE);
+  closure->function = function;
+  closure->upvalueCount = function->upvalueCount;
+  return closure;
+}
+
+ObjUpvalue *newUpvalue(MemoryManager *mm, Value *slot) {
+  ObjUpvalue *upvalue = ALLOCATE_OBJ(mm, ObjUpvalue, OBJ_UPVALUE);
+  upvalue->location = slot;
+  upvalue->closed = NIL_VAL;
+  upvalue->next = NULL;
+  return upvalue;
+}
+
+ObjNative *newNative(MemoryManager *mm, NativeFn function, int arity,
+                     ObjString *name) {
+  ObjNative *native = ALLOCATE_OBJ(mm, ObjNative, OBJ_NATIVE);
+  native->function = function;
+  native->arity = arity;
+  native->name = name;
+  return native;
+}
+
+static ObjShape *newShape(MemoryManager *mm, ObjClass *klass) {
+  ObjShape *shape = ALLOCATE_OBJ(mm, ObjShape, OBJ_SHAPE);
+  shape->klass = klass;
+  initTable(&shape->fields);
+  shape->fieldCount = 0;
+  initTable(&shape->transitions);
+  return shape;
+}
+
+ObjClass *newClass(MemoryManager *mm, ObjString *name) {
+  ObjClass *klass = ALLOCATE_OBJ(mm, ObjClass, OBJ_CLASS);
+  klass->name = name;
+  initTable(&klass->methods);
+  klass->initializer = NIL_VAL;
+  klass->fieldCount = 0;
+  klass->shape = newShape(mm, klass);
+  return klass;
+}
+
+ObjInstance *newInstance(MemoryManager *mm, ObjClass *klass) {
+  ObjInstance *instance = ALLOCATE_OBJ(mm, ObjInstance, OBJ_INSTANCE);
+  instance->shape = klass->shape;
+  instance->fieldCap = klass->fieldCount;
+  instance->fields = ALLOCATE(Value, instance->fieldCap);
+  return instance;
+}
+
+ObjBoundMethod *newBoundMethod(MemoryManager *mm, Value receiver,
+                               Value method) {
+  ObjBoundMethod *bound = ALLOCATE_OBJ(mm, ObjBoundMethod, OBJ_BOUND_METHOD);
+  bound->receiver = receiver;
+  bound->method = method;
+  return bound;
+}
+
+// The VM gives it its stacks when the generator function is called.
+ObjCoroutine *newCoroutine(MemoryManager *mm) {
+  ObjCoroutine *coroutine = ALLOCATE_OBJ(mm, ObjCoroutine, OBJ_COROUTINE);
+  coroutine->state = COROUTINE_SUSPENDED;
+  coroutine->frames = NULL;
+  coroutine->frameCount = 0;
+  coroutine->frameCap = 0;
+  coroutine->stack = NULL;
+  coroutine->stackTop = NULL;
+  coroutine->stackCap = 0;
+  coroutine->openUpvalues = NULL;
+  coroutine->caller = NULL;
+  return coroutine;
+}
+
+// Returns the shape with the field added after the ones of shape, following
+// the transition if it exists already.
+ObjShape *shapeAddField(MemoryManager *mm, ObjShape *shape, ObjString *name) {
+  Value next;
+  if (tableGet(&shape->transitions, name, &next))
+    return AS_SHAPE(next);
+
+  ObjShape *added = newShape(mm, shape->klass);
+  tableAddAll(&shape->fields, &added->fields);
+  tableSet(&added->fields, name, INT_VAL(shape->fieldCount));
+  added->fieldCount = shape->fieldCount + 1;
+  tableSet(&shape->transitions, name, OBJ_VAL(added));
+
+  if (added->fieldCount > shape->klass->fieldCount)
+    shape->klass->fieldCount = added->fieldCount;
+  return added;
+}
+
 // Approach not using Flexibile Array Member (FAM).
 // ObjString *allocateString(MemoryManager *mm, char *chars, int length) {
 //   ObjString *string = ALLOCATE_OBJ(mm, ObjString, OBJ_STRING);
@@ -86,9 +215,68 @@ ObjString *copyString(MemoryManager *mm, const char *str, int length) {
 
 void printObject(Value value) {
   switch (OBJ_TYPE(value)) {
+  case OBJ_ARRAY: {
+    ValueArray *elements = &AS_ARRAY(value)->elements;
+    printf("[");
+    for (int i = 0; i < elements->count; i++) {
+      printValue(elements->values[i], "", i < elements->count - 1 ? ", " : "");
+    }
+    printf("]");
+    break;
+  }
+  case OBJ_BOUND_METHOD:
+    printValue(AS_BOUND_METHOD(value)->method, "", "");
+    break;
+  case OBJ_CLASS:
+    printf("<class %s>", AS_CLASS(value)->name->str);
+    break;
+  case OBJ_CLOSURE:
+    printf("<fn %s>", AS_CLOSURE(value)->function->name->str);
+    break;
+  case OBJ_COROUTINE:
+    printf("<generator>");
+    break;
+  case OBJ_FLOAT64_ARRAY: {
+    ObjFloat64Array *array = AS_FLOAT64_ARRAY(value);
+    printf("Float64Array[");
+    for (int i = 0; i < array->count; i++) {
+      printf("%g%s", array->values[i], i < array->count - 1 ? ", " : "");
+    }
+    printf("]");
+    break;
+  }
+  case OBJ_FUNCTION:
+    printf("<fn %s>", AS_FUNCTION(value)->name->str);
+    break;
+  case OBJ_INSTANCE:
+    printf("<%s instance>", AS_INSTANCE(value)->shape->klass->name->str);
+    break;
+  case OBJ_MAP: {
+    ObjMap *map = AS_MAP(value);
+    int printed = 0;
+    printf("{");
+    for (int i = 0; i < map->table.cap; i++) {
+      Entry *entry = &map->table.entries[i];
+      if (IS_NIL(entry->key))
+        continue;
+      printValue(entry->key, "", ": ");
+      printValue(entry->value, "", ++printed < map->count ? ", " : "");
+    }
+    printf("}");
+    break;
+  }
+  case OBJ_NATIVE:
+    printf("<native fn %s>", AS_NATIVE(value)->name->str);
+    break;
+  case OBJ_SHAPE:
+    printf("shape");
+    break;
   case OBJ_STRING:
     printf("%s", AS_STRING(value)->str);
     break;
+  case OBJ_UPVALUE:
+    printf("upvalue");
+    break;
   default:
     printf("Undefined Object Type");
     break;
@@ -1,6 +1,7 @@
 #ifndef nrk_object_h
 #define nrk_object_h
 
+#include "chunk.h"
 #include "common.h"
 #include "memory.h"
 #include "value.h"
@@ -10,14 +11,60 @@
 // A function is needed as we need to use "value" twice, meaning it can
 // duplicate side-effects.
 #define IS_STRING(value) isObjType(value, OBJ_STRING)
+#define IS_FUNCTION(value) isObjType(value, OBJ_FUNCTION)
+#define IS_ARRAY(value) isObjType(value, OBJ_ARRAY)
+#define IS_CLOSURE(value) isObjType(value, OBJ_CLOSURE)
+#define IS_NATIVE(value) isObjType(value, OBJ_NATIVE)
+#define IS_MAP(value) isObjType(value, OBJ_MAP)
+#define IS_FLOAT64_ARRAY(value) isObjType(value, OBJ_FLOAT64_ARRAY)
+#define IS_CLASS(value) isObjType(value, OBJ_CLASS)
+#define IS_INSTANCE(value) isObjType(value, OBJ_INSTANCE)
+#define IS_BOUND_METHOD(value) isObjType(value, OBJ_BOUND_METHOD)
+#define IS_COROUTINE(value) isObjType(value, OBJ_COROUTINE)
 
 // Returns the ObjString*
 #define AS_STRING(value) ((ObjString *)AS_OBJ(value))
 // Returns the underlying chars array in ObjString*
 #define AS_CSTRING(value) (((ObjString *)AS_OBJ(value))->str)
+// Returns the ObjFunction*
+#define AS_FUNCTION(value) ((ObjFunction *)AS_OBJ(value))
+// Returns the ObjArray*
+#define AS_ARRAY(value) ((ObjArray *)AS_OBJ(value))
+// Returns the ObjClosure*
+#define AS_CLOSURE(value) ((ObjClosure *)AS_OBJ(value))
+// Returns the ObjNative*
+#define AS_NATIVE(value) ((ObjNative *)AS_OBJ(value))
+// Returns the ObjFloat64Array*
+#define AS_FLOAT64_ARRAY(value) ((ObjFloat64Array *)AS_OBJ(value))
+// Returns the ObjMap*
+#define AS_MAP(value) ((ObjMap *)AS_OBJ(value))
+// Returns the ObjUpvalue*
+#define AS_UPVALUE(value) ((ObjUpvalue *)AS_OBJ(value))
+// Returns the ObjShape*
+#define AS_SHAPE(value) ((ObjShape *)AS_OBJ(value))
+// Returns the ObjClass*
+#define AS_CLASS(value) ((ObjClass *)AS_OBJ(value))
+// Returns the ObjInstance*
+#define AS_INSTANCE(value) ((ObjInstance *)AS_OBJ(value))
+// Returns the ObjBoundMethod*
+#define AS_BOUND_METHOD(value) ((ObjBoundMethod *)AS_OBJ(value))
+// Returns the ObjCoroutine*
+#define AS_COROUTINE(value) ((ObjCoroutine *)AS_OBJ(value))
 
 typedef enum {
+  OBJ_ARRAY,
+  OBJ_BOUND_METHOD,
+  OBJ_CLASS,
+  OBJ_CLOSURE,
+  OBJ_COROUTINE,
+  OBJ_FLOAT64_ARRAY,
+  OBJ_FUNCTION,
+  OBJ_INSTANCE,
+  OBJ_MAP,
+  OBJ_NATIVE,
+  OBJ_SHAPE,
   OBJ_STRING,
+  OBJ_UPVALUE,
 } ObjType;
 
 // We use a kind "Type Punning", (in this case Nystrom calls it Struct
@@ -43,6 +90,217 @@ struct ObjString {
   char str[];
 };
 
+// How OP_CLOSURE fills an upvalue of the closure, from the function creating
+// it.
+typedef enum {
+  // Mutable local: shared through an ObjUpvalue, so both see assignments.
+  CAPTURE_LOCAL,
+  // Constant local: it can't change, so its value is copied.
+  CAPTURE_LOCAL_VALUE,
+  // Upvalue of the enclosing closure, copied as is (ObjUpvalue or value).
+  CAPTURE_UPVALUE,
+  // Receiver of the enclosing method (`this`), copied by value.
+  CAPTURE_THIS,
+} CaptureKind;
+
+typedef struct {
+  uint8_t kind;
+  // Local slot or upvalue index in the enclosing function.
+  uint8_t index;
+} Capture;
+
+// Functions are created by the compiler, each one with its own chunk, and
+// stored as constants of the enclosing chunk.
+struct ObjFunction {
+  Obj obj;
+  // Number of parameters, checked by OP_CALL.
+  int arity;
+  // Variables of the enclosing functions it uses, see ObjClosure. Functions
+  // without upvalues are called directly, without creating a closure.
+  int upvalueCount;
+  Capture *captures;
+  Chunk chunk;
+  ObjString *name;
+  // Has a `yield`: calling it creates a generator (see ObjCoroutine) instead
+  // of running the body.
+  bool isGenerator;
+};
+
+// Upvalues are flat: each closure holds all the variables it uses, even the
+// ones of functions further out, so reading one is a single indirection.
+//
+// Only mutable locals go through an ObjUpvalue, an ObjUpvalue value in the
+// array. Constants are copied into the array by value.
+struct ObjClosure {
+  Obj obj;
+  ObjFunction *function;
+  int upvalueCount;
+  // Flexible array member: must be at the end.
+  Value upvalues[];
+};
+
+// A captured mutable local. While the local is on the stack (open) location
+// points to its slot, once it goes out of scope (closed) the value is moved
+// into closed and location points there.
+struct ObjUpvalue {
+  Obj obj;
+  Value *location;
+  Value closed;
+  // Open upvalues are kept in a list by the VM, sorted by stack slot, top
+  // first.
+  ObjUpvalue *next;
+};
+
+// Arrays keep their elements in a single buffer, grown by doubling its
+// capacity (see writeValueArray()), so pushing is amortized O(1).
+struct ObjArray {
+  Obj obj;
+  ValueArray elements;
+};
+
+// Fixed length array of raw doubles, 8 bytes per element instead of a Value.
+// Arithmetic, comparisons and bitwise operations between them (or with a
+// number) are done elementwise by a single kernel call (see simd.c).
+struct ObjFloat64Array {
+  Obj obj;
+  int count;
+  double values[];
+};
+
+// Maps hash any value but nil to a value (see hashValue()).
+struct ObjMap {
+  Obj obj;
+  Table table;
+  // Live entries, the table count includes the tombstones.
+  int count;
+};
+
+// Layout of the fields of instances (a "hidden class"): the instances that got
+// the same fields in the same order share a shape, and only keep the values,
+// packed in that order. Adding a field moves an instance along a transition to
+// the shape with the field added, created the first time and then shared.
+//
+// Property instructions remember the shapes they've seen with what they found
+// (see InlineCache), so they skip the lookup next time.
+struct ObjShape {
+  Obj obj;
+  // Each class has its own shapes, so a shape also tells the methods.
+  ObjClass *klass;
+  // Field name -> index in the fields of the instances.
+  Table fields;
+  int fieldCount;
+  // Field name -> shape with the field added.
+  Table transitions;
+};
+
+struct ObjClass {
+  Obj obj;
+  ObjString *name;
+  // Method name -> function or closure, the inherited ones are copied in
+  // when the class is declared (see OP_INHERIT).
+  Table methods;
+  // init() method, nil if none. Called with the arguments of the class call.
+  Value initializer;
+  // Shape of the instances without fields.
+  ObjShape *shape;
+  // Most fields of a shape of the class so far: new instances get room for
+  // them up front, instead of growing field by field.
+  int fieldCount;
+};
+
+struct ObjInstance {
+  Obj obj;
+  ObjShape *shape;
+  // Values of the fields, in the order of the shape.
+  Value *fields;
+  int fieldCap;
+};
+
+// Method read from an instance (p.method), remembering its receiver.
+struct ObjBoundMethod {
+  Obj obj;
+  Value receiver;
+  // Function or closure.
+  Value method;
+};
+
+// A function call being executed.
+typedef struct {
+  // Function being executed, NULL for the script.
+  ObjFunction *function;
+
+  // Upvalues of the closure being executed, NULL if the function has none.
+  Value *upvalues;
+
+  // Chunk to be executed
+  Chunk *chunk;
+
+  // Instruction Pointer about to be executed (in chunk.decoded.code)
+  // It is a real pointer as it's easier and faster to use memory directly
+  // Note: it is called PC (Program Counter in some arch like ARM)
+  // Saved here only when calling another function, see run().
+  Instruction *ip;
+
+  // First local slot of the call in the VM stack: the arguments are the first
+  // locals, the callee sits right below them (the receiver, for methods).
+  Value *slots;
+} CallFrame;
+
+typedef enum {
+  COROUTINE_SUSPENDED,
+  COROUTINE_RUNNING,
+  COROUTINE_DONE,
+} CoroutineState;
+
+// A generator runs as a coroutine with its own value stack and call frames,
+// so it can be suspended anywhere and resumed later. The VM only runs on the
+// stacks it holds: resuming a coroutine swaps them with the ones of the
+// coroutine, that keeps the ones of its resumer until it yields and they are
+// swapped back. Nothing is copied.
+struct ObjCoroutine {
+  Obj obj;
+  CoroutineState state;
+
+  // Same as in the VM, see there.
+  CallFrame *frames;
+  int frameCount;
+  int frameCap;
+  Value *stack;
+  Value *stackTop;
+  int stackCap;
+  ObjUpvalue *openUpvalues;
+
+  // Coroutine that resumed it while it runs, NULL for the script.
+  ObjCoroutine *caller;
+};
+
+struct VM;
+
+// Function implemented in C, see defineNative().
+typedef Value (*NativeFn)(struct VM *vm, int argCount, Value *args);
+
+struct ObjNative {
+  Obj obj;
+  NativeFn function;
+  // Number of arguments, checked by OP_CALL, -1 for any.
+  int arity;
+  ObjString *name;
+};
+
+ObjArray *newArray(MemoryManager *mm);
+ObjFunction *newFunction(MemoryManager *mm);
+ObjMap *newMap(MemoryManager *mm);
+ObjFloat64Array *newFloat64Array(MemoryManager *mm, int count);
+ObjClosure *newClosure(MemoryManager *mm, ObjFunction *function);
+ObjUpvalue *newUpvalue(MemoryManager *mm, Value *slot);
+ObjNative *newNative(MemoryManager *mm, NativeFn function, int arity,
+                     ObjString *name);
+ObjClass *newClass(MemoryManager *mm, ObjString *name);
+ObjInstance *newInstance(MemoryManager *mm, ObjClass *klass);
+ObjBoundMethod *newBoundMethod(MemoryManager *mm, Value receiver,
+                               Value method);
+ObjCoroutine *newCoroutine(MemoryManager *mm);
+ObjShape *shapeAddField(MemoryManager *mm, ObjShape *shape, ObjString *name);
 ObjString *copyString(MemoryManager *mm, const char *str, int length);
 void printObject(Value value);
 ObjString *takeString(MemoryManager *mm, char *str, int len);
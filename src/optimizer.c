@@ -0,0 +1,969 @@
+#include <string.h>
+
+#include "memory.h"
+#include "object.h"
+#include "optimizer.h"
+
+// Instruction of the chunk being optimized. Its jump is resolved to the index
+// of the target instruction, so that instructions can be removed or replaced
+// before the bytecode is laid out again.
+typedef struct {
+  // Offset and length in the original bytecode.
+  int offset;
+  int length;
+  // Opcode, after the OP_WIDE prefix if any.
+  uint8_t op;
+  // Slot, upvalue or constant index of the variable instructions.
+  int operand;
+  // Stack effect, as in OpInfo with the arguments popped included.
+  int pops;
+  int pushes;
+  // Stack depth on entry, -1 if no path reaches the instruction.
+  int depth;
+  // Index of the instruction jumped to, -1 if it's not a jump.
+  int target;
+  // Reached by a jump, so it starts a basic block: it can't be combined with
+  // the instructions before it, the stack could hold anything else there.
+  bool isTarget;
+  // One of the jumps following OP_JUMP_HASH or OP_JUMP_TABLE, found by their
+  // position: it can be retargeted but not removed.
+  bool inTable;
+  bool removed;
+  // Replaced by the push of value, see pushLength().
+  bool folded;
+  Value value;
+  // Constant index of the folded value, -1 if it's pushed without one.
+  int constant;
+  int line;
+  int column;
+} OptInstruction;
+
+typedef struct {
+  Chunk *chunk;
+  OptInstruction *code;
+  int count;
+  // Arguments of the function, in the first local slots on entry.
+  int arity;
+} Optimizer;
+
+// What is known of the value of a stack slot, a local or a temporary, at some
+// point of a basic block (see propagateLocals()).
+typedef enum {
+  SLOT_UNKNOWN,
+  // Holds value.
+  SLOT_CONSTANT,
+  // Holds the same value as the local slot.
+  SLOT_COPY,
+} SlotKind;
+
+typedef struct {
+  SlotKind kind;
+  Value value;
+  int slot;
+} SlotValue;
+
+// State of the locals propagation, for the whole stack of the function.
+typedef struct {
+  SlotValue *slots;
+  // Number of slots known as copies of each one.
+  int *copies;
+  // Number of slots whose value is known.
+  int known;
+  // Locals captured by a closure of the function: it could assign them.
+  bool *captured;
+  int count;
+} Propagation;
+
+// Offset of the 16-bit jump distance of a jump instruction.
+static int jumpOffset(OptInstruction *instr) {
+  OperandType operand = getOpInfo(instr->op)->operand;
+  return instr->offset + 1 +
+         (operand == OPERAND_SLOT_JUMP || operand == OPERAND_SLOT_LOOP ? 1
+                                                                       : 0);
+}
+
+// Splits the bytecode in instructions, resolving the jumps.
+static bool build(Optimizer *opt) {
+  Chunk *chunk = opt->chunk;
+
+  // Index of the instruction starting at each offset, -1 in the middle of one.
+  int *indexes = ALLOCATE(int, chunk->count + 1);
+  for (int offset = 0; offset <= chunk->count; offset++) {
+    indexes[offset] = -1;
+  }
+  int count = 0;
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    indexes[offset] = count++;
+  }
+  indexes[chunk->count] = count;
+
+  opt->code = ALLOCATE(OptInstruction, count);
+  opt->count = count;
+
+  bool ok = true;
+  for (int offset = 0, i = 0; offset < chunk->count && ok; i++) {
+    OptInstruction *instr = &opt->code[i];
+    bool wide = chunk->code[offset] == OP_WIDE;
+    instr->offset = offset;
+    instr->length = instructionLength(chunk, offset);
+    instr->op = chunk->code[offset + (wide ? 1 : 0)];
+    instr->operand = 0;
+    instr->depth = -1;
+    instr->target = -1;
+    instr->isTarget = false;
+    instr->inTable = false;
+    instr->removed = false;
+    instr->folded = false;
+    instr->constant = -1;
+    getLinePosition(&chunk->lines, offset, &instr->line, &instr->column);
+
+    const OpInfo *info = getOpInfo(instr->op);
+    if (info == NULL || offset + instr->length > chunk->count) {
+      ok = false;
+      break;
+    }
+
+    int operandOffset = offset + (wide ? 2 : 1);
+    instr->pops = info->pops;
+    instr->pushes = info->pushes;
+    if (info->operand == OPERAND_ARG_COUNT)
+      instr->pops += chunk->code[operandOffset];
+    else if (info->operand == OPERAND_INVOKE)
+      instr->pops += chunk->code[offset + instr->length - 1];
+    switch (info->operand) {
+    case OPERAND_CONSTANT:
+    case OPERAND_SLOT:
+    case OPERAND_UPVALUE:
+    case OPERAND_IMMEDIATE:
+      instr->operand = wide ? (int)GET_WIDE_OPERAND(chunk, operandOffset)
+                            : chunk->code[operandOffset];
+      if (info->operand == OPERAND_IMMEDIATE)
+        instr->operand = wide ? SIGN_EXTEND_24(instr->operand)
+                              : (int8_t)instr->operand;
+      break;
+    case OPERAND_JUMP:
+    case OPERAND_LOOP:
+    case OPERAND_SLOT_JUMP:
+    case OPERAND_SLOT_LOOP: {
+      int at = jumpOffset(instr);
+      int jump = (chunk->code[at] << 8) | chunk->code[at + 1];
+      bool forward = info->operand == OPERAND_JUMP ||
+                     info->operand == OPERAND_SLOT_JUMP;
+      int target = offset + instr->length + (forward ? jump : -jump);
+      if (target < 0 || target > chunk->count || indexes[target] == -1) {
+        ok = false;
+        break;
+      }
+      instr->target = indexes[target];
+      break;
+    }
+    default:
+      break;
+    }
+
+    offset += instr->length;
+  }
+
+  for (int i = 0; i < count && ok; i++) {
+    OptInstruction *instr = &opt->code[i];
+    if (instr->target >= 0 && instr->target < count)
+      opt->code[instr->target].isTarget = true;
+    if (instr->op == OP_JUMP_HASH || instr->op == OP_JUMP_TABLE) {
+      // Taken as all the jumps there, the verifier checks their number.
+      for (int k = i + 1; k < count && (opt->code[k].op == OP_JUMP ||
+                                         opt->code[k].op == OP_LOOP);
+           k++) {
+        opt->code[k].inTable = true;
+      }
+    }
+  }
+
+  FREE_ARR(int, indexes, chunk->count + 1);
+  return ok;
+}
+
+// Index of the last instruction kept before i, -1 if none.
+static int previous(Optimizer *opt, int i) {
+  do {
+    i--;
+  } while (i >= 0 && opt->code[i].removed);
+  return i;
+}
+
+// Removes an instruction. The jumps to it now land on the next one kept,
+// which starts a basic block in its place.
+static void removeInstruction(Optimizer *opt, int i) {
+  opt->code[i].removed = true;
+  if (opt->code[i].isTarget) {
+    for (int next = i + 1; next < opt->count; next++) {
+      if (!opt->code[next].removed) {
+        opt->code[next].isTarget = true;
+        break;
+      }
+    }
+  }
+}
+
+// Value pushed by the instruction, if it's a constant.
+static bool constantOf(Optimizer *opt, int i, Value *value) {
+  if (i < 0)
+    return false;
+
+  OptInstruction *instr = &opt->code[i];
+  if (instr->folded) {
+    *value = instr->value;
+    return true;
+  }
+
+  switch (instr->op) {
+  case OP_NIL:
+    *value = NIL_VAL;
+    return true;
+  case OP_TRUE:
+    *value = BOOL_VAL(true);
+    return true;
+  case OP_FALSE:
+    *value = BOOL_VAL(false);
+    return true;
+  case OP_PUSH_ZERO:
+    *value = INT_VAL(0);
+    return true;
+  case OP_PUSH_ONE:
+    *value = INT_VAL(1);
+    return true;
+  case OP_PUSH_SMALLINT:
+    *value = INT_VAL(instr->operand);
+    return true;
+  case OP_CONSTANT:
+    *value = opt->chunk->constants.values[instr->operand];
+    return !IS_OBJ(*value) || IS_STRING(*value);
+  default:
+    return false;
+  }
+}
+
+// Pushes no more than a value, without side effects or errors.
+static bool isPure(Optimizer *opt, int i) {
+  Value value;
+  if (constantOf(opt, i, &value))
+    return true;
+
+  uint8_t op = opt->code[i].op;
+  return op == OP_GET_LOCAL || op == OP_GET_UPVALUE ||
+         op == OP_GET_CONST_UPVALUE || op == OP_GET_THIS;
+}
+
+static bool isFalsey(Value value) {
+  return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value)) ||
+         (IS_INT(value) && AS_INT(value) == 0) ||
+         (IS_DOUBLE(value) && AS_NUMBER(value) == 0);
+}
+
+// Computes a op b like the VM does, when it can't fail.
+static bool foldBinary(uint8_t op, Value a, Value b, Value *result) {
+  if (op == OP_EQUAL || op == OP_NOT_EQUAL) {
+    *result = BOOL_VAL(valuesEqual(a, b) == (op == OP_EQUAL));
+    return true;
+  }
+
+  if (!IS_NUMBER(a) || !IS_NUMBER(b))
+    return false;
+
+  bool ints = IS_INT(a) && IS_INT(b);
+  int64_t x = ints ? AS_INT(a) : 0, y = ints ? AS_INT(b) : 0, n;
+  double p = AS_NUMBER(a), q = AS_NUMBER(b);
+
+  switch (op) {
+  case OP_ADD:
+    *result = ints && !__builtin_add_overflow(x, y, &n) ? INT_VAL(n)
+                                                         : NUMBER_VAL(p + q);
+    return true;
+  case OP_SUBTRACT:
+    *result = ints && !__builtin_sub_overflow(x, y, &n) ? INT_VAL(n)
+                                                         : NUMBER_VAL(p - q);
+    return true;
+  case OP_MULTIPLY:
+    *result = ints && !__builtin_mul_overflow(x, y, &n) ? INT_VAL(n)
+                                                         : NUMBER_VAL(p * q);
+    return true;
+  case OP_DIVIDE:
+    // Only exact integer divisions give an integer.
+    *result = ints && y != 0 && !(x == INT64_MIN && y == -1) && x % y == 0
+                  ? INT_VAL(x / y)
+                  : NUMBER_VAL(p / q);
+    return true;
+  case OP_GREATER:
+    *result = BOOL_VAL(ints ? x > y : p > q);
+    return true;
+  case OP_GREATER_EQUAL:
+    *result = BOOL_VAL(ints ? x >= y : p >= q);
+    return true;
+  case OP_LESS:
+    *result = BOOL_VAL(ints ? x < y : p < q);
+    return true;
+  case OP_LESS_EQUAL:
+    *result = BOOL_VAL(ints ? x <= y : p <= q);
+    return true;
+  default:
+    break;
+  }
+
+  // Doubles are truncated by the VM, left to it.
+  if (!ints)
+    return false;
+
+  switch (op) {
+  case OP_BITWISE_AND:
+    *result = INT_VAL(x & y);
+    return true;
+  case OP_BITWISE_OR:
+    *result = INT_VAL(x | y);
+    return true;
+  case OP_BITWISE_XOR:
+    *result = INT_VAL(x ^ y);
+    return true;
+  case OP_BITWISE_SHIFT_LEFT:
+    *result = INT_VAL((int64_t)((uint64_t)x << (y & 63)));
+    return true;
+  case OP_BITWISE_SHIFT_RIGHT:
+    *result = INT_VAL(x >> (y & 63));
+    return true;
+  default:
+    return false;
+  }
+}
+
+// Computes op a like the VM does, when it can't fail.
+static bool foldUnary(uint8_t op, Value a, Value *result) {
+  switch (op) {
+  case OP_NOT:
+    *result = BOOL_VAL(isFalsey(a));
+    return true;
+  case OP_NEGATE:
+    if (IS_INT(a) && AS_INT(a) != INT64_MIN) {
+      *result = INT_VAL(-AS_INT(a));
+    } else if (IS_NUMBER(a)) {
+      *result = NUMBER_VAL(-AS_NUMBER(a));
+    } else {
+      return false;
+    }
+    return true;
+  case OP_BITWISE_NOT:
+    if (!IS_INT(a))
+      return false;
+    *result = INT_VAL(~AS_INT(a));
+    return true;
+  default:
+    return false;
+  }
+}
+
+// Jump with a constant condition: taken, it becomes an OP_JUMP, otherwise
+// it's removed, and the constants it pops with it. The code no longer
+// reached is then removed by removeUnreachable(), e.g. the body of
+// `if (DEBUG)` with `const DEBUG = false`.
+static bool foldBranch(Optimizer *opt, int i, int b) {
+  OptInstruction *instr = &opt->code[i];
+  Value x, y, result;
+  if (!constantOf(opt, b, &y))
+    return false;
+
+  bool taken;
+  switch (instr->op) {
+  case OP_JUMP_IF_FALSE:
+  case OP_JUMP_IF_TRUE:
+    // The value stays on the stack.
+    taken = isFalsey(y) == (instr->op == OP_JUMP_IF_FALSE);
+    break;
+  case OP_POP_JUMP_IF_FALSE:
+  case OP_POP_JUMP_IF_TRUE:
+    taken = isFalsey(y) == (instr->op == OP_POP_JUMP_IF_FALSE);
+    removeInstruction(opt, b);
+    break;
+  case OP_JUMP_IF_NOT_GREATER:
+  case OP_JUMP_IF_NOT_GREATER_EQUAL:
+  case OP_JUMP_IF_NOT_LESS:
+  case OP_JUMP_IF_NOT_LESS_EQUAL: {
+    static const uint8_t comparisons[] = {OP_GREATER, OP_GREATER_EQUAL,
+                                          OP_LESS, OP_LESS_EQUAL};
+    int a = previous(opt, b);
+    if (opt->code[b].isTarget || !constantOf(opt, a, &x) ||
+        !foldBinary(comparisons[instr->op - OP_JUMP_IF_NOT_GREATER], x, y,
+                    &result))
+      return false;
+    taken = !AS_BOOL(result);
+    removeInstruction(opt, a);
+    removeInstruction(opt, b);
+    break;
+  }
+  default:
+    return false;
+  }
+
+  if (taken) {
+    instr->op = OP_JUMP;
+  } else {
+    removeInstruction(opt, i);
+  }
+  return true;
+}
+
+static void fold(OptInstruction *instr, Value value) {
+  instr->folded = true;
+  instr->value = value;
+}
+
+// Follows every path from the entry like the verifier does, setting the stack
+// depth on entry of the instructions reached (-1 for the others). Returns
+// false if two paths reach an instruction with different depths, or if the
+// stack underflows, as the verifier would reject the bytecode.
+static bool computeDepths(Optimizer *opt) {
+  int *worklist = ALLOCATE(int, opt->count);
+  for (int i = 0; i < opt->count; i++) {
+    opt->code[i].depth = -1;
+  }
+
+  bool consistent = true;
+  int pending = 0;
+  if (opt->count > 0) {
+    opt->code[0].depth = opt->arity;
+    worklist[pending++] = 0;
+  }
+
+  while (pending > 0) {
+    int i = worklist[--pending];
+    OptInstruction *instr = &opt->code[i];
+    int depth = instr->depth - instr->pops + instr->pushes;
+    if (instr->op == __OP_STACK_RESET)
+      depth = 0;
+    if (instr->depth < instr->pops) {
+      consistent = false;
+      depth = 0;
+    }
+
+    // At most the target, the next instruction, and for a switch dispatch
+    // the miss and case jumps following it.
+    int successors[2] = {instr->target, -1};
+    switch (instr->op) {
+    case OP_RETURN:
+    case OP_RETURN_VALUE:
+      successors[0] = -1;
+      break;
+    case OP_JUMP:
+    case OP_LOOP:
+      break;
+    case OP_JUMP_HASH:
+    case OP_JUMP_TABLE:
+      for (int k = i + 1; k < opt->count && opt->code[k].inTable; k++) {
+        if (opt->code[k].depth == -1) {
+          opt->code[k].depth = depth;
+          worklist[pending++] = k;
+        }
+      }
+      successors[1] = i + 1;
+      break;
+    default:
+      successors[1] = i + 1;
+      break;
+    }
+
+    for (int s = 0; s < 2; s++) {
+      int next = successors[s];
+      if (next < 0 || next >= opt->count)
+        continue;
+      if (opt->code[next].depth == -1) {
+        opt->code[next].depth = depth;
+        worklist[pending++] = next;
+      } else if (opt->code[next].depth != depth) {
+        consistent = false;
+      }
+    }
+  }
+
+  FREE_ARR(int, worklist, opt->count);
+  return consistent;
+}
+
+// Folds the instruction with the ones before it, if they push constants.
+static void foldInstruction(Optimizer *opt, int i) {
+  OptInstruction *instr = &opt->code[i];
+  if (instr->removed || instr->isTarget)
+    return;
+
+  int b = previous(opt, i);
+  if (b < 0)
+    return;
+
+  if (foldBranch(opt, i, b))
+    return;
+
+  if (instr->op == OP_POP && isPure(opt, b)) {
+    removeInstruction(opt, b);
+    removeInstruction(opt, i);
+    return;
+  }
+
+  Value x, y, result;
+  if (!constantOf(opt, b, &y))
+    return;
+
+  if (foldUnary(instr->op, y, &result)) {
+    removeInstruction(opt, b);
+    fold(instr, result);
+    return;
+  }
+
+  int a = previous(opt, b);
+  if (!opt->code[b].isTarget && constantOf(opt, a, &x) &&
+      foldBinary(instr->op, x, y, &result)) {
+    removeInstruction(opt, a);
+    removeInstruction(opt, b);
+    fold(instr, result);
+  }
+}
+
+static void setSlot(Propagation *prop, int slot, SlotKind kind, Value value,
+                    int source) {
+  SlotValue *current = &prop->slots[slot];
+  // A captured local can change behind the function's back.
+  if (prop->captured[slot] || (kind == SLOT_COPY && prop->captured[source]))
+    kind = SLOT_UNKNOWN;
+
+  if (current->kind == SLOT_COPY)
+    prop->copies[current->slot]--;
+  if (current->kind != SLOT_UNKNOWN)
+    prop->known--;
+
+  current->kind = kind;
+  current->value = value;
+  current->slot = source;
+
+  if (kind == SLOT_COPY)
+    prop->copies[source]++;
+  if (kind != SLOT_UNKNOWN)
+    prop->known++;
+}
+
+// The slot changes or is popped: its value isn't known anymore, and neither
+// are the values known as copies of it.
+static void forgetSlot(Propagation *prop, int slot) {
+  setSlot(prop, slot, SLOT_UNKNOWN, NIL_VAL, 0);
+  for (int k = 0; k < prop->count && prop->copies[slot] > 0; k++) {
+    if (prop->slots[k].kind == SLOT_COPY && prop->slots[k].slot == slot)
+      setSlot(prop, k, SLOT_UNKNOWN, NIL_VAL, 0);
+  }
+}
+
+static void forgetSlots(Propagation *prop) {
+  for (int k = 0; k < prop->count && prop->known > 0; k++) {
+    setSlot(prop, k, SLOT_UNKNOWN, NIL_VAL, 0);
+  }
+}
+
+// Replaces the load of a local whose value is known: by the push of the
+// constant, or by the load of the local it's a copy of.
+static void propagateLoad(Optimizer *opt, Propagation *prop, int i) {
+  OptInstruction *instr = &opt->code[i];
+  // Other paths join at a jump target, nothing is known of them.
+  if (instr->isTarget || instr->depth == -1)
+    forgetSlots(prop);
+
+  // Slots are a byte, except in the wide form which isn't rewritten.
+  if (instr->removed || instr->op != OP_GET_LOCAL || instr->length != 2 ||
+      instr->operand >= prop->count)
+    return;
+
+  SlotValue *slot = &prop->slots[instr->operand];
+  if (slot->kind == SLOT_CONSTANT) {
+    fold(instr, slot->value);
+  } else if (slot->kind == SLOT_COPY) {
+    instr->operand = slot->slot;
+  }
+}
+
+// Records what the instruction leaves in the slots it pops and pushes, and in
+// the local it assigns.
+static void updateSlots(Optimizer *opt, Propagation *prop, int i) {
+  OptInstruction *instr = &opt->code[i];
+  OperandType operand = getOpInfo(instr->op)->operand;
+  if (instr->depth == -1)
+    return;
+  // Loops assign their slots, and a stack reset drops them all.
+  if (operand == OPERAND_SLOT_JUMP || operand == OPERAND_SLOT_LOOP ||
+      instr->op == __OP_STACK_RESET) {
+    forgetSlots(prop);
+    return;
+  }
+
+  int base = instr->depth - instr->pops;
+  int top = base + instr->pushes;
+  if (base < 0 || top > prop->count) {
+    forgetSlots(prop);
+    return;
+  }
+
+  SlotValue stored = {SLOT_UNKNOWN, NIL_VAL, 0};
+  if (instr->op == OP_SET_LOCAL)
+    stored = prop->slots[instr->depth - 1];
+
+  int end = instr->depth > top ? instr->depth : top;
+  for (int k = base; k < end; k++) {
+    forgetSlot(prop, k);
+  }
+
+  Value value;
+  if (instr->pushes != 1 || instr->removed) {
+    return;
+  } else if (constantOf(opt, i, &value)) {
+    setSlot(prop, top - 1, SLOT_CONSTANT, value, 0);
+  } else if (instr->op == OP_GET_LOCAL) {
+    setSlot(prop, top - 1, SLOT_COPY, NIL_VAL, instr->operand);
+  } else if (instr->op == OP_SET_LOCAL) {
+    int local = instr->operand;
+    setSlot(prop, top - 1, stored.kind, stored.value, stored.slot);
+    // Assigning a copy of the local to itself changes nothing.
+    if (stored.kind == SLOT_COPY && stored.slot == local)
+      return;
+    forgetSlot(prop, local);
+    setSlot(prop, local, stored.kind, stored.value, stored.slot);
+  }
+}
+
+// Constant folding: an operation on constants is replaced by the push of its
+// result, e.g. `2 * 3 + 1` by 7 and `-1` by a single push. As it goes forward,
+// the result of a fold is folded again with what uses it, including branches
+// (see foldBranch()). A pure push followed by OP_POP is removed altogether.
+//
+// The instructions combined must be in the same basic block: only the first
+// one can be a jump target.
+//
+// With prop, the values of the locals are propagated along: within a basic
+// block, a local holding a constant is read as the constant, folded again with
+// what uses it, and a local holding a copy of another one is read from the
+// latter. `var x = 3; var y = x + 1; return y * 2;` returns 8 without reading
+// a local.
+static void foldConstants(Optimizer *opt, Propagation *prop) {
+  for (int i = 0; i < opt->count; i++) {
+    if (prop != NULL)
+      propagateLoad(opt, prop, i);
+    foldInstruction(opt, i);
+    if (prop != NULL)
+      updateSlots(opt, prop, i);
+  }
+}
+
+// Sets up the locals propagation of foldConstants(), for the stack depths
+// computed, or returns false if they can't be.
+static bool initPropagation(Optimizer *opt, Propagation *prop) {
+  if (!computeDepths(opt))
+    return false;
+
+  int count = opt->arity;
+  for (int i = 0; i < opt->count; i++) {
+    OptInstruction *instr = &opt->code[i];
+    int depth = instr->depth - instr->pops + instr->pushes;
+    if (instr->depth > count)
+      count = instr->depth;
+    if (depth > count)
+      count = depth;
+  }
+
+  prop->count = count;
+  prop->known = 0;
+  prop->slots = ALLOCATE(SlotValue, count);
+  prop->copies = ALLOCATE(int, count);
+  prop->captured = ALLOCATE(bool, count);
+  for (int k = 0; k < count; k++) {
+    prop->slots[k].kind = SLOT_UNKNOWN;
+    prop->copies[k] = 0;
+    prop->captured[k] = false;
+  }
+
+  // Only the locals captured as variables can be assigned by the closure, the
+  // constant ones are copied.
+  for (int i = 0; i < opt->count; i++) {
+    if (opt->code[i].op != OP_CLOSURE)
+      continue;
+    Value function = opt->chunk->constants.values[opt->code[i].operand];
+    if (!IS_FUNCTION(function))
+      continue;
+    for (int c = 0; c < AS_FUNCTION(function)->upvalueCount; c++) {
+      Capture *capture = &AS_FUNCTION(function)->captures[c];
+      if (capture->kind == CAPTURE_LOCAL && capture->index < count)
+        prop->captured[capture->index] = true;
+    }
+  }
+  return true;
+}
+
+static void freePropagation(Propagation *prop) {
+  FREE_ARR(SlotValue, prop->slots, prop->count);
+  FREE_ARR(int, prop->copies, prop->count);
+  FREE_ARR(bool, prop->captured, prop->count);
+}
+
+// Store to load forwarding: `x = v; ... x` stores v with OP_SET_LOCAL, pops
+// it, and pushes it back with OP_GET_LOCAL. Keeping it on the stack instead
+// removes the pop and the load. Same for upvalues and globals, a successful
+// OP_SET_GLOBAL leaving the global defined.
+static void forwardStores(Optimizer *opt) {
+  for (int i = 0; i < opt->count; i++) {
+    OptInstruction *load = &opt->code[i];
+    if (load->removed || load->isTarget)
+      continue;
+
+    uint8_t store;
+    switch (load->op) {
+    case OP_GET_LOCAL:
+      store = OP_SET_LOCAL;
+      break;
+    case OP_GET_UPVALUE:
+      store = OP_SET_UPVALUE;
+      break;
+    case OP_GET_GLOBAL:
+      store = OP_SET_GLOBAL;
+      break;
+    default:
+      continue;
+    }
+
+    int pop = previous(opt, i);
+    if (pop < 0 || opt->code[pop].op != OP_POP || opt->code[pop].isTarget)
+      continue;
+    int set = previous(opt, pop);
+    if (set < 0 || opt->code[set].op != store)
+      continue;
+    // Each use of a global has its own name constant.
+    ValueArray *constants = &opt->chunk->constants;
+    if (store == OP_SET_GLOBAL
+            ? !valuesEqual(constants->values[opt->code[set].operand],
+                           constants->values[load->operand])
+            : opt->code[set].operand != load->operand)
+      continue;
+
+    removeInstruction(opt, pop);
+    removeInstruction(opt, i);
+  }
+}
+
+// Dead code elimination: removes the instructions no path reaches, e.g. after
+// a return or around the jump over an else branch that ends with one.
+static void removeUnreachable(Optimizer *opt) {
+  computeDepths(opt);
+  for (int i = 0; i < opt->count; i++) {
+    if (opt->code[i].depth == -1)
+      opt->code[i].removed = true;
+  }
+}
+
+// Index of the first instruction kept from i, opt->count at the end.
+static int nextKept(Optimizer *opt, int i) {
+  while (i < opt->count && opt->code[i].removed) {
+    i++;
+  }
+  return i;
+}
+
+// Jump threading: a jump to an unconditional jump goes straight to where the
+// latter goes, e.g. from the end of a nested if to the end of the enclosing
+// one. Jumps only go one way, OP_JUMP and OP_LOOP excepted as they swap for
+// each other, so a chain is followed as far as the jump can reach. An
+// OP_JUMP to the next instruction is then removed: going backward, the jumps
+// after it are already gone if they had to.
+static void threadJumps(Optimizer *opt) {
+  for (int i = opt->count - 1; i >= 0; i--) {
+    OptInstruction *instr = &opt->code[i];
+    if (instr->removed || instr->target == -1)
+      continue;
+
+    OperandType operand = getOpInfo(instr->op)->operand;
+    bool unconditional = instr->op == OP_JUMP || instr->op == OP_LOOP;
+    bool forward = operand == OPERAND_JUMP || operand == OPERAND_SLOT_JUMP;
+
+    // The chain can loop (`while (true) {}`), it's followed at most once
+    // through each instruction.
+    int target = nextKept(opt, instr->target);
+    for (int steps = 0; steps < opt->count; steps++) {
+      if (target >= opt->count || target == i ||
+          (opt->code[target].op != OP_JUMP && opt->code[target].op != OP_LOOP))
+        break;
+      int next = nextKept(opt, opt->code[target].target);
+      if (!unconditional && (next > i) != forward)
+        break;
+      target = next;
+    }
+
+    if (unconditional)
+      instr->op = target > i ? OP_JUMP : OP_LOOP;
+    instr->target = target;
+
+    if (instr->op == OP_JUMP && !instr->inTable &&
+        target == nextKept(opt, i + 1))
+      instr->removed = true;
+  }
+}
+
+// Constant pool index of a folded value, reusing an equal constant.
+static int constantIndex(Chunk *chunk, Value value) {
+  for (int i = 0; i < chunk->constants.count; i++) {
+    Value constant = chunk->constants.values[i];
+    if (constant.type == value.type &&
+        memcmp(&constant.as, &value.as, sizeof(value.as)) == 0)
+      return i;
+  }
+  return addConstant(chunk, value);
+}
+
+// Length of the push of a folded value, with the same encodings as the
+// compiler's emitInteger().
+static int pushLength(Chunk *chunk, OptInstruction *instr) {
+  Value value = instr->value;
+  if (IS_NIL(value) || IS_BOOL(value) ||
+      (IS_INT(value) && (AS_INT(value) == 0 || AS_INT(value) == 1)))
+    return 1;
+  if (IS_INT(value) && AS_INT(value) >= SMALLINT_MIN &&
+      AS_INT(value) <= SMALLINT_MAX)
+    return 2;
+
+  if (instr->constant == -1)
+    instr->constant = constantIndex(chunk, value);
+  return instr->constant > UINT8_MAX ? 5 : 2;
+}
+
+static int writePush(uint8_t *code, OptInstruction *instr) {
+  Value value = instr->value;
+  if (IS_NIL(value)) {
+    code[0] = OP_NIL;
+  } else if (IS_BOOL(value)) {
+    code[0] = AS_BOOL(value) ? OP_TRUE : OP_FALSE;
+  } else if (instr->constant == -1 && AS_INT(value) == 0) {
+    code[0] = OP_PUSH_ZERO;
+  } else if (instr->constant == -1 && AS_INT(value) == 1) {
+    code[0] = OP_PUSH_ONE;
+  } else if (instr->constant == -1) {
+    code[0] = OP_PUSH_SMALLINT;
+    code[1] = (uint8_t)AS_INT(value);
+    return 2;
+  } else if (instr->constant > UINT8_MAX) {
+    code[0] = OP_WIDE;
+    code[1] = OP_CONSTANT;
+    code[2] = (instr->constant >> 16) & 0xff;
+    code[3] = (instr->constant >> 8) & 0xff;
+    code[4] = instr->constant & 0xff;
+    return 5;
+  } else {
+    code[0] = OP_CONSTANT;
+    code[1] = (uint8_t)instr->constant;
+    return 2;
+  }
+  return 1;
+}
+
+// Lays out the instructions kept, with their jumps relocated, in place of the
+// chunk's bytecode and line information. Gives up (keeping the chunk as it
+// was) if a jump doesn't fit in its operand anymore.
+static void emit(Optimizer *opt) {
+  Chunk *chunk = opt->chunk;
+
+  // New offset of each instruction, a removed one being at the next one kept.
+  int *offsets = ALLOCATE(int, opt->count + 1);
+  int size = 0;
+  for (int i = 0; i < opt->count; i++) {
+    OptInstruction *instr = &opt->code[i];
+    offsets[i] = size;
+    if (!instr->removed)
+      size += instr->folded ? pushLength(chunk, instr) : instr->length;
+  }
+  offsets[opt->count] = size;
+
+  uint8_t *code = ALLOCATE(uint8_t, size > 0 ? size : 1);
+  LineArray lines;
+  initLineArray(&lines);
+
+  bool ok = true;
+  for (int i = 0; i < opt->count && ok; i++) {
+    OptInstruction *instr = &opt->code[i];
+    if (instr->removed)
+      continue;
+
+    uint8_t *at = code + offsets[i];
+    int length = instr->length;
+    if (instr->folded) {
+      length = writePush(at, instr);
+    } else {
+      memcpy(at, chunk->code + instr->offset, length);
+      // The local read may have changed, see propagateLoad().
+      if (instr->op == OP_GET_LOCAL && length == 2)
+        at[1] = (uint8_t)instr->operand;
+    }
+
+    if (!instr->folded && instr->target != -1) {
+      // The opcode may have changed (see foldBranch()), jumps aren't wide.
+      at[0] = instr->op;
+      int end = offsets[i] + length;
+      int distance = getOpInfo(instr->op)->operand == OPERAND_JUMP ||
+                             getOpInfo(instr->op)->operand == OPERAND_SLOT_JUMP
+                         ? offsets[instr->target] - end
+                         : end - offsets[instr->target];
+      if (distance < 0 || distance > UINT16_MAX) {
+        ok = false;
+        break;
+      }
+      uint8_t *jump = code + offsets[i] + (jumpOffset(instr) - instr->offset);
+      jump[0] = (distance >> 8) & 0xff;
+      jump[1] = distance & 0xff;
+    }
+
+    for (int k = 0; k < length; k++) {
+      setLine(&lines, instr->line, instr->column);
+    }
+  }
+
+  if (ok) {
+    FREE_ARR(uint8_t, chunk->code, chunk->cap);
+    freeLineArray(&chunk->lines);
+    chunk->code = code;
+    chunk->count = size;
+    chunk->cap = size > 0 ? size : 1;
+    chunk->lines = lines;
+  } else {
+    FREE_ARR(uint8_t, code, size > 0 ? size : 1);
+    freeLineArray(&lines);
+  }
+
+  FREE_ARR(int, offsets, opt->count + 1);
+}
+
+// Optimizes the bytecode of a function once it's compiled, with the passes of
+// the level (see OptimizationLevel). The function takes arity arguments.
+//
+// The compiler is single pass and emits bytecode as it parses, so it only
+// sees the instructions it just emitted. Here the whole function is known:
+// the bytecode is split in instructions with resolved jumps and stack depths,
+// whose basic blocks start at the jump targets. The passes remove, replace or
+// rewrite instructions in place, then the bytecode is laid out again.
+void optimizeChunk(Chunk *chunk, int arity, OptimizationLevel level) {
+  if (level == OPTIMIZE_NONE || chunk->count == 0)
+    return;
+
+  Optimizer opt = {.chunk = chunk, .code = NULL, .count = 0, .arity = arity};
+  if (build(&opt)) {
+    Propagation prop;
+    if (level >= OPTIMIZE_FULL && initPropagation(&opt, &prop)) {
+      foldConstants(&opt, &prop);
+      freePropagation(&prop);
+    } else {
+      foldConstants(&opt, NULL);
+    }
+    if (level >= OPTIMIZE_FULL)
+      forwardStores(&opt);
+    removeUnreachable(&opt);
+    threadJumps(&opt);
+    // Jumps threaded past a block may leave it unreached.
+    removeUnreachable(&opt);
+    emit(&opt);
+  }
+
+  FREE_ARR(OptInstruction, opt.code, opt.count);
+}
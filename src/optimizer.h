@@ -0,0 +1,22 @@
+#ifndef nrk_optimizer_h
+#define nrk_optimizer_h
+
+#include "chunk.h"
+
+// Optimization levels, selected with the -O flag of nrk (see optimizeChunk()).
+typedef enum {
+  // The bytecode runs as compiled.
+  OPTIMIZE_NONE,
+  // Operations on constants are folded, and dead code is removed.
+  OPTIMIZE_BASIC,
+  // The constants and copies held by locals are also propagated to their
+  // loads within a basic block, and a stored value is forwarded to the load
+  // right after it. There's no common subexpression elimination.
+  OPTIMIZE_FULL,
+} OptimizationLevel;
+
+#define OPTIMIZATION_LEVEL_DEFAULT OPTIMIZE_BASIC
+
+void optimizeChunk(Chunk *chunk, int arity, OptimizationLevel level);
+
+#endif
@@ -285,9 +285,10 @@ static void handle_regular_input(REPLState *state, char c) {
   }
 }
 
-void repl() {
+void repl(OptimizationLevel level) {
   REPLState state = {0};
   state.vm = initVM();
+  state.vm->compiler->optimizationLevel = level;
 
   // Load history from file
   history_load_from_file(&state.history);
@@ -1,6 +1,8 @@
 #ifndef nrk_repl_h
 #define nrk_repl_h
 
+#include "optimizer.h"
+
 #define REPL_HISTORY_MAX (1 << 8)
 #define REPL_LINE_MAX (1 << 10)
 
@@ -14,6 +16,6 @@
 #define ARROW_RIGHT 'C'
 #define ARROW_LEFT 'D'
 
-void repl();
+void repl(OptimizationLevel level);
 
 #endif
@@ -14,10 +14,18 @@ const char *tokenTypeToString(TokenType type) {
     return "TOKEN_LEFT_BRACE";
   case TOKEN_RIGHT_BRACE:
     return "TOKEN_RIGHT_BRACE";
+  case TOKEN_LEFT_BRACKET:
+    return "TOKEN_LEFT_BRACKET";
+  case TOKEN_RIGHT_BRACKET:
+    return "TOKEN_RIGHT_BRACKET";
   case TOKEN_COMMA:
     return "TOKEN_COMMA";
+  case TOKEN_COLON:
+    return "TOKEN_COLON";
   case TOKEN_DOT:
     return "TOKEN_DOT";
+  case TOKEN_DOT_DOT:
+    return "TOKEN_DOT_DOT";
   case TOKEN_MINUS:
     return "TOKEN_MINUS";
   case TOKEN_PLUS:
@@ -62,8 +70,12 @@ const char *tokenTypeToString(TokenType type) {
     return "TOKEN_NUMBER";
   case TOKEN_AND:
     return "TOKEN_AND";
+  case TOKEN_CASE:
+    return "TOKEN_CASE";
   case TOKEN_CLASS:
     return "TOKEN_CLASS";
+  case TOKEN_DEFAULT:
+    return "TOKEN_DEFAULT";
   case TOKEN_ELSE:
     return "TOKEN_ELSE";
   case TOKEN_FALSE:
@@ -74,6 +86,8 @@ const char *tokenTypeToString(TokenType type) {
     return "TOKEN_FUN";
   case TOKEN_IF:
     return "TOKEN_IF";
+  case TOKEN_IN:
+    return "TOKEN_IN";
   case TOKEN_NIL:
     return "TOKEN_NIL";
   case TOKEN_OR:
@@ -84,6 +98,8 @@ const char *tokenTypeToString(TokenType type) {
     return "TOKEN_RETURN";
   case TOKEN_SUPER:
     return "TOKEN_SUPER";
+  case TOKEN_SWITCH:
+    return "TOKEN_SWITCH";
   case TOKEN_THIS:
     return "TOKEN_THIS";
   case TOKEN_TRUE:
@@ -94,6 +110,8 @@ const char *tokenTypeToString(TokenType type) {
     return "TOKEN_CONST";
   case TOKEN_WHILE:
     return "TOKEN_WHILE";
+  case TOKEN_YIELD:
+    return "TOKEN_YIELD";
   case TOKEN_ERROR:
     return "TOKEN_ERROR";
   case TOKEN_PLUS_PLUS:
@@ -136,6 +154,10 @@ Scanner *initScanner(const char *source) {
   scanner->start = source;
   scanner->curr = source;
   scanner->line = 1;
+  scanner->lineStart = source;
+  scanner->startColumn = 1;
+  scanner->inTemplate = false;
+  scanner->templateNesting = 0;
 
   return scanner;
 }
@@ -174,6 +196,7 @@ static void skipWhitespaceAndComments(Scanner *scanner) {
     case '\n':
       scanner->line++;
       advance(scanner);
+      scanner->lineStart = scanner->curr;
       break;
     case '/':
       if (peekNext(scanner) == '/') {
@@ -217,6 +240,7 @@ static Token errorToken(Scanner *scanner, char *message) {
   token.start = message;
   token.length = (int)strlen(message);
   token.line = scanner->line;
+  token.column = scanner->startColumn;
 
   return token;
 }
@@ -228,6 +252,7 @@ Token makeToken(Scanner *scanner, TokenType t) {
   token.start = scanner->start;
   token.length = (int)(scanner->curr - scanner->start);
   token.line = scanner->line;
+  token.column = scanner->startColumn;
 
 #ifdef DEBUG_SCAN_EXECUTION
   printf("makeToken(%s)\n", tokenTypeToString(token.type));
@@ -255,6 +280,8 @@ static TokenType identifierType(Scanner *scanner) {
   case 'c':
     if (scanner->curr - scanner->start > 1) {
       switch (scanner->start[1]) {
+      case 'a':
+        return checkKeyword(scanner, 2, 2, "se", TOKEN_CASE);
       case 'o':
         return checkKeyword(scanner, 2, 3, "nst", TOKEN_CONST);
       case 'l':
@@ -262,6 +289,8 @@ static TokenType identifierType(Scanner *scanner) {
       }
     }
     break;
+  case 'd':
+    return checkKeyword(scanner, 1, 6, "efault", TOKEN_DEFAULT);
   case 'e':
     return checkKeyword(scanner, 1, 3, "lse", TOKEN_ELSE);
   case 'f':
@@ -277,7 +306,15 @@ static TokenType identifierType(Scanner *scanner) {
     }
     break;
   case 'i':
-    return checkKeyword(scanner, 1, 1, "f", TOKEN_IF);
+    if (scanner->curr - scanner->start > 1) {
+      switch (scanner->start[1]) {
+      case 'f':
+        return checkKeyword(scanner, 2, 0, "", TOKEN_IF);
+      case 'n':
+        return checkKeyword(scanner, 2, 0, "", TOKEN_IN);
+      }
+    }
+    break;
   case 'n':
     return checkKeyword(scanner, 1, 2, "il", TOKEN_NIL);
   case 'o':
@@ -287,7 +324,15 @@ static TokenType identifierType(Scanner *scanner) {
   case 'r':
     return checkKeyword(scanner, 1, 5, "eturn", TOKEN_RETURN);
   case 's':
-    return checkKeyword(scanner, 1, 4, "uper", TOKEN_SUPER);
+    if (scanner->curr - scanner->start > 1) {
+      switch (scanner->start[1]) {
+      case 'u':
+        return checkKeyword(scanner, 2, 3, "per", TOKEN_SUPER);
+      case 'w':
+        return checkKeyword(scanner, 2, 4, "itch", TOKEN_SWITCH);
+      }
+    }
+    break;
   case 't':
     if (scanner->curr - scanner->start > 1) {
       switch (scanner->start[1]) {
@@ -302,6 +347,8 @@ static TokenType identifierType(Scanner *scanner) {
     return checkKeyword(scanner, 1, 2, "ar", TOKEN_VAR);
   case 'w':
     return checkKeyword(scanner, 1, 4, "hile", TOKEN_WHILE);
+  case 'y':
+    return checkKeyword(scanner, 1, 4, "ield", TOKEN_YIELD);
   }
 
   return TOKEN_IDENTIFIER;
@@ -347,12 +394,11 @@ Token templateString(Scanner *scanner) {
       return makeToken(scanner, TOKEN_TEMPL_INTERP_START);
     }
 
-    if (peek(scanner) == '\n') {
+    // In any other case, advance one char (e.g. content increasing)
+    if (advance(scanner) == '\n') {
       scanner->line++;
+      scanner->lineStart = scanner->curr;
     }
-
-    // In any other case, advance one char (e.g. content increasing)
-    advance(scanner);
   }
 
   // Consume the remaining content if at the end
@@ -365,9 +411,10 @@ Token templateString(Scanner *scanner) {
 
 Token string(Scanner *scanner) {
   while (peek(scanner) != '"' && !isAtEnd(scanner)) {
-    if (peek(scanner) == '\n')
+    if (advance(scanner) == '\n') {
       scanner->line++;
-    advance(scanner);
+      scanner->lineStart = scanner->curr;
+    }
   }
 
   if (isAtEnd(scanner)) {
@@ -382,7 +429,8 @@ Token number(Scanner *scanner) {
   while (isDigit(peek(scanner)))
     advance(scanner);
 
-  if (peek(scanner) == '.' && peekNext(scanner))
+  // A dot not followed by a digit is not part of the number (e.g. `0..10`).
+  if (peek(scanner) == '.' && isDigit(peekNext(scanner)))
     advance(scanner);
 
   while (isDigit(peek(scanner)))
@@ -397,6 +445,7 @@ Token scanToken(Scanner *scanner) {
   // Set the start of the current token, so in makeToken() it can calculate the
   // length.
   scanner->start = scanner->curr;
+  scanner->startColumn = (int)(scanner->start - scanner->lineStart) + 1;
 
   if (isAtEnd(scanner)) {
     return makeToken(scanner, TOKEN_EOF);
@@ -423,6 +472,10 @@ Token scanToken(Scanner *scanner) {
     return makeToken(scanner, TOKEN_RIGHT_PAREN);
   case '{':
     return makeToken(scanner, TOKEN_LEFT_BRACE);
+  case '[':
+    return makeToken(scanner, TOKEN_LEFT_BRACKET);
+  case ']':
+    return makeToken(scanner, TOKEN_RIGHT_BRACKET);
   case '}': {
     // If I was in a template but consuming an interpolated expression, consume
     // the closing brace.
@@ -439,8 +492,11 @@ Token scanToken(Scanner *scanner) {
     return makeToken(scanner, TOKEN_SEMICOLON);
   case ',':
     return makeToken(scanner, TOKEN_COMMA);
+  case ':':
+    return makeToken(scanner, TOKEN_COLON);
   case '.':
-    return makeToken(scanner, TOKEN_DOT);
+    return makeToken(scanner,
+                     match(scanner, '.') ? TOKEN_DOT_DOT : TOKEN_DOT);
   case '-':
     if (match(scanner, '-'))
       return makeToken(scanner, TOKEN_MINUS_MINUS);
@@ -7,6 +7,10 @@ typedef struct {
   const char *start;
   const char *curr;
   int line;
+  // Beginning of the current line and column where the current token starts,
+  // to track the column of tokens.
+  const char *lineStart;
+  int startColumn;
   bool inTemplate;
   int templateNesting;
 } Scanner;
@@ -17,8 +21,12 @@ typedef enum {
   TOKEN_RIGHT_PAREN,
   TOKEN_LEFT_BRACE,
   TOKEN_RIGHT_BRACE,
+  TOKEN_LEFT_BRACKET,
+  TOKEN_RIGHT_BRACKET,
   TOKEN_COMMA,
+  TOKEN_COLON,
   TOKEN_DOT,
+  TOKEN_DOT_DOT, // .. (range)
   TOKEN_MINUS,
   TOKEN_PLUS,
   TOKEN_SEMICOLON,
@@ -57,22 +65,27 @@ typedef enum {
   TOKEN_NUMBER,
   // Keywords.
   TOKEN_AND,
+  TOKEN_CASE,
   TOKEN_CLASS,
+  TOKEN_DEFAULT,
   TOKEN_ELSE,
   TOKEN_FALSE,
   TOKEN_FOR,
   TOKEN_FUN,
   TOKEN_IF,
+  TOKEN_IN,
   TOKEN_NIL,
   TOKEN_OR,
   TOKEN_PRINT,
   TOKEN_RETURN,
   TOKEN_SUPER,
+  TOKEN_SWITCH,
   TOKEN_THIS,
   TOKEN_TRUE,
   TOKEN_VAR,
   TOKEN_CONST,
   TOKEN_WHILE,
+  TOKEN_YIELD,
   // Specials.
   TOKEN_ERROR,
   TOKEN_EOF
@@ -83,6 +96,7 @@ typedef struct {
   const char *start;
   int length;
   int line;
+  int column;
 } Token;
 
 Scanner *initScanner(const char *source);
@@ -0,0 +1,304 @@
+#include "simd.h"
+#include <math.h>
+#include <stdint.h>
+
+// Kernels are written once on Vec4, 4 doubles processed together, with three
+// backends picked at compile time: AVX (built with -mavx2 or -march=native),
+// SSE2 (any x86-64) and plain C. The remaining count % 4 elements are done one
+// by one.
+//
+// Reductions accumulate element i in lane i % 4, then combine the lanes as
+// (0, 2) and (1, 3) before the remaining elements: the order of the additions
+// is the same for every backend, so is the result.
+
+#if defined(__AVX__)
+#include <immintrin.h>
+
+typedef __m256d Vec4;
+
+static inline Vec4 load4(const double *p) { return _mm256_loadu_pd(p); }
+static inline void store4(double *p, Vec4 v) { _mm256_storeu_pd(p, v); }
+static inline Vec4 set4(double x) { return _mm256_set1_pd(x); }
+static inline Vec4 add4(Vec4 a, Vec4 b) { return _mm256_add_pd(a, b); }
+static inline Vec4 sub4(Vec4 a, Vec4 b) { return _mm256_sub_pd(a, b); }
+static inline Vec4 mul4(Vec4 a, Vec4 b) { return _mm256_mul_pd(a, b); }
+static inline Vec4 div4(Vec4 a, Vec4 b) { return _mm256_div_pd(a, b); }
+static inline Vec4 min4(Vec4 a, Vec4 b) { return _mm256_min_pd(a, b); }
+static inline Vec4 max4(Vec4 a, Vec4 b) { return _mm256_max_pd(a, b); }
+// Comparison masks are turned into 1.0 or 0.0.
+static inline Vec4 less4(Vec4 a, Vec4 b) {
+  return _mm256_and_pd(_mm256_cmp_pd(a, b, _CMP_LT_OQ), set4(1.0));
+}
+static inline Vec4 lessEqual4(Vec4 a, Vec4 b) {
+  return _mm256_and_pd(_mm256_cmp_pd(a, b, _CMP_LE_OQ), set4(1.0));
+}
+static inline Vec4 isNan4(Vec4 a) {
+  return _mm256_and_pd(_mm256_cmp_pd(a, a, _CMP_UNORD_Q), set4(1.0));
+}
+
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+
+typedef struct {
+  __m128d lo;
+  __m128d hi;
+} Vec4;
+
+static inline Vec4 load4(const double *p) {
+  Vec4 v = {_mm_loadu_pd(p), _mm_loadu_pd(p + 2)};
+  return v;
+}
+static inline void store4(double *p, Vec4 v) {
+  _mm_storeu_pd(p, v.lo);
+  _mm_storeu_pd(p + 2, v.hi);
+}
+static inline Vec4 set4(double x) {
+  Vec4 v = {_mm_set1_pd(x), _mm_set1_pd(x)};
+  return v;
+}
+
+#define SSE2_OP(name, op)                                                      \
+  static inline Vec4 name(Vec4 a, Vec4 b) {                                    \
+    Vec4 v = {op(a.lo, b.lo), op(a.hi, b.hi)};                                 \
+    return v;                                                                  \
+  }
+#define SSE2_COMPARE(name, compare)                                            \
+  static inline Vec4 name(Vec4 a, Vec4 b) {                                    \
+    __m128d one = _mm_set1_pd(1.0);                                            \
+    Vec4 v = {_mm_and_pd(compare(a.lo, b.lo), one),                            \
+              _mm_and_pd(compare(a.hi, b.hi), one)};                           \
+    return v;                                                                  \
+  }
+
+SSE2_OP(add4, _mm_add_pd)
+SSE2_OP(sub4, _mm_sub_pd)
+SSE2_OP(mul4, _mm_mul_pd)
+SSE2_OP(div4, _mm_div_pd)
+SSE2_OP(min4, _mm_min_pd)
+SSE2_OP(max4, _mm_max_pd)
+SSE2_COMPARE(less4, _mm_cmplt_pd)
+SSE2_COMPARE(lessEqual4, _mm_cmple_pd)
+SSE2_COMPARE(unordered4, _mm_cmpunord_pd)
+
+static inline Vec4 isNan4(Vec4 a) { return unordered4(a, a); }
+
+#undef SSE2_OP
+#undef SSE2_COMPARE
+
+#else
+
+typedef struct {
+  double v[4];
+} Vec4;
+
+static inline Vec4 load4(const double *p) {
+  Vec4 r = {{p[0], p[1], p[2], p[3]}};
+  return r;
+}
+static inline void store4(double *p, Vec4 a) {
+  for (int i = 0; i < 4; i++)
+    p[i] = a.v[i];
+}
+static inline Vec4 set4(double x) {
+  Vec4 r = {{x, x, x, x}};
+  return r;
+}
+
+// Same results as the vector instructions: min and max return the second
+// operand when the comparison is false (equal or NaN).
+#define SCALAR_OP(name, expression)                                            \
+  static inline Vec4 name(Vec4 a, Vec4 b) {                                    \
+    Vec4 r;                                                                    \
+    for (int i = 0; i < 4; i++) {                                              \
+      double x = a.v[i];                                                       \
+      double y = b.v[i];                                                       \
+      r.v[i] = (expression);                                                   \
+    }                                                                          \
+    return r;                                                                  \
+  }
+
+SCALAR_OP(add4, x + y)
+SCALAR_OP(sub4, x - y)
+SCALAR_OP(mul4, x * y)
+SCALAR_OP(div4, x / y)
+SCALAR_OP(min4, x < y ? x : y)
+SCALAR_OP(max4, x > y ? x : y)
+SCALAR_OP(less4, x < y ? 1.0 : 0.0)
+SCALAR_OP(lessEqual4, x <= y ? 1.0 : 0.0)
+
+static inline Vec4 isNan4(Vec4 a) {
+  Vec4 r;
+  for (int i = 0; i < 4; i++)
+    r.v[i] = isnan(a.v[i]) ? 1.0 : 0.0;
+  return r;
+}
+
+#undef SCALAR_OP
+
+#endif
+
+static inline Vec4 greater4(Vec4 a, Vec4 b) { return less4(b, a); }
+static inline Vec4 greaterEqual4(Vec4 a, Vec4 b) { return lessEqual4(b, a); }
+
+// Same conversion as toInteger() in the VM: out of range (and NaN) is 0.
+static inline int64_t toInt64(double d) {
+  if (!(d >= -9223372036854775808.0 && d < 9223372036854775808.0))
+    return 0;
+  return (int64_t)d;
+}
+
+#define ADD(x, y) ((x) + (y))
+#define SUBTRACT(x, y) ((x) - (y))
+#define MULTIPLY(x, y) ((x) * (y))
+#define DIVIDE(x, y) ((x) / (y))
+#define LESS(x, y) ((x) < (y) ? 1.0 : 0.0)
+#define LESS_EQUAL(x, y) ((x) <= (y) ? 1.0 : 0.0)
+#define GREATER(x, y) ((x) > (y) ? 1.0 : 0.0)
+#define GREATER_EQUAL(x, y) ((x) >= (y) ? 1.0 : 0.0)
+#define BITWISE_AND(x, y) ((double)(toInt64(x) & toInt64(y)))
+#define BITWISE_OR(x, y) ((double)(toInt64(x) | toInt64(y)))
+#define BITWISE_XOR(x, y) ((double)(toInt64(x) ^ toInt64(y)))
+
+#define VECTOR_LOOP(vectorOp, scalarOp, loadA, loadB, elementA, elementB)      \
+  do {                                                                         \
+    int i = 0;                                                                 \
+    for (; i + 4 <= count; i += 4)                                             \
+      store4(out + i, vectorOp(loadA, loadB));                                 \
+    for (; i < count; i++)                                                     \
+      out[i] = scalarOp(elementA, elementB);                                   \
+  } while (false)
+
+// One loop for each shape of the operands, so the loads don't check whether
+// the operand is a scalar.
+#define VECTOR_KERNEL(vectorOp, scalarOp)                                      \
+  do {                                                                         \
+    if (a.values != NULL && b.values != NULL) {                                \
+      VECTOR_LOOP(vectorOp, scalarOp, load4(a.values + i),                     \
+                  load4(b.values + i), a.values[i], b.values[i]);              \
+    } else if (a.values != NULL) {                                             \
+      Vec4 vb = set4(b.scalar);                                                \
+      VECTOR_LOOP(vectorOp, scalarOp, load4(a.values + i), vb, a.values[i],    \
+                  b.scalar);                                                   \
+    } else {                                                                   \
+      Vec4 va = set4(a.scalar);                                                \
+      VECTOR_LOOP(vectorOp, scalarOp, va, load4(b.values + i), a.scalar,       \
+                  b.values[i]);                                                \
+    }                                                                          \
+  } while (false)
+
+// There's no conversion between doubles and int64 before AVX-512, bitwise
+// operations are done one element at a time.
+#define SCALAR_KERNEL(scalarOp)                                                \
+  do {                                                                         \
+    for (int i = 0; i < count; i++) {                                          \
+      double x = a.values != NULL ? a.values[i] : a.scalar;                    \
+      double y = b.values != NULL ? b.values[i] : b.scalar;                    \
+      out[i] = scalarOp(x, y);                                                 \
+    }                                                                          \
+  } while (false)
+
+void float64Binary(Float64Op op, double *out, Float64Operand a,
+                   Float64Operand b, int count) {
+  switch (op) {
+  case F64_ADD:
+    VECTOR_KERNEL(add4, ADD);
+    break;
+  case F64_SUBTRACT:
+    VECTOR_KERNEL(sub4, SUBTRACT);
+    break;
+  case F64_MULTIPLY:
+    VECTOR_KERNEL(mul4, MULTIPLY);
+    break;
+  case F64_DIVIDE:
+    VECTOR_KERNEL(div4, DIVIDE);
+    break;
+  case F64_LESS:
+    VECTOR_KERNEL(less4, LESS);
+    break;
+  case F64_LESS_EQUAL:
+    VECTOR_KERNEL(lessEqual4, LESS_EQUAL);
+    break;
+  case F64_GREATER:
+    VECTOR_KERNEL(greater4, GREATER);
+    break;
+  case F64_GREATER_EQUAL:
+    VECTOR_KERNEL(greaterEqual4, GREATER_EQUAL);
+    break;
+  case F64_BITWISE_AND:
+    SCALAR_KERNEL(BITWISE_AND);
+    break;
+  case F64_BITWISE_OR:
+    SCALAR_KERNEL(BITWISE_OR);
+    break;
+  case F64_BITWISE_XOR:
+    SCALAR_KERNEL(BITWISE_XOR);
+    break;
+  }
+}
+
+double float64Sum(const double *values, int count) {
+  Vec4 acc = set4(0.0);
+  int i = 0;
+  for (; i + 4 <= count; i += 4)
+    acc = add4(acc, load4(values + i));
+
+  double lanes[4];
+  store4(lanes, acc);
+  double sum = (lanes[0] + lanes[2]) + (lanes[1] + lanes[3]);
+  for (; i < count; i++)
+    sum += values[i];
+  return sum;
+}
+
+double float64Dot(const double *a, const double *b, int count) {
+  Vec4 acc = set4(0.0);
+  int i = 0;
+  for (; i + 4 <= count; i += 4)
+    acc = add4(acc, mul4(load4(a + i), load4(b + i)));
+
+  double lanes[4];
+  store4(lanes, acc);
+  double sum = (lanes[0] + lanes[2]) + (lanes[1] + lanes[3]);
+  for (; i < count; i++)
+    sum += a[i] * b[i];
+  return sum;
+}
+
+// The lanes keep the extreme seen so far, plus a flag set to 1.0 on a NaN.
+#define EXTREME(vectorOp, scalarOp, start)                                     \
+  do {                                                                         \
+    Vec4 acc = set4(start);                                                    \
+    Vec4 nan = set4(0.0);                                                      \
+    int i = 0;                                                                 \
+    for (; i + 4 <= count; i += 4) {                                           \
+      Vec4 x = load4(values + i);                                              \
+      acc = vectorOp(acc, x);                                                  \
+      nan = max4(nan, isNan4(x));                                              \
+    }                                                                          \
+                                                                               \
+    double lanes[4];                                                           \
+    double nans[4];                                                            \
+    store4(lanes, acc);                                                        \
+    store4(nans, nan);                                                         \
+    if (nans[0] + nans[1] + nans[2] + nans[3] > 0)                             \
+      return NAN;                                                              \
+    double result =                                                            \
+        scalarOp(scalarOp(lanes[0], lanes[2]), scalarOp(lanes[1], lanes[3]));  \
+    for (; i < count; i++) {                                                   \
+      if (isnan(values[i]))                                                    \
+        return NAN;                                                            \
+      result = scalarOp(result, values[i]);                                    \
+    }                                                                          \
+    return result;                                                             \
+  } while (false)
+
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+#define MAX(x, y) ((x) > (y) ? (x) : (y))
+
+double float64Min(const double *values, int count) {
+  EXTREME(min4, MIN, INFINITY);
+}
+
+double float64Max(const double *values, int count) {
+  EXTREME(max4, MAX, -INFINITY);
+}
@@ -0,0 +1,40 @@
+#ifndef nrk_simd_h
+#define nrk_simd_h
+
+#include "common.h"
+
+// Elementwise operations between Float64Arrays, see float64Binary().
+typedef enum {
+  F64_ADD,
+  F64_SUBTRACT,
+  F64_MULTIPLY,
+  F64_DIVIDE,
+  // Comparisons give 1.0 or 0.0.
+  F64_LESS,
+  F64_LESS_EQUAL,
+  F64_GREATER,
+  F64_GREATER_EQUAL,
+  // Bitwise operations convert to int64 and back, like on numbers.
+  F64_BITWISE_AND,
+  F64_BITWISE_OR,
+  F64_BITWISE_XOR,
+} Float64Op;
+
+// Either count doubles or, when values is NULL, a scalar repeated count times.
+typedef struct {
+  const double *values;
+  double scalar;
+} Float64Operand;
+
+// out[i] = a[i] op b[i], for i in [0, count).
+void float64Binary(Float64Op op, double *out, Float64Operand a,
+                   Float64Operand b, int count);
+
+// Reductions. Min and max are NaN if any element is, and +/-infinity on no
+// elements.
+double float64Sum(const double *values, int count);
+double float64Dot(const double *a, const double *b, int count);
+double float64Min(const double *values, int count);
+double float64Max(const double *values, int count);
+
+#endif
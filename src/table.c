@@ -2,6 +2,7 @@
 #include "memory.h"
 #include "object.h"
 #include "value.h"
+#include <math.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -19,23 +20,67 @@ void freeTable(Table *table) {
   initTable(table);
 }
 
+// Mixes the bits of a number or a pointer, so that keys differing only in the
+// high bits (or multiples of the capacity) don't end up in the same bucket.
+static uint32_t hashBits(uint64_t bits) {
+  bits ^= bits >> 33;
+  bits *= 0xff51afd7ed558ccdULL;
+  bits ^= bits >> 33;
+  return (uint32_t)bits;
+}
+
+// Hashes a key, equal keys have the same hash:
+// - Numbers equal to an integer (1.0, -0.0) hash like that integer, as they are
+//   equal to it. Other doubles hash by their bit pattern.
+// - All NaNs are the same key, even if NaN isn't equal to itself.
+// - Strings are interned, so they hash by content. Other objects by identity.
+uint32_t hashValue(Value key) {
+  switch (key.type) {
+  case VAL_BOOL:
+    return AS_BOOL(key) ? 3 : 5;
+  case VAL_INT:
+    return hashBits((uint64_t)AS_INT(key));
+  case VAL_NUMBER: {
+    double number = AS_NUMBER(key);
+    if (isnan(number))
+      return 7;
+    if (number >= -9223372036854775808.0 && number < 9223372036854775808.0 &&
+        (double)(int64_t)number == number)
+      return hashBits((uint64_t)(int64_t)number);
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(bits));
+    return hashBits(bits);
+  }
+  case VAL_OBJ:
+    if (IS_STRING(key))
+      return AS_STRING(key)->hash;
+    return hashBits((uint64_t)(uintptr_t)AS_OBJ(key));
+  default:
+    return 0;
+  }
+}
+
+// Like valuesEqual, but a NaN key finds the NaN key.
+static bool keysEqual(Value a, Value b) {
+  if (IS_DOUBLE(a) && IS_DOUBLE(b) && isnan(AS_NUMBER(a)) &&
+      isnan(AS_NUMBER(b)))
+    return true;
+  return valuesEqual(a, b);
+}
+
 // Finds the spot in the entries list, with the given key and cap of a table.
 // It doesn't take an entire Table struct, so it's possible to search the spot
 // in an existing table->entries list, without being contrained to its existing
 // capacity.
-Entry *findEntry(Entry *entries, int cap, ObjString *key) {
-  uint32_t index = key->hash % cap;
+static Entry *findEntry(Entry *entries, int cap, Value key) {
+  uint32_t index = hashValue(key) & (cap - 1);
   Entry *tombstone = NULL;
 
   for (;;) {
     Entry *entry = &entries[index];
 
-    // Key found, return the entry.
-    if (entry->key == key)
-      return entry;
-
     // Empty entry, go ahead
-    if (entry->key == NULL) {
+    if (IS_NIL(entry->key)) {
       // If no value set, check first if we have a tombstone saved during the
       // linear probe so far.
       if (IS_NIL(entry->value)) {
@@ -48,26 +93,40 @@ Entry *findEntry(Entry *entries, int cap, ObjString *key) {
       // Set the tombstone if we haven't already since we are in an empty entry.
       if (tombstone == NULL)
         tombstone = entry;
+    } else if (keysEqual(entry->key, key)) {
+      // Key found, return the entry.
+      return entry;
     }
 
     // Linear probing, going ahead.
-    index = (index + 1) % cap;
+    index = (index + 1) & (cap - 1);
   }
 }
 
-bool tableGet(Table *table, ObjString *key, Value *value) {
-  if (table->count == 0)
-    return false;
+// Same as findEntry, for an interned string: no type dispatch, just a pointer
+// comparison.
+static Entry *findStringEntry(Entry *entries, int cap, ObjString *key) {
+  uint32_t index = key->hash & (cap - 1);
+  Entry *tombstone = NULL;
 
-  Entry *e = findEntry(table->entries, table->cap, key);
-  if (e->key == NULL)
-    return false;
+  for (;;) {
+    Entry *entry = &entries[index];
 
-  *value = e->value;
-  return true;
+    if (IS_OBJ(entry->key) && AS_OBJ(entry->key) == (Obj *)key)
+      return entry;
+
+    if (IS_NIL(entry->key)) {
+      if (IS_NIL(entry->value))
+        return tombstone != NULL ? tombstone : entry;
+      if (tombstone == NULL)
+        tombstone = entry;
+    }
+
+    index = (index + 1) & (cap - 1);
+  }
 }
 
-void adjustCapacity(Table *table, int cap) {
+static void adjustCapacity(Table *table, int cap) {
   Entry *entries = ALLOCATE(Entry, cap);
   if (entries == NULL) {
     fprintf(stderr, "Not enough memory to adjust table capacity.\n");
@@ -76,7 +135,7 @@ void adjustCapacity(Table *table, int cap) {
 
   // (Re)initialize all the entries
   for (int i = 0; i < cap; i++) {
-    entries[i].key = NULL;
+    entries[i].key = NIL_VAL;
     entries[i].value = NIL_VAL;
   }
 
@@ -88,7 +147,7 @@ void adjustCapacity(Table *table, int cap) {
   table->count = 0;
   for (int i = 0; i < table->cap; i++) {
     Entry *entry = &table->entries[i];
-    if (entry->key == NULL)
+    if (IS_NIL(entry->key))
       continue;
 
     Entry *dest = findEntry(entries, cap, entry->key);
@@ -103,14 +162,15 @@ void adjustCapacity(Table *table, int cap) {
   table->cap = cap;
 }
 
-bool tableSet(Table *table, ObjString *key, Value value) {
+static void ensureCapacity(Table *table) {
   if (table->count + 1 > table->cap * TABLE_MAX_LOAD) {
     adjustCapacity(table, GROW_CAP(table->cap));
   }
+}
 
-  Entry *entry = findEntry(table->entries, table->cap, key);
-
-  bool isNew = entry->key == NULL;
+// Upserts the entry found for key, returns true if it's a new one.
+static bool setEntry(Table *table, Entry *entry, Value key, Value value) {
+  bool isNew = IS_NIL(entry->key);
   // Tombstone management (see comment in table.h on why they're counted).
   if (isNew && IS_NIL(entry->value))
     table->count++;
@@ -124,24 +184,73 @@ bool tableSet(Table *table, ObjString *key, Value value) {
 // Tomblestone method, we leave a signal if deleting an entry, so linear probing
 // keeps working.
 // Returns false if no element was deleted.
-bool tableDelete(Table *table, ObjString *key) {
-  Entry *entry = findEntry(table->entries, table->cap, key);
-  if (entry == NULL)
+static bool deleteEntry(Entry *entry) {
+  if (IS_NIL(entry->key))
     return false;
 
-  entry->key = NULL;
+  entry->key = NIL_VAL;
   // Tombstone
   entry->value = BOOL_VAL(true);
 
   return true;
 }
 
+bool tableGet(Table *table, ObjString *key, Value *value) {
+  if (table->count == 0)
+    return false;
+
+  Entry *e = findStringEntry(table->entries, table->cap, key);
+  if (IS_NIL(e->key))
+    return false;
+
+  *value = e->value;
+  return true;
+}
+
+bool tableSet(Table *table, ObjString *key, Value value) {
+  ensureCapacity(table);
+  Entry *entry = findStringEntry(table->entries, table->cap, key);
+  return setEntry(table, entry, OBJ_VAL(key), value);
+}
+
+bool tableDelete(Table *table, ObjString *key) {
+  if (table->count == 0)
+    return false;
+
+  return deleteEntry(findStringEntry(table->entries, table->cap, key));
+}
+
+bool tableGetValue(Table *table, Value key, Value *value) {
+  if (table->count == 0)
+    return false;
+
+  Entry *e = findEntry(table->entries, table->cap, key);
+  if (IS_NIL(e->key))
+    return false;
+
+  *value = e->value;
+  return true;
+}
+
+bool tableSetValue(Table *table, Value key, Value value) {
+  ensureCapacity(table);
+  Entry *entry = findEntry(table->entries, table->cap, key);
+  return setEntry(table, entry, key, value);
+}
+
+bool tableDeleteValue(Table *table, Value key) {
+  if (table->count == 0)
+    return false;
+
+  return deleteEntry(findEntry(table->entries, table->cap, key));
+}
+
 void tableAddAll(Table *from, Table *to) {
   for (int i = 0; i < from->cap; i++) {
     Entry *e = &from->entries[i];
-    if (e->key == NULL)
+    if (IS_NIL(e->key))
       continue;
-    tableSet(to, e->key, e->value);
+    tableSetValue(to, e->key, e->value);
   }
 }
 
@@ -150,26 +259,28 @@ ObjString *tableFindString(Table *table, const char *str, int length,
   if (table->count == 0)
     return NULL;
 
-  uint32_t index = hash % table->cap;
+  uint32_t index = hash & (table->cap - 1);
 
   for (;;) {
     Entry *entry = &table->entries[index];
 
     // Keep looping for linear probing, until the element with the correct key
     // is found, or we're on a tombstone of a previously removed element.
-    if (entry->key == NULL) {
+    if (IS_NIL(entry->key)) {
       // Stop if this is an empty non-tombstone element, i.e. the string (key)
       // is not present in the hashset.
       if (IS_NIL(entry->value))
         return NULL;
       // Otherwise keep going with next index.
+    } else {
+      // Char-by-char comparison necessary at this point. Is string is found,
+      // return it.
+      ObjString *key = AS_STRING(entry->key);
+      if (key->hash == hash && key->length == length &&
+          memcmp(key->str, str, length) == 0)
+        return key;
     }
-    // Char-by-char comparison necessary at this point. Is string is found,
-    // return it.
-    else if (entry->key->length == length &&
-             memcmp(entry->key->str, str, length) == 0)
-      return entry->key;
 
-    index = (index + 1) % table->cap;
+    index = (index + 1) & (table->cap - 1);
   }
 }
@@ -6,8 +6,10 @@
 
 #define TABLE_MAX_LOAD 0.75
 
+// Keys are any value but nil, an entry with a nil key is either empty (nil
+// value) or a tombstone (true value).
 typedef struct {
-  ObjString *key;
+  Value key;
   Value value;
 } Entry;
 
@@ -24,17 +26,25 @@ typedef struct {
    * entries.
    */
   int count;
+  // Always a power of two, so the hash is reduced to an index with a mask.
   int cap;
   Entry *entries;
 } Table;
 
 void initTable(Table *table);
 void freeTable(Table *table);
+// String keys, used by globals and interning. They are interned, so they are
+// compared by pointer and their hash is already computed.
 bool tableSet(Table *table, ObjString *key, Value value);
 bool tableGet(Table *table, ObjString *key, Value *value);
 bool tableDelete(Table *table, ObjString *key);
+// Any non nil key (see hashValue), used by maps.
+bool tableSetValue(Table *table, Value key, Value value);
+bool tableGetValue(Table *table, Value key, Value *value);
+bool tableDeleteValue(Table *table, Value key);
 void tableAddAll(Table *from, Table *to);
 ObjString *tableFindString(Table *table, const char *str, int length,
                            uint32_t hash);
+uint32_t hashValue(Value key);
 
 #endif
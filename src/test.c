@@ -1,10 +1,13 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include "chunk.h"
 #include "test.h"
 #include "value.h"
+#include "verifier.h"
 #include "vm.h"
 
 void testResetStack() {
@@ -17,14 +20,14 @@ void testResetStack() {
 
   int numConst = 10;
   for (int i = 0; i < numConst; i++) {
-    writeConstant(&c, NUMBER_VAL(666), 10);
+    writeConstant(&c, NUMBER_VAL(666), 10, 0);
   }
 
-  writeChunk(&c, __OP_STACK_RESET, 11);
-  writeConstant(&c, NUMBER_VAL(42), 12);
+  writeChunk(&c, __OP_STACK_RESET, 11, 0);
+  writeConstant(&c, NUMBER_VAL(42), 12, 0);
 
   // Return
-  writeChunk(&c, OP_RETURN, 13);
+  writeChunk(&c, OP_RETURN, 13, 0);
 
   // Interpret
   interpretChunk(vm, &c);
@@ -43,20 +46,20 @@ void testLongConst() {
   Chunk c;
   initChunk(&c);
 
-  // Go beyond 255 to have the encoder using OP_CONSTANT_LONG
+  // Go beyond 255 to have the encoder using OP_WIDE OP_CONSTANT
   int numConst = 285;
   for (int i = 0; i < numConst; i++) {
 
     uint8_t r = (uint8_t)rand();
-    writeConstant(&c, NUMBER_VAL(r), 10);
+    writeConstant(&c, NUMBER_VAL(r), 10, 0);
   }
 
   // Negate
-  writeConstant(&c, NUMBER_VAL(42), 1);
-  writeChunk(&c, OP_NEGATE, 1);
+  writeConstant(&c, NUMBER_VAL(42), 1, 0);
+  writeChunk(&c, OP_NEGATE, 1, 0);
 
   // Return
-  writeChunk(&c, OP_RETURN, 11);
+  writeChunk(&c, OP_RETURN, 11, 0);
 
   // Interpret
   interpretChunk(vm, &c);
@@ -75,13 +78,13 @@ void testAdd() {
   Chunk c;
   initChunk(&c);
 
-  writeConstant(&c, NUMBER_VAL(5.23), 10);
-  writeConstant(&c, NUMBER_VAL(5.4), 10);
+  writeConstant(&c, NUMBER_VAL(5.23), 10, 0);
+  writeConstant(&c, NUMBER_VAL(5.4), 10, 0);
 
-  writeChunk(&c, OP_ADD, 10);
+  writeChunk(&c, OP_ADD, 10, 0);
 
   // Return
-  writeChunk(&c, OP_RETURN, 11);
+  writeChunk(&c, OP_RETURN, 11, 0);
 
   // Interpret
   interpretChunk(vm, &c);
@@ -100,18 +103,18 @@ void testArithmetics() {
   Chunk c;
   initChunk(&c);
 
-  writeConstant(&c, NUMBER_VAL(2), 10);
-  writeConstant(&c, NUMBER_VAL(5), 10);
-  writeChunk(&c, OP_ADD, 10);
+  writeConstant(&c, NUMBER_VAL(2), 10, 0);
+  writeConstant(&c, NUMBER_VAL(5), 10, 0);
+  writeChunk(&c, OP_ADD, 10, 0);
 
-  writeConstant(&c, NUMBER_VAL(3), 10);
-  writeChunk(&c, OP_MULTIPLY, 10);
+  writeConstant(&c, NUMBER_VAL(3), 10, 0);
+  writeChunk(&c, OP_MULTIPLY, 10, 0);
 
-  writeConstant(&c, NUMBER_VAL(3), 10);
-  writeChunk(&c, OP_DIVIDE, 10);
+  writeConstant(&c, NUMBER_VAL(3), 10, 0);
+  writeChunk(&c, OP_DIVIDE, 10, 0);
 
   // Return
-  writeChunk(&c, OP_RETURN, 11);
+  writeChunk(&c, OP_RETURN, 11, 0);
 
   // Interpret
   interpretChunk(vm, &c);
@@ -131,11 +134,11 @@ void testNegate() {
   initChunk(&c);
 
   for (int i = 1; i < 998; i++) {
-    writeConstant(&c, NUMBER_VAL(i), i);
-    writeChunk(&c, OP_NEGATE, i);
+    writeConstant(&c, NUMBER_VAL(i), i, 0);
+    writeChunk(&c, OP_NEGATE, i, 0);
   }
 
-  writeChunk(&c, OP_RETURN, 1000);
+  writeChunk(&c, OP_RETURN, 1000, 0);
 
   // Interpret
   interpretChunk(vm, &c);
@@ -145,3 +148,688 @@ void testNegate() {
 
   freeVM(vm);
 }
+
+// Verifies a chunk, printing the outcome and the max stack depth.
+static void verify(const char *name, Chunk *c, bool expected) {
+  bool ok = decodeChunk(c) && verifyChunk(c, 0, 0);
+  printf("%s: %s (max stack %d) %s\n", name, ok ? "valid" : "invalid",
+         c->decoded.maxStack, ok == expected ? "OK" : "FAILED");
+}
+
+void testVerifier() {
+  printf("\nRunning testVerifier()...\n");
+
+  Chunk c;
+
+  // 1 + (2 * 3), the stack reaches 3 values.
+  initChunk(&c);
+  writeChunk(&c, OP_PUSH_ONE, 1, 0);
+  writeChunk(&c, OP_PUSH_SMALLINT, 1, 0);
+  writeChunk(&c, 2, 1, 0);
+  writeConstant(&c, NUMBER_VAL(3), 1, 0);
+  writeChunk(&c, OP_MULTIPLY, 1, 0);
+  writeChunk(&c, OP_ADD, 1, 0);
+  writeChunk(&c, OP_PRINT, 1, 0);
+  writeChunk(&c, OP_RETURN, 1, 0);
+  verify("arithmetics", &c, true);
+  freeChunk(&c);
+
+  // Both branches of the if must leave the same depth.
+  initChunk(&c);
+  writeChunk(&c, OP_TRUE, 1, 0);
+  writeChunk(&c, OP_JUMP_IF_FALSE, 1, 0);
+  writeChunk(&c, 0, 1, 0);
+  writeChunk(&c, 1, 1, 0);
+  writeChunk(&c, OP_PUSH_ONE, 1, 0);
+  writeChunk(&c, OP_RETURN, 1, 0);
+  verify("unbalanced branches", &c, false);
+  freeChunk(&c);
+
+  initChunk(&c);
+  writeChunk(&c, OP_PUSH_ONE, 1, 0);
+  writeChunk(&c, OP_ADD, 1, 0);
+  writeChunk(&c, OP_RETURN, 1, 0);
+  verify("stack underflow", &c, false);
+  freeChunk(&c);
+
+  // The local slot 1 is not on the stack yet.
+  initChunk(&c);
+  writeChunk(&c, OP_PUSH_ONE, 1, 0);
+  writeChunk(&c, OP_GET_LOCAL, 1, 0);
+  writeChunk(&c, 1, 1, 0);
+  writeChunk(&c, OP_RETURN, 1, 0);
+  verify("local out of range", &c, false);
+  freeChunk(&c);
+
+  // The script has no upvalues.
+  initChunk(&c);
+  writeChunk(&c, OP_GET_UPVALUE, 1, 0);
+  writeChunk(&c, 0, 1, 0);
+  writeChunk(&c, OP_POP, 1, 0);
+  writeChunk(&c, OP_RETURN, 1, 0);
+  verify("upvalue out of range", &c, false);
+  freeChunk(&c);
+
+  initChunk(&c);
+  writeChunk(&c, OP_JUMP, 1, 0);
+  writeChunk(&c, 0, 1, 0);
+  writeChunk(&c, 1, 1, 0);
+  writeChunk(&c, OP_PUSH_SMALLINT, 1, 0);
+  writeChunk(&c, 5, 1, 0);
+  writeChunk(&c, OP_RETURN, 1, 0);
+  verify("jump inside an instruction", &c, false);
+  freeChunk(&c);
+
+  initChunk(&c);
+  writeChunk(&c, OP_NIL, 1, 0);
+  writeChunk(&c, OP_POP, 1, 0);
+  verify("missing return", &c, false);
+  freeChunk(&c);
+}
+
+// Reads a global set by the script.
+static Value global(VM *vm, const char *name) {
+  Value value = NIL_VAL;
+  tableGet(&vm->memoryManager->globals,
+           copyString(vm->memoryManager, name, (int)strlen(name)), &value);
+  return value;
+}
+
+// Tail calls reuse the frame of the caller: recursing 10M calls deep in tail
+// position must not grow the stack nor the call frames past what a shallow
+// recursion uses.
+void testTailCall() {
+  printf("\nRunning testTailCall()...\n");
+
+  VM *vm = initVM();
+
+  InterpretResult shallow =
+      interpret(vm, "fun count(n, acc) {\n"
+                    "  if (n == 0) return acc;\n"
+                    "  return count(n - 1, acc + 1);\n"
+                    "}\n"
+                    "fun even(n) {\n"
+                    "  if (n == 0) return true;\n"
+                    "  return odd(n - 1);\n"
+                    "}\n"
+                    "fun odd(n) {\n"
+                    "  if (n == 0) return false;\n"
+                    "  return even(n - 1);\n"
+                    "}\n"
+                    "var result = count(10, 0);\n"
+                    "var parity = even(11);\n");
+  int stackCap = vm->stackCap;
+  int frameCap = vm->frameCap;
+
+  InterpretResult deep = interpret(vm, "result = count(10000000, 0);\n"
+                                       "parity = even(10000001);\n");
+  Value result = global(vm, "result");
+  Value parity = global(vm, "parity");
+
+  bool ok = shallow == INTERPRET_OK && deep == INTERPRET_OK &&
+            IS_INT(result) && AS_INT(result) == 10000000 && IS_BOOL(parity) &&
+            !AS_BOOL(parity) && vm->stackCap == stackCap &&
+            vm->frameCap == frameCap;
+  printf("10M deep tail recursion: stack %d -> %d, frames %d -> %d %s\n",
+         stackCap, vm->stackCap, frameCap, vm->frameCap, ok ? "OK" : "FAILED");
+
+  freeVM(vm);
+}
+
+// Counts the instructions with the given opcode in the chunk.
+static int countOps(Chunk *chunk, OpCode op) {
+  int count = 0;
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    if (chunk->code[offset] == op)
+      count++;
+  }
+  return count;
+}
+
+// Constants initialized with a literal are replaced by their value: the
+// function reads neither a global nor a local for them, and the global isn't
+// defined at all. Redefining one in a later line (as in the REPL) is an error.
+void testConstPropagation() {
+  printf("\nRunning testConstPropagation()...\n");
+
+  VM *vm = initVM();
+
+  InterpretResult first =
+      interpret(vm, "const LIMIT = 10;\n"
+                    "fun below(x) {\n"
+                    "  const STEP = 2;\n"
+                    "  return x + STEP < LIMIT;\n"
+                    "}\n"
+                    "var result = below(3);\n");
+  InterpretResult redefined = interpret(vm, "const LIMIT = 11;\n");
+  InterpretResult kept = interpret(vm, "var seen = LIMIT;\n");
+
+  // A constant declared by a source that doesn't compile never existed.
+  InterpretResult var = interpret(vm, "var C = 1;\n");
+  InterpretResult failed = interpret(vm, "const C = 9; print (;\n");
+  InterpretResult assigned = interpret(vm, "var before = C;\nC = 3;\n");
+
+  Value below = global(vm, "below");
+  Chunk *chunk = IS_FUNCTION(below) ? &AS_FUNCTION(below)->chunk : NULL;
+  Value result = global(vm, "result");
+  Value limit = global(vm, "LIMIT");
+  Value seen = global(vm, "seen");
+  Value before = global(vm, "before");
+  Value c = global(vm, "C");
+
+  bool ok = first == INTERPRET_OK && redefined == INTERPRET_COMPILE_ERROR &&
+            chunk != NULL && countOps(chunk, OP_GET_GLOBAL) == 0 &&
+            countOps(chunk, OP_GET_LOCAL) == 1 && IS_BOOL(result) &&
+            AS_BOOL(result) && IS_NIL(limit) && kept == INTERPRET_OK &&
+            IS_INT(seen) && AS_INT(seen) == 10;
+  printf("constants inlined, global not defined, redefinition rejected %s\n",
+         ok ? "OK" : "FAILED");
+
+  ok = var == INTERPRET_OK && failed == INTERPRET_COMPILE_ERROR &&
+       assigned == INTERPRET_OK && IS_INT(before) && AS_INT(before) == 1 &&
+       IS_INT(c) && AS_INT(c) == 3;
+  printf("constants of a failed compilation discarded %s\n",
+         ok ? "OK" : "FAILED");
+
+  freeVM(vm);
+}
+
+// The same function compiled at each optimization level: 2 + 3 and -1 are
+// folded and the dead print removed from -O1, the store of a forwarded to the
+// test following it at -O2. The result never changes.
+void testOptimizer() {
+  printf("\nRunning testOptimizer()...\n");
+
+  const char *source = "fun f(n) {\n"
+                       "  var a = n;\n"
+                       "  a = a * (2 + 3);\n"
+                       "  if (a > 0) return a - -1; else return 0;\n"
+                       "  print \"dead\";\n"
+                       "}\n"
+                       "var result = f(4);\n";
+
+  for (int level = OPTIMIZE_NONE; level <= OPTIMIZE_FULL; level++) {
+    VM *vm = initVM();
+    vm->compiler->optimizationLevel = (OptimizationLevel)level;
+
+    InterpretResult res = interpret(vm, source);
+    Value f = global(vm, "f");
+    Chunk *chunk = IS_FUNCTION(f) ? &AS_FUNCTION(f)->chunk : NULL;
+    Value result = global(vm, "result");
+
+    bool folded = level == OPTIMIZE_NONE;
+    bool ok = res == INTERPRET_OK && chunk != NULL && IS_INT(result) &&
+              AS_INT(result) == 21 &&
+              (countOps(chunk, OP_ADD) == 0) != folded &&
+              (countOps(chunk, OP_NEGATE) == 0) != folded &&
+              (countOps(chunk, OP_PRINT) == 0) != folded &&
+              countOps(chunk, OP_GET_LOCAL) == (level == OPTIMIZE_FULL ? 3 : 4);
+    printf("-O%d: %d bytes %s\n", level, chunk != NULL ? chunk->count : 0,
+           ok ? "OK" : "FAILED");
+
+    freeVM(vm);
+  }
+}
+
+// Branches on constants are decided at compile time from -O1: the disabled
+// code is gone, and so are the jumps, the one of the inner if going straight
+// to the end of the outer one.
+void testDeadBranches() {
+  printf("\nRunning testDeadBranches()...\n");
+
+  const char *source = "const DEBUG = false;\n"
+                       "fun f(x) {\n"
+                       "  if (DEBUG) print x;\n"
+                       "  while (DEBUG and x) print x;\n"
+                       "  if (!DEBUG) x = x + 1;\n"
+                       "  if (x > 0) { if (x > 5) x = 5; } else x = 0;\n"
+                       "  return x;\n"
+                       "}\n"
+                       "var result = f(7);\n";
+
+  for (int level = OPTIMIZE_NONE; level <= OPTIMIZE_FULL; level++) {
+    VM *vm = initVM();
+    vm->compiler->optimizationLevel = (OptimizationLevel)level;
+
+    InterpretResult res = interpret(vm, source);
+    Value f = global(vm, "f");
+    Chunk *chunk = IS_FUNCTION(f) ? &AS_FUNCTION(f)->chunk : NULL;
+    Value result = global(vm, "result");
+
+    bool ok = res == INTERPRET_OK && chunk != NULL && IS_INT(result) &&
+              AS_INT(result) == 5;
+    if (ok && level != OPTIMIZE_NONE) {
+      // Nothing left of the flags, and no jump lands on a jump.
+      ok = countOps(chunk, OP_PRINT) == 0 && countOps(chunk, OP_FALSE) == 0 &&
+           countOps(chunk, OP_POP_JUMP_IF_FALSE) == 0 &&
+           countOps(chunk, OP_LOOP) == 0 && countOps(chunk, OP_JUMP) == 1;
+    }
+    printf("-O%d: %d bytes %s\n", level, chunk != NULL ? chunk->count : 0,
+           ok ? "OK" : "FAILED");
+
+    freeVM(vm);
+  }
+}
+
+// In `for i in 0..len(a)`, a[i] is compiled to unchecked instructions, and
+// turned back into checked ones when something after it in the body could
+// break the bounds: assigning i or a, a call, pop(), a closure capturing a, a
+// yield or a for-in loop (running a generator). The functions aren't called.
+void testBoundsHoisting() {
+  printf("\nRunning testBoundsHoisting()...\n");
+
+  VM *vm = initVM();
+  InterpretResult res =
+      interpret(vm, "fun bounded(a) {\n"
+                    "  for i in 0..len(a) { a[i] = a[i] + 1; }\n"
+                    "}\n"
+                    "fun index(a) {\n"
+                    "  for i in 0..len(a) { print a[i]; i = 0; }\n"
+                    "}\n"
+                    "fun array(a) {\n"
+                    "  for i in 0..len(a) { print a[i]; a = []; }\n"
+                    "}\n"
+                    "fun calls(a) {\n"
+                    "  for i in 0..len(a) { print a[i]; clock(); }\n"
+                    "}\n"
+                    "fun pops(a) {\n"
+                    "  for i in 0..len(a) { print a[i]; pop(a); }\n"
+                    "}\n"
+                    "fun captures(a) {\n"
+                    "  for i in 0..len(a) { print a[i]; fun f() { a; } }\n"
+                    "}\n"
+                    "fun yields(a) {\n"
+                    "  for i in 0..len(a) { print a[i]; yield; }\n"
+                    "}\n"
+                    "fun iterates(a) {\n"
+                    "  for i in 0..len(a) { print a[i]; for x in a {} }\n"
+                    "}\n");
+
+  Value bounded = global(vm, "bounded");
+  Chunk *chunk = IS_FUNCTION(bounded) ? &AS_FUNCTION(bounded)->chunk : NULL;
+  bool ok = res == INTERPRET_OK && chunk != NULL &&
+            countOps(chunk, OP_INDEX_GET_UNCHECKED) == 1 &&
+            countOps(chunk, OP_INDEX_SET_UNCHECKED) == 1 &&
+            countOps(chunk, OP_INDEX_GET) == 0 &&
+            countOps(chunk, OP_INDEX_SET) == 0;
+  printf("bounded: %s\n", ok ? "OK" : "FAILED");
+
+  const char *broken[] = {"index",    "array",  "calls",   "pops",
+                          "captures", "yields", "iterates"};
+  for (int i = 0; i < (int)(sizeof(broken) / sizeof(broken[0])); i++) {
+    Value f = global(vm, broken[i]);
+    chunk = IS_FUNCTION(f) ? &AS_FUNCTION(f)->chunk : NULL;
+    ok = res == INTERPRET_OK && chunk != NULL &&
+         countOps(chunk, OP_INDEX_GET_UNCHECKED) == 0 &&
+         countOps(chunk, OP_INDEX_GET) == 1;
+    printf("%s: %s\n", broken[i], ok ? "OK" : "FAILED");
+  }
+
+  freeVM(vm);
+}
+
+// Locals holding constants are read as the constants at -O2, and folded with
+// what uses them: f() returns 16 without reading a local or computing. A
+// local holding a copy of an argument reads the argument, and one captured by
+// a closure, which can assign it, is read as is.
+void testLocalPropagation() {
+  printf("\nRunning testLocalPropagation()...\n");
+
+  const char *source = "fun f() {\n"
+                       "  var x = 3;\n"
+                       "  var y = x + 1;\n"
+                       "  var z = (y * 2) + (y * 2);\n"
+                       "  return z;\n"
+                       "}\n"
+                       "fun g(a) {\n"
+                       "  var b = a;\n"
+                       "  var c = b;\n"
+                       "  b = 7;\n"
+                       "  return c + b;\n"
+                       "}\n"
+                       "fun h() {\n"
+                       "  var x = 1;\n"
+                       "  fun inc() { x = x + 1; }\n"
+                       "  inc();\n"
+                       "  return x;\n"
+                       "}\n"
+                       "var results = [f(), g(5), h()];\n";
+
+  for (int level = OPTIMIZE_BASIC; level <= OPTIMIZE_FULL; level++) {
+    VM *vm = initVM();
+    vm->compiler->optimizationLevel = (OptimizationLevel)level;
+
+    InterpretResult res = interpret(vm, source);
+    Value f = global(vm, "f");
+    Value g = global(vm, "g");
+    Value h = global(vm, "h");
+    Value results = global(vm, "results");
+    bool ok = res == INTERPRET_OK && IS_FUNCTION(f) && IS_FUNCTION(g) &&
+              IS_FUNCTION(h) && IS_ARRAY(results) &&
+              AS_ARRAY(results)->elements.count == 3;
+    if (ok) {
+      Value *values = AS_ARRAY(results)->elements.values;
+      ok = IS_INT(values[0]) && AS_INT(values[0]) == 16 &&
+           IS_INT(values[1]) && AS_INT(values[1]) == 12 &&
+           IS_INT(values[2]) && AS_INT(values[2]) == 2;
+    }
+
+    if (ok && level == OPTIMIZE_FULL) {
+      Chunk *fc = &AS_FUNCTION(f)->chunk;
+      Chunk *gc = &AS_FUNCTION(g)->chunk;
+      Chunk *hc = &AS_FUNCTION(h)->chunk;
+      // g() reads a for b, for c and in place of c, then b is 7. h() reads
+      // x, and inc() for the call.
+      ok = countOps(fc, OP_GET_LOCAL) == 0 && countOps(fc, OP_ADD) == 0 &&
+           countOps(fc, OP_MULTIPLY) == 0 && countOps(gc, OP_GET_LOCAL) == 3 &&
+           countOps(hc, OP_GET_LOCAL) == 2;
+    }
+    printf("-O%d: %s\n", level, ok ? "OK" : "FAILED");
+
+    freeVM(vm);
+  }
+}
+
+// Compiles a generated 100k-line script and measures pc -> line lookups, as
+// done when reporting errors or tracing the execution.
+void benchLineTable() {
+  printf("\nRunning benchLineTable()...\n");
+
+  const int numLines = 100000;
+  const int numLookups = 100000;
+
+  // Each line is a small statement, with a few instructions per line.
+  size_t size = (size_t)numLines * 32;
+  char *source = malloc(size);
+  size_t len = 0;
+  for (int i = 0; i < numLines; i++) {
+    len += snprintf(source + len, size - len, "var v%d = %d * %d + 1;\n", i,
+                    i, i % 100);
+  }
+
+  VM *vm = initVM();
+
+  Chunk c;
+  initChunk(&c);
+  vm->compiler->currentChunk = &c;
+  if (!compile(vm->compiler, source)) {
+    printf("Compilation failed.\n");
+    return;
+  }
+
+  // Spread the lookups over the whole chunk.
+  long checksum = 0;
+  clock_t start = clock();
+  for (int i = 0; i < numLookups; i++) {
+    int offset = (int)(((long)i * 7919) % c.count);
+    checksum += getInstructionLine(&c, offset);
+  }
+  double elapsed = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+  printf("%d lines, %d bytes of code, %d lookups in %.3fs (%.1f ns/lookup, "
+         "checksum %ld)\n",
+         numLines, c.count, numLookups, elapsed, elapsed * 1e9 / numLookups,
+         checksum);
+
+  // Cleanup
+  freeChunk(&c);
+  free(source);
+
+  freeVM(vm);
+}
+
+// Runs a long straight-line chunk of stack-heavy instructions (locals, binary
+// ops, unary ops and pops) to measure the cost of dispatching them.
+void benchDispatch() {
+  printf("\nRunning benchDispatch()...\n");
+
+  // Small enough for the decoded instructions to stay in cache.
+  const int numBlocks = 1000;
+  const int numRuns = 5000;
+
+  Chunk c;
+  initChunk(&c);
+
+  // Slot 0 is the accumulator: v = ((v * 3) + 1) & 127, !v
+  writeChunk(&c, OP_PUSH_ONE, 1, 0);
+  for (int i = 0; i < numBlocks; i++) {
+    writeChunk(&c, OP_GET_LOCAL, 1, 0);
+    writeChunk(&c, 0, 1, 0);
+    writeChunk(&c, OP_PUSH_SMALLINT, 1, 0);
+    writeChunk(&c, 3, 1, 0);
+    writeChunk(&c, OP_MULTIPLY, 1, 0);
+    writeChunk(&c, OP_PUSH_ONE, 1, 0);
+    writeChunk(&c, OP_ADD, 1, 0);
+    writeChunk(&c, OP_PUSH_SMALLINT, 1, 0);
+    writeChunk(&c, 127, 1, 0);
+    writeChunk(&c, OP_BITWISE_AND, 1, 0);
+    writeChunk(&c, OP_SET_LOCAL, 1, 0);
+    writeChunk(&c, 0, 1, 0);
+    writeChunk(&c, OP_POP, 1, 0);
+    writeChunk(&c, OP_GET_LOCAL, 1, 0);
+    writeChunk(&c, 0, 1, 0);
+    writeChunk(&c, OP_NOT, 1, 0);
+    writeChunk(&c, OP_POP, 1, 0);
+  }
+  writeChunk(&c, OP_RETURN, 1, 0);
+
+  // The chunk is decoded and verified by the first run only.
+  VM *vm = initVM();
+  interpretChunk(vm, &c);
+
+  clock_t start = clock();
+  for (int i = 0; i < numRuns; i++) {
+    interpretChunk(vm, &c);
+  }
+  double elapsed = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+  long count = (long)c.decoded.count * numRuns;
+  printf("%ld instructions in %.3fs (%.2f ns/instruction, result %g)\n", count,
+         elapsed, elapsed * 1e9 / count,
+         AS_NUMBER(vm->frames[0].slots[0]));
+
+  // Cleanup
+  freeChunk(&c);
+
+  freeVM(vm);
+}
+
+// Runs a long straight-line chunk of shifts, xors and masks on a local, along
+// with a counter incremented and compared at every step.
+void benchBitwise() {
+  printf("\nRunning benchBitwise()...\n");
+
+  const int numBlocks = 1000;
+  const int numRuns = 5000;
+
+  Chunk c;
+  initChunk(&c);
+
+  // Slot 0: x, slot 1: counter
+  writeConstant(&c, INT_VAL(12345), 1, 0);
+  writeChunk(&c, OP_PUSH_ZERO, 1, 0);
+  for (int i = 0; i < numBlocks; i++) {
+    // x = (x ^ (x << 5)) & 0xFFFFF
+    writeChunk(&c, OP_GET_LOCAL, 1, 0);
+    writeChunk(&c, 0, 1, 0);
+    writeChunk(&c, OP_GET_LOCAL, 1, 0);
+    writeChunk(&c, 0, 1, 0);
+    writeChunk(&c, OP_PUSH_SMALLINT, 1, 0);
+    writeChunk(&c, 5, 1, 0);
+    writeChunk(&c, OP_BITWISE_SHIFT_LEFT, 1, 0);
+    writeChunk(&c, OP_BITWISE_XOR, 1, 0);
+    writeConstant(&c, INT_VAL(0xFFFFF), 1, 0);
+    writeChunk(&c, OP_BITWISE_AND, 1, 0);
+    writeChunk(&c, OP_SET_LOCAL, 1, 0);
+    writeChunk(&c, 0, 1, 0);
+    writeChunk(&c, OP_POP, 1, 0);
+
+    // x = x ^ (x >> 3)
+    writeChunk(&c, OP_GET_LOCAL, 1, 0);
+    writeChunk(&c, 0, 1, 0);
+    writeChunk(&c, OP_GET_LOCAL, 1, 0);
+    writeChunk(&c, 0, 1, 0);
+    writeChunk(&c, OP_PUSH_SMALLINT, 1, 0);
+    writeChunk(&c, 3, 1, 0);
+    writeChunk(&c, OP_BITWISE_SHIFT_RIGHT, 1, 0);
+    writeChunk(&c, OP_BITWISE_XOR, 1, 0);
+    writeChunk(&c, OP_SET_LOCAL, 1, 0);
+    writeChunk(&c, 0, 1, 0);
+    writeChunk(&c, OP_POP, 1, 0);
+
+    // counter++ < 1000
+    writeChunk(&c, OP_GET_LOCAL, 1, 0);
+    writeChunk(&c, 1, 1, 0);
+    writeChunk(&c, OP_INCREMENT, 1, 0);
+    writeChunk(&c, OP_SET_LOCAL, 1, 0);
+    writeChunk(&c, 1, 1, 0);
+    writeConstant(&c, INT_VAL(1000), 1, 0);
+    writeChunk(&c, OP_LESS, 1, 0);
+    writeChunk(&c, OP_POP, 1, 0);
+  }
+  writeChunk(&c, OP_RETURN, 1, 0);
+
+  // The chunk is decoded and verified by the first run only.
+  VM *vm = initVM();
+  interpretChunk(vm, &c);
+
+  clock_t start = clock();
+  for (int i = 0; i < numRuns; i++) {
+    interpretChunk(vm, &c);
+  }
+  double elapsed = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+  long count = (long)c.decoded.count * numRuns;
+  printf("%ld instructions in %.3fs (%.2f ns/instruction, x ", count, elapsed,
+         elapsed * 1e9 / count);
+  printValue(vm->frames[0].slots[0], "", ", counter ");
+  printValue(vm->frames[0].slots[1], "", ")\n");
+
+  // Cleanup
+  freeChunk(&c);
+
+  freeVM(vm);
+}
+
+// Compiles machine-generated functions with hundreds of locals and constants,
+// most statements reading and assigning them, to measure how fast names are
+// resolved. The bytecode isn't optimized, only the compiler is measured.
+void benchCompileLocals() {
+  printf("\nRunning benchCompileLocals()...\n");
+
+  const int numFunctions = 100;
+  const int numLocals = 240;
+  const int numConstants = 16;
+  const int numStatements = 400;
+
+  size_t size = (size_t)numFunctions *
+                (numLocals * 24 + numConstants * 24 + numStatements * 64 + 64);
+  char *source = malloc(size);
+  size_t len = 0;
+  int references = 0;
+  for (int f = 0; f < numFunctions; f++) {
+    len += snprintf(source + len, size - len, "fun f%d() {\n", f);
+    for (int i = 0; i < numLocals; i++) {
+      len += snprintf(source + len, size - len, "  var v%d = %d;\n", i, i);
+    }
+    for (int i = 0; i < numConstants; i++) {
+      len += snprintf(source + len, size - len, "  const k%d = %d;\n", i, i);
+    }
+    for (int i = 0; i < numStatements; i++) {
+      // Every tenth statement in a block shadowing a local.
+      int a = (i * 7919) % numLocals, b = (i * 104729) % numLocals;
+      if (i % 10 == 0) {
+        len += snprintf(source + len, size - len,
+                        "  { var v%d = k%d; v%d = v%d + v%d * k%d; }\n", b,
+                        i % numConstants, a, b, (a + b) % numLocals,
+                        (i + 1) % numConstants);
+      } else {
+        len += snprintf(source + len, size - len,
+                        "  v%d = v%d + v%d * k%d;\n", a, b,
+                        (a + b) % numLocals, i % numConstants);
+      }
+      references += 4;
+    }
+    len += snprintf(source + len, size - len, "  return v0;\n}\n");
+  }
+
+  VM *vm = initVM();
+  vm->compiler->optimizationLevel = OPTIMIZE_NONE;
+
+  Chunk c;
+  initChunk(&c);
+  vm->compiler->currentChunk = &c;
+  clock_t start = clock();
+  bool compiled = compile(vm->compiler, source);
+  double elapsed = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+  printf("%d functions, %d locals each, %d references compiled %s in %.3fs "
+         "(%.1f ns/reference, %.1f MB/s)\n",
+         numFunctions, numLocals, references, compiled ? "OK" : "FAILED",
+         elapsed, elapsed * 1e9 / references, len / elapsed / 1e6);
+
+  // Cleanup
+  freeChunk(&c);
+  free(source);
+
+  freeVM(vm);
+}
+
+// Compiles a machine-generated script of several MB, made of small functions
+// with the usual statements, to measure the compiler's throughput. As the
+// previous benchmark, the bytecode isn't optimized.
+void benchCompileThroughput() {
+  printf("\nRunning benchCompileThroughput()...\n");
+
+  const int numFunctions = 20000;
+  const int numRuns = 5;
+
+  size_t size = (size_t)numFunctions * 320;
+  char *source = malloc(size);
+  size_t len = 0;
+  for (int f = 0; f < numFunctions; f++) {
+    len += snprintf(source + len, size - len,
+                    "fun f%d(a, b) {\n"
+                    "  var total = 0;\n"
+                    "  for (var i = 0; i < a; i = i + 1) {\n"
+                    "    if (i > b and i < %d) total = total + i * %d;\n"
+                    "    else total = total - (b & %d);\n"
+                    "  }\n"
+                    "  var items = [a, b, %d];\n"
+                    "  print items[0] + total;\n"
+                    "  return total;\n"
+                    "}\n"
+                    "var r%d = f%d(%d, %d);\n",
+                    f, f % 1000, f % 7 + 2, f % 255, f, f, f, f % 10, f % 3);
+  }
+
+  double best = 0;
+  int count = 0;
+  for (int run = 0; run < numRuns; run++) {
+    VM *vm = initVM();
+    vm->compiler->optimizationLevel = OPTIMIZE_NONE;
+
+    Chunk c;
+    initChunk(&c);
+    vm->compiler->currentChunk = &c;
+    clock_t start = clock();
+    if (!compile(vm->compiler, source)) {
+      printf("Compilation failed.\n");
+      return;
+    }
+    double elapsed = (double)(clock() - start) / CLOCKS_PER_SEC;
+    if (run == 0 || elapsed < best)
+      best = elapsed;
+    count = c.count;
+
+    freeChunk(&c);
+    freeVM(vm);
+  }
+
+  printf("%.1f MB of source, %d bytes of script code, best of %d in %.3fs "
+         "(%.1f MB/s)\n",
+         len / 1e6, count, numRuns, best, len / best / 1e6);
+
+  free(source);
+}
@@ -6,5 +6,17 @@ void testLongConst();
 void testAdd();
 void testArithmetics();
 void testNegate();
+void testVerifier();
+void testTailCall();
+void testConstPropagation();
+void testOptimizer();
+void testDeadBranches();
+void testLocalPropagation();
+void testBoundsHoisting();
+void benchLineTable();
+void benchDispatch();
+void benchBitwise();
+void benchCompileLocals();
+void benchCompileThroughput();
 
 #endif
@@ -1,3 +1,4 @@
+#include <inttypes.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -7,7 +8,7 @@
 
 void initValueArray(ValueArray *array) {
   array->cap = 0;
-  array->count = 1;
+  array->count = 0;
   array->values = NULL;
 }
 
@@ -36,6 +37,9 @@ void printValue(Value value, char *head, char *tail) {
   case VAL_BOOL:
     printf("%s", AS_BOOL(value) ? "true" : "false");
     break;
+  case VAL_INT:
+    printf("%" PRId64, AS_INT(value));
+    break;
   case VAL_NUMBER:
     printf("%g", AS_NUMBER(value));
     break;
@@ -48,10 +52,26 @@ void printValue(Value value, char *head, char *tail) {
   printf("%s", tail);
 }
 
+// Compares an integer and a double exactly, converting the integer to a double
+// could round it (above 2^53).
+static bool intEqualsDouble(int64_t i, double d) {
+  // 2^63 is exactly representable, and it's the first double above INT64_MAX.
+  if (!(d >= -9223372036854775808.0 && d < 9223372036854775808.0))
+    return false;
+  return (int64_t)d == i && (double)(int64_t)d == d;
+}
+
 bool valuesEqual(Value a, Value b) {
+  if (IS_INT(a) && IS_DOUBLE(b))
+    return intEqualsDouble(AS_INT(a), AS_NUMBER(b));
+  if (IS_DOUBLE(a) && IS_INT(b))
+    return intEqualsDouble(AS_INT(b), AS_NUMBER(a));
+
   if (a.type != b.type)
     return false;
   switch (a.type) {
+  case VAL_INT:
+    return AS_INT(a) == AS_INT(b);
   case VAL_NUMBER:
     return AS_NUMBER(a) == AS_NUMBER(b);
     break;
@@ -6,11 +6,24 @@
 // Forward declarations to avoid cyclic dependency (defs in object.h)
 typedef struct Obj Obj;
 typedef struct ObjString ObjString;
+typedef struct ObjFunction ObjFunction;
+typedef struct ObjClosure ObjClosure;
+typedef struct ObjUpvalue ObjUpvalue;
+typedef struct ObjNative ObjNative;
+typedef struct ObjArray ObjArray;
+typedef struct ObjMap ObjMap;
+typedef struct ObjFloat64Array ObjFloat64Array;
+typedef struct ObjShape ObjShape;
+typedef struct ObjClass ObjClass;
+typedef struct ObjInstance ObjInstance;
+typedef struct ObjBoundMethod ObjBoundMethod;
+typedef struct ObjCoroutine ObjCoroutine;
 
 // VM's types, not user's types.
 // Types that have the built-in support in the VM.
 typedef enum {
   VAL_BOOL,
+  VAL_INT,
   VAL_NIL,
   VAL_NUMBER,
   VAL_OBJ,
@@ -29,30 +42,43 @@ typedef enum {
 // Value struct:
 // [..type..|..padding..|.......as.......]
 //                       [bool]
+//                       [....integer...]
 //                       [....number....]
+//
+// Numbers are either integers (VAL_INT) or doubles (VAL_NUMBER). Integer
+// literals and arithmetic on integers stay integers, and are promoted to
+// doubles only when the result doesn't fit in 64 bits.
 typedef struct {
   ValueType type;
   union {
     bool boolean;
+    int64_t integer;
     double number;
     Obj *obj;
   } as;
 } Value;
 
 #define IS_BOOL(value) ((value).type == VAL_BOOL)
+#define IS_INT(value) ((value).type == VAL_INT)
+#define IS_DOUBLE(value) ((value).type == VAL_NUMBER)
 #define IS_NIL(value) ((value).type == VAL_NIL)
-#define IS_NUMBER(value) ((value).type == VAL_NUMBER)
+// Either an integer or a double.
+#define IS_NUMBER(value) (IS_INT(value) || IS_DOUBLE(value))
 #define IS_OBJ(value) ((value).type == VAL_OBJ)
 
 // Conversion from nrk KNOWN values to C values
 // It's important to know the type before doing it (see above macros)
 #define AS_BOOL(value) ((value).as.boolean)
-#define AS_NUMBER(value) ((value).as.number)
+#define AS_INT(value) ((value).as.integer)
+// Any number as a double, integers are converted.
+#define AS_NUMBER(value)                                                       \
+  (IS_INT(value) ? (double)(value).as.integer : (value).as.number)
 #define AS_OBJ(value) ((value).as.obj)
 
 // Promotion from C values to nrk values.
 // Creates a tagged union with value and proper type.
 #define BOOL_VAL(value) ((Value){VAL_BOOL, {.boolean = value}})
+#define INT_VAL(value) ((Value){VAL_INT, {.integer = value}})
 #define NIL_VAL ((Value){VAL_NIL, {.number = 0}})
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
 #define OBJ_VAL(object) ((Value){VAL_OBJ, {.obj = (Obj *)object}})
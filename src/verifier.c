@@ -0,0 +1,280 @@
+#include <stdio.h>
+
+#include "chunk.h"
+#include "memory.h"
+#include "object.h"
+#include "verifier.h"
+
+static void verifyError(Chunk *chunk, int instruction, const char *message) {
+  fprintf(stderr, "Malformed bytecode at offset %d: %s.\n",
+          chunk->decoded.offsets[instruction], message);
+}
+
+// Records the stack depth on entry of the target instruction, queuing it the
+// first time it's reached. All the paths reaching an instruction must agree on
+// the depth, otherwise slots wouldn't be where the code expects them.
+static bool reach(Chunk *chunk, int *depths, int *worklist, int *pending,
+                  int from, int target, int depth) {
+  if (target < 0 || target > chunk->decoded.count) {
+    verifyError(chunk, from, "jump out of the chunk");
+    return false;
+  }
+
+  if (depths[target] == -1) {
+    depths[target] = depth;
+    worklist[(*pending)++] = target;
+    return true;
+  }
+
+  if (depths[target] != depth) {
+    verifyError(chunk, from, "inconsistent stack depth");
+    return false;
+  }
+
+  return true;
+}
+
+// The function of OP_CLOSURE must capture existing variables. The closure is
+// pushed before capturing, so a local function can capture its own slot.
+static bool verifyCaptures(Chunk *chunk, int instruction, int depth,
+                           int upvalueCount) {
+  Value constant = *chunk->decoded.code[instruction].constant;
+  if (!IS_FUNCTION(constant)) {
+    verifyError(chunk, instruction, "closure of a non function");
+    return false;
+  }
+
+  ObjFunction *function = AS_FUNCTION(constant);
+  for (int i = 0; i < function->upvalueCount; i++) {
+    Capture *capture = &function->captures[i];
+    int limit = capture->kind == CAPTURE_UPVALUE ? upvalueCount : depth + 1;
+    if (capture->index >= limit) {
+      verifyError(chunk, instruction, "captured variable out of range");
+      return false;
+    }
+  }
+
+  return true;
+}
+
+// The table of OP_JUMP_HASH and OP_JUMP_TABLE gives case indexes, each with
+// its jump right after the miss jump following the instruction. Sets the
+// number of cases.
+static bool verifyJumpTable(Chunk *chunk, int instruction, int *caseCount) {
+  Instruction *instr = &chunk->decoded.code[instruction];
+  Value constant = *instr->constant;
+  int max = -1;
+
+  if (instr->op == OP_JUMP_HASH) {
+    if (!IS_MAP(constant)) {
+      verifyError(chunk, instruction, "jump table isn't a map");
+      return false;
+    }
+    Table *table = &AS_MAP(constant)->table;
+    for (int i = 0; i < table->cap; i++) {
+      Entry *entry = &table->entries[i];
+      if (IS_NIL(entry->key))
+        continue;
+      if (!IS_INT(entry->value) || AS_INT(entry->value) < 0 ||
+          AS_INT(entry->value) > UINT8_MAX) {
+        verifyError(chunk, instruction, "invalid jump table case");
+        return false;
+      }
+      if (AS_INT(entry->value) > max)
+        max = (int)AS_INT(entry->value);
+    }
+  } else {
+    if (!IS_ARRAY(constant) || AS_ARRAY(constant)->elements.count == 0 ||
+        !IS_INT(AS_ARRAY(constant)->elements.values[0])) {
+      verifyError(chunk, instruction, "invalid jump table");
+      return false;
+    }
+    ValueArray *table = &AS_ARRAY(constant)->elements;
+    for (int i = 1; i < table->count; i++) {
+      Value k = table->values[i];
+      if (!IS_INT(k) || AS_INT(k) < -1 || AS_INT(k) > UINT8_MAX) {
+        verifyError(chunk, instruction, "invalid jump table case");
+        return false;
+      }
+      if (AS_INT(k) > max)
+        max = (int)AS_INT(k);
+    }
+  }
+
+  *caseCount = max + 1;
+  for (int i = instruction + 1; i <= instruction + 1 + *caseCount; i++) {
+    if (i >= chunk->decoded.count || (chunk->decoded.code[i].op != OP_JUMP &&
+                                      chunk->decoded.code[i].op != OP_LOOP)) {
+      verifyError(chunk, instruction, "missing jump table jump");
+      return false;
+    }
+  }
+
+  return true;
+}
+
+// Abstractly interprets the decoded chunk, following every path and tracking
+// only the stack depth. It checks that:
+//  - jumps land on an instruction (decodeChunk() already maps them), and
+//    switch dispatches are followed by the jumps of their cases
+//  - constant, local slot and upvalue operands are in range, and so are the
+//    variables captured by OP_CLOSURE
+//  - the stack never underflows and has the same depth on merging paths
+//  - execution can't run past the end of the chunk
+//
+// Functions start with their arity arguments already on the stack, in the
+// first local slots, and run in a closure with upvalueCount upvalues.
+//
+// On success the maximum stack depth, arguments included, is saved in
+// chunk->decoded.maxStack, so the VM can size its stack once (and check it
+// once per call) and push without checking the capacity.
+//
+// The chunk must be decoded.
+bool verifyChunk(Chunk *chunk, int arity, int upvalueCount) {
+  DecodedChunk *decoded = &chunk->decoded;
+  if (decoded->count == 0) {
+    decoded->maxStack = arity;
+    return true;
+  }
+
+  // Stack depth on entry of each instruction, -1 if not reached yet.
+  // The extra one is the end of the chunk.
+  int *depths = ALLOCATE(int, decoded->count + 1);
+  for (int i = 0; i <= decoded->count; i++) {
+    depths[i] = -1;
+  }
+
+  // Every instruction is queued at most once.
+  int *worklist = ALLOCATE(int, decoded->count + 1);
+  int pending = 0;
+
+  depths[0] = arity;
+  worklist[pending++] = 0;
+
+  int maxStack = arity;
+  bool ok = true;
+  while (ok && pending > 0) {
+    int i = worklist[--pending];
+    if (i == decoded->count) {
+      verifyError(chunk, i - 1, "execution runs past the end of the chunk");
+      ok = false;
+      break;
+    }
+
+    Instruction *instr = &decoded->code[i];
+    const OpInfo *info = getOpInfo(instr->op);
+    int depth = depths[i];
+
+    if (info == NULL || instr->op == OP_WIDE) {
+      verifyError(chunk, i, "unknown opcode");
+      ok = false;
+      break;
+    }
+
+    int pops = info->pops;
+    if (info->operand == OPERAND_ARG_COUNT)
+      pops += instr->operand;
+    else if (info->operand == OPERAND_INVOKE)
+      pops += instr->argCount;
+
+    if (depth < pops) {
+      verifyError(chunk, i, "stack underflow");
+      ok = false;
+      break;
+    }
+
+    switch (info->operand) {
+    case OPERAND_CONSTANT:
+    case OPERAND_PROPERTY:
+    case OPERAND_INVOKE:
+      if (instr->constant == NULL || instr->operand < 0 ||
+          instr->operand >= chunk->constants.count) {
+        verifyError(chunk, i, "constant out of range");
+        ok = false;
+      }
+      break;
+    case OPERAND_SLOT:
+      // The local must live below the values the instruction works on.
+      if (instr->operand < 0 || instr->operand >= depth - pops) {
+        verifyError(chunk, i, "local slot out of range");
+        ok = false;
+      }
+      break;
+    case OPERAND_UPVALUE:
+      if (instr->operand < 0 || instr->operand >= upvalueCount) {
+        verifyError(chunk, i, "upvalue out of range");
+        ok = false;
+      }
+      break;
+    case OPERAND_SLOT_JUMP:
+    case OPERAND_SLOT_LOOP:
+      // Range loops use 4 consecutive slots, other loops 3.
+      if (instr->slot + (instr->op == OP_FOR_EACH ? 3 : 4) > depth) {
+        verifyError(chunk, i, "local slot out of range");
+        ok = false;
+      }
+      break;
+    default:
+      break;
+    }
+
+    if (ok && instr->op == OP_CLOSURE)
+      ok = verifyCaptures(chunk, i, depth, upvalueCount);
+    int caseCount = 0;
+    if (ok && (instr->op == OP_JUMP_HASH || instr->op == OP_JUMP_TABLE))
+      ok = verifyJumpTable(chunk, i, &caseCount);
+
+    if (!ok)
+      break;
+
+    depth = depth - pops + info->pushes;
+    if (instr->op == __OP_STACK_RESET)
+      depth = 0;
+
+    if (depth > maxStack)
+      maxStack = depth;
+
+    switch (instr->op) {
+    case OP_RETURN:
+    case OP_RETURN_VALUE:
+      break;
+    case OP_JUMP:
+    case OP_LOOP:
+      ok = reach(chunk, depths, worklist, &pending, i, i + 1 + instr->operand,
+                 depth);
+      break;
+    case OP_FOR_EACH:
+    case OP_FOR_RANGE:
+    case OP_FOR_RANGE_INIT:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_NOT_GREATER_EQUAL:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_NOT_LESS_EQUAL:
+    case OP_JUMP_IF_TRUE:
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_POP_JUMP_IF_TRUE:
+      ok = reach(chunk, depths, worklist, &pending, i, i + 1 + instr->operand,
+                 depth) &&
+           reach(chunk, depths, worklist, &pending, i, i + 1, depth);
+      break;
+    case OP_JUMP_HASH:
+    case OP_JUMP_TABLE:
+      // The miss jump, then the jump of each case.
+      for (int k = 0; ok && k <= caseCount; k++) {
+        ok = reach(chunk, depths, worklist, &pending, i, i + 1 + k, depth);
+      }
+      break;
+    default:
+      ok = reach(chunk, depths, worklist, &pending, i, i + 1, depth);
+      break;
+    }
+  }
+
+  FREE_ARR(int, depths, decoded->count + 1);
+  FREE_ARR(int, worklist, decoded->count + 1);
+
+  decoded->maxStack = ok ? maxStack : 0;
+  decoded->verified = ok;
+  return ok;
+}
@@ -0,0 +1,8 @@
+#ifndef nrk_verifier_h
+#define nrk_verifier_h
+
+#include "chunk.h"
+
+bool verifyChunk(Chunk *chunk, int arity, int upvalueCount);
+
+#endif
@@ -3,10 +3,14 @@
 #include "compiler.h"
 #include "debug.h"
 #include "memory.h"
+#include "native.h"
 #include "object.h"
+#include "simd.h"
 #include "table.h"
 #include "value.h"
-#include <arpa/inet.h>
+#include "verifier.h"
+#include <inttypes.h>
+#include <math.h>
 #include <stdarg.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -18,12 +22,22 @@ VM *initVM() {
   VM *vm = (VM *)malloc(sizeof(VM));
   vm->memoryManager = initMemoryManager();
   vm->compiler = initCompiler(vm->memoryManager);
+  // Let's grow the stack right away, interpretChunk() grows it further if a
+  // chunk needs more.
+  vm->stackCap = GROW_CAP(0);
+  vm->stack = GROW_ARR(Value, NULL, 0, vm->stackCap);
+  vm->frameCap = GROW_CAP(0);
+  vm->frames = ALLOCATE(CallFrame, vm->frameCap);
+  vm->coroutine = NULL;
   resetStack(vm);
+  vm->initString = copyString(vm->memoryManager, "init", 4);
+  defineNatives(vm);
   return vm;
 }
 
 void freeVM(VM *vm) {
   FREE_ARR(Value, vm->stack, vm->stackCap);
+  FREE_ARR(CallFrame, vm->frames, vm->frameCap);
 
   freeCompiler(vm->compiler);
   vm->compiler = NULL;
@@ -34,18 +48,97 @@ void freeVM(VM *vm) {
   free(vm);
 };
 
+// Swaps the stacks the VM runs on with the ones kept by the coroutine: the
+// coroutine's to resume it, the resumer's back when it yields or returns.
+static void swapStacks(VM *vm, ObjCoroutine *coroutine) {
+#define SWAP(type, field)                                                      \
+  do {                                                                         \
+    type tmp = vm->field;                                                      \
+    vm->field = coroutine->field;                                              \
+    coroutine->field = tmp;                                                    \
+  } while (false)
+
+  SWAP(CallFrame *, frames);
+  SWAP(int, frameCount);
+  SWAP(int, frameCap);
+  SWAP(Value *, stack);
+  SWAP(Value *, stackTop);
+  SWAP(int, stackCap);
+  SWAP(ObjUpvalue *, openUpvalues);
+
+#undef SWAP
+}
+
+static void resumeCoroutine(VM *vm, ObjCoroutine *coroutine) {
+  swapStacks(vm, coroutine);
+  coroutine->state = COROUTINE_RUNNING;
+  coroutine->caller = vm->coroutine;
+  vm->coroutine = coroutine;
+}
+
+// Goes back to the resumer of the coroutine running, leaving it in state.
+static void suspendCoroutine(VM *vm, CoroutineState state) {
+  ObjCoroutine *coroutine = vm->coroutine;
+  swapStacks(vm, coroutine);
+  coroutine->state = state;
+  vm->coroutine = coroutine->caller;
+  coroutine->caller = NULL;
+}
+
+// Returning from the generator function: its stacks are freed right away, as
+// nothing can run on them anymore.
+static void finishCoroutine(VM *vm) {
+  ObjCoroutine *coroutine = vm->coroutine;
+  suspendCoroutine(vm, COROUTINE_DONE);
+  FREE_ARR(CallFrame, coroutine->frames, coroutine->frameCap);
+  FREE_ARR(Value, coroutine->stack, coroutine->stackCap);
+  coroutine->frames = NULL;
+  coroutine->frameCount = 0;
+  coroutine->frameCap = 0;
+  coroutine->stack = NULL;
+  coroutine->stackTop = NULL;
+  coroutine->stackCap = 0;
+}
+
 void resetStack(VM *vm) {
-  if (vm->stack != NULL) {
-    vm->stack = FREE_ARR(Value, vm->stack, vm->stackCap);
+  // An error in a generator ends it, and the generators that resumed it, back
+  // to the script.
+  while (vm->coroutine != NULL) {
+    suspendCoroutine(vm, COROUTINE_DONE);
   }
 
-  // Let's grow the stack right away to avoid doing it everytime at runtime the
-  // first time
-  vm->stackCap = GROW_CAP(0);
-  vm->stack = GROW_ARR(Value, vm->stack, 0, vm->stackCap);
-
-  // Position the top of the stack at its beginning (first empty element)
+  // Position the top of the stack at its beginning (first empty element).
+  // The stack keeps its capacity, as running chunks rely on it.
   vm->stackTop = vm->stack;
+  vm->frameCount = 0;
+  vm->openUpvalues = NULL;
+  vm->hadNativeError = false;
+}
+
+// Makes room for at least cap values in the stack. The stack moves, so the
+// frames, the open upvalues and the top of the stack are moved along with it.
+static void reserveStack(VM *vm, int cap) {
+  if (vm->stackCap >= cap)
+    return;
+
+  int newCap = GROW_CAP(vm->stackCap);
+  if (newCap < cap)
+    newCap = cap;
+
+  Value *stack = ALLOCATE(Value, newCap);
+  memcpy(stack, vm->stack, sizeof(Value) * (vm->stackTop - vm->stack));
+  for (int i = 0; i < vm->frameCount; i++) {
+    vm->frames[i].slots = stack + (vm->frames[i].slots - vm->stack);
+  }
+  for (ObjUpvalue *upvalue = vm->openUpvalues; upvalue != NULL;
+       upvalue = upvalue->next) {
+    upvalue->location = stack + (upvalue->location - vm->stack);
+  }
+  vm->stackTop = stack + (vm->stackTop - vm->stack);
+
+  FREE_ARR(Value, vm->stack, vm->stackCap);
+  vm->stack = stack;
+  vm->stackCap = newCap;
 }
 
 void push(VM *vm, Value value) {
@@ -67,6 +160,35 @@ Value pop(VM *vm) {
   return *vm->stackTop;
 }
 
+static void printFrames(CallFrame *frames, int frameCount) {
+  for (int i = frameCount - 1; i >= 0; i--) {
+    CallFrame *frame = &frames[i];
+
+    // We take the "previous" instruction as we've already advanced.
+    size_t instruction = frame->ip - frame->chunk->decoded.code - 1;
+    int offset = frame->chunk->decoded.offsets[instruction];
+
+    fprintf(stderr, "[Line %d:%d] in ",
+            getInstructionLine(frame->chunk, offset),
+            getInstructionColumn(frame->chunk, offset));
+    if (frame->function == NULL) {
+      fprintf(stderr, "script\n");
+    } else {
+      fprintf(stderr, "%s()\n", frame->function->name->str);
+    }
+  }
+}
+
+// Prints the calls being executed, innermost first, through the generators
+// running and their resumers.
+static void printStackTrace(VM *vm) {
+  printFrames(vm->frames, vm->frameCount);
+  for (ObjCoroutine *coroutine = vm->coroutine; coroutine != NULL;
+       coroutine = coroutine->caller) {
+    printFrames(coroutine->frames, coroutine->frameCount);
+  }
+}
+
 // Report an error to the user and reset the stack as it is invalidated.
 static void runtimeError(VM *vm, const char *format, ...) {
   va_list(args);
@@ -75,25 +197,96 @@ static void runtimeError(VM *vm, const char *format, ...) {
   va_end(args);
   fputs("\n", stderr);
 
-  // We take the "previous" instruction as we've already advanced.
-  size_t instruction = vm->ip - vm->chunk->code - 1;
+  printStackTrace(vm);
+  resetStack(vm);
+}
 
-  fprintf(stderr, "[Line %d] in script\n",
-          getInstructionLine(vm->chunk, instruction));
+Value nativeError(VM *vm, const char *format, ...) {
+  va_list(args);
+  va_start(args, format);
+  vfprintf(stderr, format, args);
+  va_end(args);
+  fputs("\n", stderr);
 
-  resetStack(vm);
+  printStackTrace(vm);
+  vm->hadNativeError = true;
+  return NIL_VAL;
 }
 
-// Returns the value on the stack at the given distance.
-// Returns the top of the stack if dist is 0.
-static Value peek(VM *vm, int dist) { return vm->stackTop[-1 - dist]; }
+void defineNative(VM *vm, const char *name, NativeFn function, int arity) {
+  ObjString *string = copyString(vm->memoryManager, name, (int)strlen(name));
+  ObjNative *native = newNative(vm->memoryManager, function, arity, string);
+  tableSet(&vm->memoryManager->globals, string, OBJ_VAL(native));
+  // Natives can't be assigned, see OP_SET_GLOBAL.
+  tableSet(&vm->memoryManager->constants, string, NIL_VAL);
+}
+
+// Elementwise a op b, where one operand is a Float64Array and the other one a
+// Float64Array of the same length or a number. The whole loop is a single
+// kernel call.
+static bool float64Operation(VM *vm, Float64Op op, Value a, Value b,
+                             Value *result) {
+  Float64Operand x = {NULL, 0};
+  Float64Operand y = {NULL, 0};
+  int count = -1;
+
+  if (IS_FLOAT64_ARRAY(a)) {
+    x.values = AS_FLOAT64_ARRAY(a)->values;
+    count = AS_FLOAT64_ARRAY(a)->count;
+  } else if (IS_NUMBER(a)) {
+    x.scalar = AS_NUMBER(a);
+  } else {
+    runtimeError(vm, "Operands must be Float64Arrays or numbers.");
+    return false;
+  }
+
+  if (IS_FLOAT64_ARRAY(b)) {
+    y.values = AS_FLOAT64_ARRAY(b)->values;
+    if (count != -1 && count != AS_FLOAT64_ARRAY(b)->count) {
+      runtimeError(vm, "Float64Array lengths differ (%d and %d).", count,
+                   AS_FLOAT64_ARRAY(b)->count);
+      return false;
+    }
+    count = AS_FLOAT64_ARRAY(b)->count;
+  } else if (IS_NUMBER(b)) {
+    y.scalar = AS_NUMBER(b);
+  } else {
+    runtimeError(vm, "Operands must be Float64Arrays or numbers.");
+    return false;
+  }
+
+  ObjFloat64Array *array = newFloat64Array(vm->memoryManager, count);
+  float64Binary(op, array->values, x, y, count);
+  *result = OBJ_VAL(array);
+  return true;
+}
 
 // Returns true is the value is nil, false or 0.
 static bool isFalsey(Value v) {
-  return IS_NIL(v) ||
-         ((IS_BOOL(v) && !AS_BOOL(v)) || (IS_NUMBER(v) && AS_NUMBER(v) == 0));
+  return IS_NIL(v) || (IS_BOOL(v) && !AS_BOOL(v)) ||
+         (IS_INT(v) && AS_INT(v) == 0) || (IS_DOUBLE(v) && AS_NUMBER(v) == 0);
 }
 
+// Converts a number to an integer for bitwise operations, truncating doubles.
+// Doubles out of the int64 range (and NaN) become 0.
+static int64_t toInteger(Value v) {
+  if (IS_INT(v))
+    return AS_INT(v);
+
+  double d = AS_NUMBER(v);
+  if (!(d >= -9223372036854775808.0 && d < 9223372036854775808.0))
+    return 0;
+  return (int64_t)d;
+}
+
+// The shift count is taken modulo 64. Left shifts are done unsigned as shifting
+// into or out of the sign bit is undefined.
+static int64_t shiftLeft(int64_t a, int64_t b) {
+  return (int64_t)((uint64_t)a << (b & 63));
+}
+
+static int64_t shiftRight(int64_t a, int64_t b) { return a >> (b & 63); }
+
 static void concatenate(VM *vm) {
   // The order must be [ b, a ] to preserve the stack fifo sort.
   ObjString *b = AS_STRING(pop(vm));
@@ -110,52 +303,432 @@ static void concatenate(VM *vm) {
   push(vm, OBJ_VAL(c));
 }
 
+// Frames move, so run() takes its frame again after a call.
+static void growFrames(VM *vm) {
+  int cap = GROW_CAP(vm->frameCap);
+  if (cap > FRAMES_MAX)
+    cap = FRAMES_MAX;
+  vm->frames = GROW_ARR(CallFrame, vm->frames, vm->frameCap, cap);
+  vm->frameCap = cap;
+}
+
+// Calling a generator function creates the generator, with stacks of its own
+// sized for the function's frame (they grow like the VM's if it calls
+// further). The callee and the arguments are moved there, nothing runs until
+// the generator is resumed. The generator replaces the callee.
+static void startGenerator(VM *vm, ObjFunction *function, Value *upvalues,
+                           int argCount) {
+  ObjCoroutine *coroutine = newCoroutine(vm->memoryManager);
+  coroutine->stackCap = function->chunk.decoded.maxStack + 1;
+  coroutine->stack = ALLOCATE(Value, coroutine->stackCap);
+  memcpy(coroutine->stack, vm->stackTop - argCount - 1,
+         sizeof(Value) * (argCount + 1));
+  coroutine->stackTop = coroutine->stack + argCount + 1;
+
+  coroutine->frameCap = GROW_CAP(0);
+  coroutine->frames = ALLOCATE(CallFrame, coroutine->frameCap);
+  coroutine->frameCount = 1;
+  CallFrame *frame = &coroutine->frames[0];
+  frame->function = function;
+  frame->upvalues = upvalues;
+  frame->chunk = &function->chunk;
+  frame->ip = function->chunk.decoded.code;
+  frame->slots = coroutine->stack + 1;
+
+  vm->stackTop -= argCount;
+  vm->stackTop[-1] = OBJ_VAL(coroutine);
+}
+
+// Natives run right away on the arguments in place, the result replaces the
+// callee.
+static bool callNative(VM *vm, ObjNative *native, int argCount) {
+  if (native->arity != -1 && argCount != native->arity) {
+    runtimeError(vm, "Expected %d arguments but got %d.", native->arity,
+                 argCount);
+    return false;
+  }
+
+  Value *args = vm->stackTop - argCount;
+  Value result = native->function(vm, argCount, args);
+  if (vm->hadNativeError) {
+    resetStack(vm);
+    return false;
+  }
+
+  args[-1] = result;
+  vm->stackTop = args;
+  return true;
+}
+
+// Calls the callee, that sits below its argCount arguments on the stack. The
+// arguments stay where they are and become the first locals of the new frame.
+// Frames are preallocated and the stack only grows when a call goes deeper
+// than ever before, so calling doesn't allocate.
+//
+// Methods find their receiver in the callee slot (see OP_GET_THIS): calling a
+// bound method or a class puts it there.
+//
+// Returns false, after reporting the error, if the callee can't be called.
+static bool callValue(VM *vm, Value callee, int argCount) {
+  if (IS_NATIVE(callee))
+    return callNative(vm, AS_NATIVE(callee), argCount);
+
+  if (IS_BOUND_METHOD(callee)) {
+    ObjBoundMethod *bound = AS_BOUND_METHOD(callee);
+    vm->stackTop[-argCount - 1] = bound->receiver;
+    return callValue(vm, bound->method, argCount);
+  }
+
+  if (IS_CLASS(callee)) {
+    ObjClass *klass = AS_CLASS(callee);
+    vm->stackTop[-argCount - 1] =
+        OBJ_VAL(newInstance(vm->memoryManager, klass));
+    if (!IS_NIL(klass->initializer))
+      return callValue(vm, klass->initializer, argCount);
+    if (argCount != 0) {
+      runtimeError(vm, "Expected 0 arguments but got %d.", argCount);
+      return false;
+    }
+    return true;
+  }
+
+  ObjFunction *function;
+  Value *upvalues = NULL;
+  if (IS_CLOSURE(callee)) {
+    function = AS_CLOSURE(callee)->function;
+    upvalues = AS_CLOSURE(callee)->upvalues;
+  } else if (IS_FUNCTION(callee)) {
+    function = AS_FUNCTION(callee);
+  } else {
+    runtimeError(vm, "Can only call functions.");
+    return false;
+  }
+
+  if (argCount != function->arity) {
+    runtimeError(vm, "Expected %d arguments but got %d.", function->arity,
+                 argCount);
+    return false;
+  }
+
+  if (function->isGenerator) {
+    startGenerator(vm, function, upvalues, argCount);
+    return true;
+  }
+
+  if (vm->frameCount == vm->frameCap) {
+    if (vm->frameCap == FRAMES_MAX) {
+      runtimeError(vm, "Stack overflow.");
+      return false;
+    }
+    growFrames(vm);
+  }
+
+  // The callee's chunk has been verified too, its maxStack counts the
+  // arguments.
+  int base = (int)(vm->stackTop - vm->stack) - argCount;
+  reserveStack(vm, base + function->chunk.decoded.maxStack);
+
+  CallFrame *frame = &vm->frames[vm->frameCount++];
+  frame->function = function;
+  frame->upvalues = upvalues;
+  frame->chunk = &function->chunk;
+  frame->ip = function->chunk.decoded.code;
+  frame->slots = vm->stack + base;
+  return true;
+}
+
+// Returns the entry of the inline cache for the shape, NULL on a miss.
+static inline CacheEntry *cacheLookup(InlineCache *cache, ObjShape *shape) {
+  for (int i = 0; i < INLINE_CACHE_WAYS; i++) {
+    if (cache->entries[i].shape == shape)
+      return &cache->entries[i];
+  }
+  return NULL;
+}
+
+// Fills an entry of the cache for the shape, replacing the oldest one if
+// they're all used.
+static CacheEntry *cacheFill(InlineCache *cache, ObjShape *shape, int field,
+                             ObjShape *transition, Value method) {
+  CacheEntry *entry = &cache->entries[cache->next];
+  cache->next = (cache->next + 1) % INLINE_CACHE_WAYS;
+  entry->shape = shape;
+  entry->field = field;
+  entry->transition = transition;
+  entry->method = method;
+  return entry;
+}
+
+// Looks the property up on a cache miss: a field of the shape first, then a
+// method of the class. Returns NULL, after reporting the error, if there's
+// neither.
+static CacheEntry *cacheProperty(VM *vm, InlineCache *cache, ObjShape *shape,
+                                 ObjString *name) {
+  Value value;
+  if (tableGet(&shape->fields, name, &value))
+    return cacheFill(cache, shape, (int)AS_INT(value), NULL, NIL_VAL);
+  if (tableGet(&shape->klass->methods, name, &value))
+    return cacheFill(cache, shape, -1, NULL, value);
+
+  runtimeError(vm, "Undefined property '%s'.", name->str);
+  return NULL;
+}
+
+// Looks the field up on a cache miss of OP_SET_PROPERTY: a new field gives
+// the transition to the shape with it.
+static CacheEntry *cacheField(VM *vm, InlineCache *cache, ObjShape *shape,
+                              ObjString *name) {
+  Value index;
+  if (tableGet(&shape->fields, name, &index))
+    return cacheFill(cache, shape, (int)AS_INT(index), NULL, NIL_VAL);
+
+  ObjShape *transition = shapeAddField(vm->memoryManager, shape, name);
+  return cacheFill(cache, shape, transition->fieldCount - 1, transition,
+                   NIL_VAL);
+}
+
+// Returns the upvalue of the local in the given slot, reusing the open one if
+// another closure already captured it, so that they all share the variable.
+static ObjUpvalue *captureUpvalue(VM *vm, Value *local) {
+  ObjUpvalue *prev = NULL;
+  ObjUpvalue *upvalue = vm->openUpvalues;
+  while (upvalue != NULL && upvalue->location > local) {
+    prev = upvalue;
+    upvalue = upvalue->next;
+  }
+
+  if (upvalue != NULL && upvalue->location == local)
+    return upvalue;
+
+  ObjUpvalue *created = newUpvalue(vm->memoryManager, local);
+  created->next = upvalue;
+  if (prev == NULL) {
+    vm->openUpvalues = created;
+  } else {
+    prev->next = created;
+  }
+
+  return created;
+}
+
+// Closes the open upvalues of the slots from last up: the locals leave the
+// stack, so their value is moved into the upvalue.
+static void closeUpvalues(VM *vm, Value *last) {
+  while (vm->openUpvalues != NULL && vm->openUpvalues->location >= last) {
+    ObjUpvalue *upvalue = vm->openUpvalues;
+    upvalue->closed = *upvalue->location;
+    upvalue->location = &upvalue->closed;
+    vm->openUpvalues = upvalue->next;
+  }
+}
+
 // Better and faster way are writing ASM or using non standard C lib
 // To keep things simple we use a switch statement
+//
+// The chunk has been verified and the stack sized to its maximum depth (see
+// verifyChunk()), so values are pushed without checking the capacity.
+//
+// The instruction pointer, the top of the stack and the locals of the current
+// call live in locals, so the compiler can keep them in registers instead of
+// going through the VM. They are spilled back to the VM only around code that
+// looks at them: runtime errors, functions working on the stack and tracing.
 static InterpretResult run(VM *vm) {
+  CallFrame *frame = &vm->frames[vm->frameCount - 1];
+  Instruction *ip = frame->ip;
+  Value *slots = frame->slots;
+  Value *sp = vm->stackTop;
 
-#define READ_BYTE() (*vm->ip++)
+#define SPILL()                                                                \
+  do {                                                                         \
+    frame->ip = ip;                                                            \
+    vm->stackTop = sp;                                                         \
+  } while (false)
 
-#define READ_SHORT() (vm->ip += 2, (u_int16_t)((vm->ip[-2] << 8) | vm->ip[-1]))
+#define RELOAD()                                                               \
+  do {                                                                         \
+    ip = frame->ip;                                                            \
+    slots = frame->slots;                                                      \
+    sp = vm->stackTop;                                                         \
+  } while (false)
 
-#define MOVE_BYTES(n) (vm->ip += (n))
+#define RUNTIME_ERROR(...)                                                     \
+  do {                                                                         \
+    SPILL();                                                                   \
+    runtimeError(vm, __VA_ARGS__);                                             \
+    return INTERPRET_RUNTIME_ERROR;                                            \
+  } while (false)
 
-#define READ_CONSTANT() (vm->chunk->constants.values[READ_BYTE()])
+#define PUSH(value) (*sp++ = (value))
 
-#define READ_CONSTANT_LONG()                                                   \
-  (vm->chunk->constants.values[GET_CONSTANT_LONG_ID(                           \
-      vm->chunk, (int)(vm->ip - vm->chunk->code - 1))])
+#define POP() (*--sp)
+
+// Returns the value on the stack at the given distance.
+// Returns the top of the stack if dist is 0.
+#define PEEK(dist) (sp[-1 - (dist)])
+
+// Operands are already decoded (see decodeChunk()), so each instruction is
+// just read as it is.
+#define READ_INSTRUCTION() (ip++)
+
+#define READ_CONSTANT() (*instruction->constant)
 
 #define READ_STRING() AS_STRING(READ_CONSTANT())
 
-#define READ_STRING_LONG() AS_STRING(READ_CONSTANT_LONG())
+// Inline cache of the property instruction being executed.
+#define READ_CACHE() (&frame->chunk->decoded.caches[instruction->slot])
 
-#define BINARY_OP(valueType, op)                                               \
+// Checks that indexValue is an integer in [0, count), setting index.
+#define CHECK_BOUNDS(indexValue, count, index)                                 \
   do {                                                                         \
-    if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1))) {                  \
-      runtimeError(vm, "Operands must be numbers.");                           \
-      return INTERPRET_RUNTIME_ERROR;                                          \
+    if (!IS_INT(indexValue)) {                                                 \
+      RUNTIME_ERROR("Array index must be an integer.");                        \
+    }                                                                          \
+    index = AS_INT(indexValue);                                                \
+    if (index < 0 || index >= (count)) {                                       \
+      RUNTIME_ERROR("Array index %" PRId64 " out of bounds [0, %d).", index,   \
+                    (count));                                                  \
+    }                                                                          \
+  } while (false)
+
+// Checks that target[index] is an element of an array, setting elements and
+// index.
+#define CHECK_INDEX(target, indexValue, elements, index)                       \
+  do {                                                                         \
+    if (!IS_ARRAY(target)) {                                                   \
+      RUNTIME_ERROR("Can only index arrays and maps.");                        \
+    }                                                                          \
+    elements = &AS_ARRAY(target)->elements;                                    \
+    CHECK_BOUNDS(indexValue, elements->count, index);                          \
+  } while (false)
+
+// Pops the current call, replacing the callee and the arguments with the
+// result, and goes back to the caller. Returning from the script ends run(),
+// returning from a generator function ends the generator: its resumer exits
+// the loop (the value returned is dropped).
+// Locals captured by closures are moved to the heap first.
+#define RETURN_TO_CALLER(result)                                               \
+  do {                                                                         \
+    if (vm->frameCount == 1 && vm->coroutine == NULL) {                        \
+      SPILL();                                                                 \
+      return INTERPRET_OK;                                                     \
     }                                                                          \
-    double b = AS_NUMBER(pop(vm));                                             \
-    double a = AS_NUMBER(pop(vm));                                             \
-    push(vm, valueType(a op b));                                               \
+    if (vm->openUpvalues != NULL)                                              \
+      closeUpvalues(vm, slots);                                                \
+    if (vm->frameCount == 1) {                                                 \
+      finishCoroutine(vm);                                                     \
+      frame = &vm->frames[vm->frameCount - 1];                                 \
+      RELOAD();                                                                \
+      ip += ip[-1].operand;                                                    \
+      break;                                                                   \
+    }                                                                          \
+    sp = slots;                                                                \
+    sp[-1] = (result);                                                         \
+    vm->frameCount--;                                                          \
+    frame = &vm->frames[vm->frameCount - 1];                                   \
+    ip = frame->ip;                                                            \
+    slots = frame->slots;                                                      \
   } while (false)
 
-#define BINARY_OP_BITWISE(op)                                                  \
+// Replaces the two operands, one of them a Float64Array, with the elementwise
+// result (see float64Operation()). The caller pops.
+#define FLOAT64_OP(float64Op)                                                  \
   do {                                                                         \
-    if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1))) {                  \
-      runtimeError(vm, "Bitwise operands must be numbers.");                   \
+    SPILL();                                                                   \
+    if (!float64Operation(vm, float64Op, PEEK(1), PEEK(0), &sp[-2]))           \
       return INTERPRET_RUNTIME_ERROR;                                          \
+  } while (false)
+
+// Integers stay integers unless the result overflows (checked with one of the
+// __builtin_*_overflow), in which case it's computed on doubles.
+#define ARITHMETIC_OP(op, overflows, float64Op)                                \
+  do {                                                                         \
+    Value b = PEEK(0);                                                         \
+    Value a = PEEK(1);                                                         \
+    int64_t result;                                                            \
+    if (IS_INT(a) && IS_INT(b) &&                                              \
+        !overflows(AS_INT(a), AS_INT(b), &result)) {                           \
+      sp[-2] = INT_VAL(result);                                                \
+    } else if (IS_NUMBER(a) && IS_NUMBER(b)) {                                 \
+      sp[-2] = NUMBER_VAL(AS_NUMBER(a) op AS_NUMBER(b));                       \
+    } else if (IS_FLOAT64_ARRAY(a) || IS_FLOAT64_ARRAY(b)) {                   \
+      FLOAT64_OP(float64Op);                                                   \
+    } else {                                                                   \
+      RUNTIME_ERROR("Operands must be numbers.");                              \
+    }                                                                          \
+    sp--;                                                                      \
+  } while (false)
+
+#define COMPARISON_OP(op, float64Op)                                           \
+  do {                                                                         \
+    Value b = PEEK(0);                                                         \
+    Value a = PEEK(1);                                                         \
+    if (IS_INT(a) && IS_INT(b)) {                                              \
+      sp[-2] = BOOL_VAL(AS_INT(a) op AS_INT(b));                               \
+    } else if (IS_NUMBER(a) && IS_NUMBER(b)) {                                 \
+      sp[-2] = BOOL_VAL(AS_NUMBER(a) op AS_NUMBER(b));                         \
+    } else if (IS_FLOAT64_ARRAY(a) || IS_FLOAT64_ARRAY(b)) {                   \
+      FLOAT64_OP(float64Op);                                                   \
+    } else {                                                                   \
+      RUNTIME_ERROR("Operands must be numbers.");                              \
+    }                                                                          \
+    sp--;                                                                      \
+  } while (false)
+
+// Comparison fused with the following OP_JUMP_IF_FALSE: both operands are
+// popped and the jump is taken if the comparison is false.
+#define COMPARISON_JUMP(op)                                                    \
+  do {                                                                         \
+    Value b = PEEK(0);                                                         \
+    Value a = PEEK(1);                                                         \
+    bool result;                                                               \
+    if (IS_INT(a) && IS_INT(b)) {                                              \
+      result = AS_INT(a) op AS_INT(b);                                         \
+    } else if (IS_NUMBER(a) && IS_NUMBER(b)) {                                 \
+      result = AS_NUMBER(a) op AS_NUMBER(b);                                   \
+    } else {                                                                   \
+      RUNTIME_ERROR("Operands must be numbers.");                              \
+    }                                                                          \
+    sp -= 2;                                                                   \
+    if (!result)                                                               \
+      ip += instruction->operand;                                              \
+  } while (false)
+
+// Bitwise operations always produce integers, doubles are truncated.
+#define BITWISE_OP(op, float64Op)                                              \
+  do {                                                                         \
+    Value b = PEEK(0);                                                         \
+    Value a = PEEK(1);                                                         \
+    if (IS_INT(a) && IS_INT(b)) {                                              \
+      sp[-2] = INT_VAL(AS_INT(a) op AS_INT(b));                                \
+    } else if (IS_NUMBER(a) && IS_NUMBER(b)) {                                 \
+      sp[-2] = INT_VAL(toInteger(a) op toInteger(b));                          \
+    } else if (IS_FLOAT64_ARRAY(a) || IS_FLOAT64_ARRAY(b)) {                   \
+      FLOAT64_OP(float64Op);                                                   \
+    } else {                                                                   \
+      RUNTIME_ERROR("Bitwise operands must be numbers.");                      \
+    }                                                                          \
+    sp--;                                                                      \
+  } while (false)
+
+#define SHIFT_OP(shift)                                                        \
+  do {                                                                         \
+    Value b = PEEK(0);                                                         \
+    Value a = PEEK(1);                                                         \
+    if (IS_INT(a) && IS_INT(b)) {                                              \
+      sp[-2] = INT_VAL(shift(AS_INT(a), AS_INT(b)));                           \
+    } else if (IS_NUMBER(a) && IS_NUMBER(b)) {                                 \
+      sp[-2] = INT_VAL(shift(toInteger(a), toInteger(b)));                     \
+    } else {                                                                   \
+      RUNTIME_ERROR("Bitwise operands must be numbers.");                      \
     }                                                                          \
-    int64_t b = (int64_t)AS_NUMBER(pop(vm));                                   \
-    int64_t a = (int64_t)AS_NUMBER(pop(vm));                                   \
-    push(vm, NUMBER_VAL(a op b));                                              \
+    sp--;                                                                      \
   } while (false)
 
   // Decode and dispatch loop
   for (;;) {
 
 #ifdef DEBUG_TRACE_EXECUTION
+    SPILL();
     // Print out the stack
     printf("== stack ==\n[ ");
     for (Value *v = vm->stack; v < vm->stackTop; v++) {
@@ -163,227 +736,647 @@ static InterpretResult run(VM *vm) {
     }
     printf("]\n===========\n");
     // To get the offset we do some pointer math
-    disassembleInstruction(vm->chunk, (int)(vm->ip - vm->chunk->code));
+    disassembleInstruction(
+        frame->chunk,
+        frame->chunk->decoded.offsets[ip - frame->chunk->decoded.code]);
 #endif
 
-    u_int8_t instruction;
-    switch (instruction = READ_BYTE()) {
+    Instruction *instruction = READ_INSTRUCTION();
+    switch (instruction->op) {
     case __OP_STACK_RESET: {
-      resetStack(vm);
+      sp = slots;
       break;
     }
     case __OP_DUP: {
-      push(vm, peek(vm, 0));
+      Value top = PEEK(0);
+      PUSH(top);
       break;
     }
     case OP_NEGATE: {
-      if (!IS_NUMBER(peek(vm, 0))) {
-        runtimeError(vm, "Operand must be a number");
-        return INTERPRET_RUNTIME_ERROR;
+      Value a = PEEK(0);
+      if (IS_INT(a) && AS_INT(a) != INT64_MIN) {
+        sp[-1] = INT_VAL(-AS_INT(a));
+      } else if (IS_NUMBER(a)) {
+        sp[-1] = NUMBER_VAL(-AS_NUMBER(a));
+      } else {
+        RUNTIME_ERROR("Operand must be a number");
       }
-      vm->stackTop[-1].as.number = -peek(vm, 0).as.number;
       break;
     }
     case OP_ADD: {
-      if (IS_STRING(peek(vm, 0)) && IS_STRING(peek(vm, 1))) {
+      if (IS_STRING(PEEK(0)) && IS_STRING(PEEK(1))) {
+        SPILL();
         concatenate(vm);
-      } else if (IS_NUMBER(peek(vm, 0)) && IS_NUMBER(peek(vm, 1))) {
-        push(vm, NUMBER_VAL(AS_NUMBER(pop(vm)) + AS_NUMBER(pop(vm))));
+        RELOAD();
+      } else if ((IS_NUMBER(PEEK(0)) || IS_FLOAT64_ARRAY(PEEK(0))) &&
+                 (IS_NUMBER(PEEK(1)) || IS_FLOAT64_ARRAY(PEEK(1)))) {
+        ARITHMETIC_OP(+, __builtin_add_overflow, F64_ADD);
       } else {
-        runtimeError(vm, "Operands must be both either strings or numbers");
-        return INTERPRET_RUNTIME_ERROR;
+        RUNTIME_ERROR("Operands must be both either strings or numbers");
       }
 
       break;
     }
     case OP_SUBTRACT: {
-      BINARY_OP(NUMBER_VAL, -);
+      ARITHMETIC_OP(-, __builtin_sub_overflow, F64_SUBTRACT);
       break;
     }
     case OP_MULTIPLY: {
-      BINARY_OP(NUMBER_VAL, *);
+      ARITHMETIC_OP(*, __builtin_mul_overflow, F64_MULTIPLY);
       break;
     }
     case OP_DIVIDE: {
-      BINARY_OP(NUMBER_VAL, /);
+      Value b = PEEK(0);
+      Value a = PEEK(1);
+      // Only exact integer divisions give an integer, 7 / 2 is 3.5.
+      if (IS_INT(a) && IS_INT(b) && AS_INT(b) != 0 &&
+          !(AS_INT(a) == INT64_MIN && AS_INT(b) == -1) &&
+          AS_INT(a) % AS_INT(b) == 0) {
+        sp[-2] = INT_VAL(AS_INT(a) / AS_INT(b));
+      } else if (IS_NUMBER(a) && IS_NUMBER(b)) {
+        sp[-2] = NUMBER_VAL(AS_NUMBER(a) / AS_NUMBER(b));
+      } else if (IS_FLOAT64_ARRAY(a) || IS_FLOAT64_ARRAY(b)) {
+        FLOAT64_OP(F64_DIVIDE);
+      } else {
+        RUNTIME_ERROR("Operands must be numbers.");
+      }
+      sp--;
       break;
     }
     case OP_BITWISE_NOT: {
-      if (!IS_NUMBER(peek(vm, 0))) {
-        runtimeError(vm, "Cannot apply bitwise not on non numbers.");
-        return INTERPRET_RUNTIME_ERROR;
+      if (!IS_NUMBER(PEEK(0))) {
+        RUNTIME_ERROR("Cannot apply bitwise not on non numbers.");
       }
 
-      int64_t result = ~(int64_t)AS_NUMBER(peek(vm, 0));
-      vm->stackTop[-1].as.number = (double)result;
-
+      sp[-1] = INT_VAL(~toInteger(PEEK(0)));
       break;
     }
     case OP_BITWISE_SHIFT_RIGHT: {
-      BINARY_OP_BITWISE(>>);
+      SHIFT_OP(shiftRight);
       break;
     }
     case OP_BITWISE_SHIFT_LEFT: {
-      BINARY_OP_BITWISE(<<);
+      SHIFT_OP(shiftLeft);
       break;
     }
     case OP_BITWISE_AND: {
-      BINARY_OP_BITWISE(&);
+      BITWISE_OP(&, F64_BITWISE_AND);
       break;
     }
     case OP_BITWISE_OR: {
-      BINARY_OP_BITWISE(|);
+      BITWISE_OP(|, F64_BITWISE_OR);
       break;
     }
     case OP_BITWISE_XOR: {
-      BINARY_OP_BITWISE(^);
+      BITWISE_OP(^, F64_BITWISE_XOR);
       break;
     }
     case OP_RETURN: {
-      return INTERPRET_OK;
+      RETURN_TO_CALLER(NIL_VAL);
+      break;
+    }
+    case OP_RETURN_VALUE: {
+      Value result = POP();
+      RETURN_TO_CALLER(result);
+      break;
+    }
+    case OP_CALL: {
+      int argCount = instruction->operand;
+      SPILL();
+      if (!callValue(vm, PEEK(argCount), argCount))
+        return INTERPRET_RUNTIME_ERROR;
+      frame = &vm->frames[vm->frameCount - 1];
+      RELOAD();
+      break;
+    }
+      // return f(x): the compiler follows it with OP_RETURN_VALUE. A function
+      // takes the place of the current one in its frame, the callee and the
+      // arguments sliding down over the current call, so tail recursion runs
+      // in constant stack. Anything else is called like with OP_CALL, the
+      // OP_RETURN_VALUE returning its result.
+    case OP_TAIL_CALL: {
+      int argCount = instruction->operand;
+      Value callee = PEEK(argCount);
+      if (IS_BOUND_METHOD(callee)) {
+        sp[-argCount - 1] = AS_BOUND_METHOD(callee)->receiver;
+        callee = AS_BOUND_METHOD(callee)->method;
+      }
+
+      ObjFunction *function = NULL;
+      Value *upvalues = NULL;
+      if (IS_CLOSURE(callee)) {
+        function = AS_CLOSURE(callee)->function;
+        upvalues = AS_CLOSURE(callee)->upvalues;
+      } else if (IS_FUNCTION(callee)) {
+        function = AS_FUNCTION(callee);
+      }
+
+      if (function == NULL || function->isGenerator ||
+          function->arity != argCount) {
+        SPILL();
+        if (!callValue(vm, callee, argCount))
+          return INTERPRET_RUNTIME_ERROR;
+        frame = &vm->frames[vm->frameCount - 1];
+        RELOAD();
+        break;
+      }
+
+      if (vm->openUpvalues != NULL)
+        closeUpvalues(vm, slots);
+      memmove(slots - 1, sp - argCount - 1, sizeof(Value) * (argCount + 1));
+      sp = slots + argCount;
+      frame->function = function;
+      frame->upvalues = upvalues;
+      frame->chunk = &function->chunk;
+      ip = function->chunk.decoded.code;
+
+      int top = (int)(slots - vm->stack) + function->chunk.decoded.maxStack;
+      if (top > vm->stackCap) {
+        SPILL();
+        reserveStack(vm, top);
+        RELOAD();
+      }
+      break;
+    }
+      // Intrinsics, see native.c: the native function they stand for is pure,
+      // the call is skipped.
+    case OP_FLOOR: {
+      if (!IS_NUMBER(PEEK(0))) {
+        RUNTIME_ERROR("floor() argument must be a number.");
+      }
+      sp[-1] = floorValue(sp[-1]);
+      break;
+    }
+    case OP_LEN: {
+      if (IS_ARRAY(PEEK(0))) {
+        sp[-1] = INT_VAL(AS_ARRAY(sp[-1])->elements.count);
+      } else if (IS_STRING(PEEK(0))) {
+        sp[-1] = INT_VAL(AS_STRING(sp[-1])->length);
+      } else if (IS_MAP(PEEK(0))) {
+        sp[-1] = INT_VAL(AS_MAP(sp[-1])->count);
+      } else if (IS_FLOAT64_ARRAY(PEEK(0))) {
+        sp[-1] = INT_VAL(AS_FLOAT64_ARRAY(sp[-1])->count);
+      } else {
+        RUNTIME_ERROR("len() argument must be an array, a map or a string.");
+      }
+      break;
+    }
+    case OP_ARRAY_PUSH: {
+      if (!IS_ARRAY(PEEK(1))) {
+        RUNTIME_ERROR("push() argument must be an array.");
+      }
+      ValueArray *elements = &AS_ARRAY(sp[-2])->elements;
+      writeValueArray(elements, sp[-1]);
+      sp[-2] = INT_VAL(elements->count);
+      sp--;
+      break;
+    }
+    case OP_ARRAY_POP: {
+      if (!IS_ARRAY(PEEK(0))) {
+        RUNTIME_ERROR("pop() argument must be an array.");
+      }
+      ValueArray *elements = &AS_ARRAY(sp[-1])->elements;
+      if (elements->count == 0) {
+        RUNTIME_ERROR("Can't pop from an empty array.");
+      }
+      sp[-1] = elements->values[--elements->count];
+      break;
+    }
+    case OP_SQRT: {
+      if (!IS_NUMBER(PEEK(0))) {
+        RUNTIME_ERROR("sqrt() argument must be a number.");
+      }
+      sp[-1] = NUMBER_VAL(sqrt(AS_NUMBER(sp[-1])));
+      break;
+    }
+    case OP_ARRAY: {
+      int count = instruction->operand;
+      ObjArray *array = newArray(vm->memoryManager);
+      // The elements are already in order on the stack.
+      if (count > 0) {
+        array->elements.values = ALLOCATE(Value, count);
+        array->elements.cap = count;
+        array->elements.count = count;
+        memcpy(array->elements.values, sp - count, sizeof(Value) * count);
+      }
+      sp -= count;
+      PUSH(OBJ_VAL(array));
+      break;
+    }
+      // The index is the variable of a range loop bounded by the length of the
+      // array, that can't shrink in the loop: it's an integer and in range.
+      // A map bounding the loop takes the checked path.
+    case OP_INDEX_GET_UNCHECKED:
+      if (IS_ARRAY(sp[-2])) {
+        sp[-2] = AS_ARRAY(sp[-2])->elements.values[AS_INT(sp[-1])];
+        sp--;
+        break;
+      }
+      // fall through
+    case OP_INDEX_GET: {
+      if (IS_MAP(sp[-2])) {
+        // A missing key reads as nil.
+        Value value;
+        if (!tableGetValue(&AS_MAP(sp[-2])->table, sp[-1], &value))
+          value = NIL_VAL;
+        sp[-2] = value;
+        sp--;
+        break;
+      }
+      if (IS_FLOAT64_ARRAY(sp[-2])) {
+        ObjFloat64Array *array = AS_FLOAT64_ARRAY(sp[-2]);
+        int64_t index;
+        CHECK_BOUNDS(sp[-1], array->count, index);
+        sp[-2] = NUMBER_VAL(array->values[index]);
+        sp--;
+        break;
+      }
+      ValueArray *elements;
+      int64_t index;
+      CHECK_INDEX(sp[-2], sp[-1], elements, index);
+      sp[-2] = elements->values[index];
+      sp--;
+      break;
+    }
+    case OP_INDEX_SET_UNCHECKED:
+      if (IS_ARRAY(sp[-3])) {
+        AS_ARRAY(sp[-3])->elements.values[AS_INT(sp[-2])] = sp[-1];
+        sp[-3] = sp[-1];
+        sp -= 2;
+        break;
+      }
+      // fall through
+    case OP_INDEX_SET: {
+      if (IS_MAP(sp[-3])) {
+        if (IS_NIL(sp[-2])) {
+          RUNTIME_ERROR("Map key can't be nil.");
+        }
+        ObjMap *map = AS_MAP(sp[-3]);
+        if (tableSetValue(&map->table, sp[-2], sp[-1]))
+          map->count++;
+        sp[-3] = sp[-1];
+        sp -= 2;
+        break;
+      }
+      if (IS_FLOAT64_ARRAY(sp[-3])) {
+        ObjFloat64Array *array = AS_FLOAT64_ARRAY(sp[-3]);
+        int64_t index;
+        CHECK_BOUNDS(sp[-2], array->count, index);
+        if (!IS_NUMBER(sp[-1])) {
+          RUNTIME_ERROR("Float64Array elements must be numbers.");
+        }
+        array->values[index] = AS_NUMBER(sp[-1]);
+        sp[-3] = sp[-1];
+        sp -= 2;
+        break;
+      }
+      ValueArray *elements;
+      int64_t index;
+      CHECK_INDEX(sp[-3], sp[-2], elements, index);
+      elements->values[index] = sp[-1];
+      sp[-3] = sp[-1];
+      sp -= 2;
+      break;
+    }
+    case OP_MAP: {
+      int count = instruction->operand;
+      ObjMap *map = newMap(vm->memoryManager);
+      // The keys and values are in order on the stack, a repeated key keeps
+      // the last value.
+      for (Value *entry = sp - count; entry < sp; entry += 2) {
+        if (IS_NIL(entry[0])) {
+          RUNTIME_ERROR("Map key can't be nil.");
+        }
+        if (tableSetValue(&map->table, entry[0], entry[1]))
+          map->count++;
+      }
+      sp -= count;
+      PUSH(OBJ_VAL(map));
+      break;
+    }
+    case OP_MAP_HAS: {
+      if (!IS_MAP(PEEK(1))) {
+        RUNTIME_ERROR("has() argument must be a map.");
+      }
+      Value value;
+      sp[-2] = BOOL_VAL(tableGetValue(&AS_MAP(sp[-2])->table, sp[-1], &value));
+      sp--;
+      break;
+    }
+    case OP_MAP_DELETE: {
+      if (!IS_MAP(PEEK(1))) {
+        RUNTIME_ERROR("delete() argument must be a map.");
+      }
+      ObjMap *map = AS_MAP(sp[-2]);
+      bool deleted = tableDeleteValue(&map->table, sp[-1]);
+      if (deleted)
+        map->count--;
+      sp[-2] = BOOL_VAL(deleted);
+      sp--;
+      break;
+    }
+    case OP_CLOSURE: {
+      ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
+      ObjClosure *closure = newClosure(vm->memoryManager, function);
+      // Pushed first, so that a local function can capture itself.
+      PUSH(OBJ_VAL(closure));
+      for (int i = 0; i < function->upvalueCount; i++) {
+        Capture *capture = &function->captures[i];
+        switch (capture->kind) {
+        case CAPTURE_LOCAL:
+          closure->upvalues[i] =
+              OBJ_VAL(captureUpvalue(vm, slots + capture->index));
+          break;
+        case CAPTURE_LOCAL_VALUE:
+          closure->upvalues[i] = slots[capture->index];
+          break;
+        case CAPTURE_UPVALUE:
+          closure->upvalues[i] = frame->upvalues[capture->index];
+          break;
+        case CAPTURE_THIS:
+          closure->upvalues[i] = slots[-1];
+          break;
+        }
+      }
+      break;
+    }
+    case OP_CLASS: {
+      PUSH(OBJ_VAL(newClass(vm->memoryManager, READ_STRING())));
+      break;
+    }
+    case OP_INHERIT: {
+      if (!IS_CLASS(PEEK(1))) {
+        RUNTIME_ERROR("Superclass must be a class.");
+      }
+      ObjClass *superclass = AS_CLASS(PEEK(1));
+      ObjClass *subclass = AS_CLASS(PEEK(0));
+      tableAddAll(&superclass->methods, &subclass->methods);
+      subclass->initializer = superclass->initializer;
+      sp--;
+      break;
+    }
+    case OP_METHOD: {
+      ObjClass *klass = AS_CLASS(PEEK(1));
+      ObjString *name = READ_STRING();
+      tableSet(&klass->methods, name, PEEK(0));
+      if (name == vm->initString)
+        klass->initializer = PEEK(0);
+      sp--;
+      break;
+    }
+    case OP_GET_THIS: {
+      PUSH(slots[-1]);
+      break;
+    }
+      // Properties go through the inline cache of the instruction: a hit on
+      // the shape of the instance gives the field index (or the method), a
+      // miss looks it up and fills an entry.
+    case OP_GET_PROPERTY: {
+      if (!IS_INSTANCE(PEEK(0))) {
+        RUNTIME_ERROR("Only instances have properties.");
+      }
+      ObjInstance *instance = AS_INSTANCE(PEEK(0));
+      InlineCache *cache = READ_CACHE();
+      CacheEntry *entry = cacheLookup(cache, instance->shape);
+      if (entry == NULL) {
+        SPILL();
+        entry = cacheProperty(vm, cache, instance->shape, READ_STRING());
+        if (entry == NULL)
+          return INTERPRET_RUNTIME_ERROR;
+      }
+      if (entry->field != -1) {
+        sp[-1] = instance->fields[entry->field];
+      } else {
+        sp[-1] = OBJ_VAL(
+            newBoundMethod(vm->memoryManager, sp[-1], entry->method));
+      }
+      break;
+    }
+    case OP_SET_PROPERTY: {
+      if (!IS_INSTANCE(PEEK(1))) {
+        RUNTIME_ERROR("Only instances have fields.");
+      }
+      ObjInstance *instance = AS_INSTANCE(PEEK(1));
+      InlineCache *cache = READ_CACHE();
+      CacheEntry *entry = cacheLookup(cache, instance->shape);
+      if (entry == NULL)
+        entry = cacheField(vm, cache, instance->shape, READ_STRING());
+      // Adding the field: the class knows how many fields its instances get.
+      if (entry->transition != NULL) {
+        if (entry->field >= instance->fieldCap) {
+          int cap = entry->transition->klass->fieldCount;
+          instance->fields =
+              GROW_ARR(Value, instance->fields, instance->fieldCap, cap);
+          instance->fieldCap = cap;
+        }
+        instance->shape = entry->transition;
+      }
+      instance->fields[entry->field] = PEEK(0);
+      sp[-2] = sp[-1];
+      sp--;
+      break;
+    }
+      // The receiver is in the callee slot already, where methods expect it.
+    case OP_INVOKE: {
+      int argCount = instruction->argCount;
+      if (!IS_INSTANCE(PEEK(argCount))) {
+        RUNTIME_ERROR("Only instances have methods.");
+      }
+      ObjInstance *instance = AS_INSTANCE(PEEK(argCount));
+      InlineCache *cache = READ_CACHE();
+      CacheEntry *entry = cacheLookup(cache, instance->shape);
+      SPILL();
+      if (entry == NULL) {
+        entry = cacheProperty(vm, cache, instance->shape, READ_STRING());
+        if (entry == NULL)
+          return INTERPRET_RUNTIME_ERROR;
+      }
+      Value callee = entry->method;
+      // A field holding a function is called like any other value.
+      if (entry->field != -1) {
+        callee = instance->fields[entry->field];
+        sp[-argCount - 1] = callee;
+      }
+      if (!callValue(vm, callee, argCount))
+        return INTERPRET_RUNTIME_ERROR;
+      frame = &vm->frames[vm->frameCount - 1];
+      RELOAD();
+      break;
+    }
+    case OP_GET_SUPER: {
+      ObjClass *superclass = AS_CLASS(POP());
+      Value method;
+      if (!tableGet(&superclass->methods, READ_STRING(), &method)) {
+        RUNTIME_ERROR("Undefined property '%s'.", READ_STRING()->str);
+      }
+      sp[-1] = OBJ_VAL(newBoundMethod(vm->memoryManager, sp[-1], method));
+      break;
+    }
+      // Cached on the root shape of the superclass, that stands for it.
+    case OP_SUPER_INVOKE: {
+      int argCount = instruction->argCount;
+      ObjClass *superclass = AS_CLASS(POP());
+      InlineCache *cache = READ_CACHE();
+      CacheEntry *entry = cacheLookup(cache, superclass->shape);
+      if (entry == NULL) {
+        Value method;
+        if (!tableGet(&superclass->methods, READ_STRING(), &method)) {
+          RUNTIME_ERROR("Undefined property '%s'.", READ_STRING()->str);
+        }
+        entry = cacheFill(cache, superclass->shape, -1, NULL, method);
+      }
+      SPILL();
+      if (!callValue(vm, entry->method, argCount))
+        return INTERPRET_RUNTIME_ERROR;
+      frame = &vm->frames[vm->frameCount - 1];
+      RELOAD();
+      break;
+    }
+    case OP_CLOSE_UPVALUE: {
+      closeUpvalues(vm, sp - 1);
+      sp--;
+      break;
     }
     case OP_CONSTANT: {
       Value constant = READ_CONSTANT();
-      push(vm, constant);
+      PUSH(constant);
+      break;
+    }
+    case OP_PUSH_ZERO: {
+      PUSH(INT_VAL(0));
+      break;
+    }
+    case OP_PUSH_ONE: {
+      PUSH(INT_VAL(1));
       break;
     }
-    case OP_CONSTANT_LONG: {
-      Value constant = READ_CONSTANT_LONG();
-      push(vm, constant);
-      MOVE_BYTES(3);
+    case OP_PUSH_SMALLINT: {
+      PUSH(INT_VAL(instruction->operand));
       break;
     }
     case OP_NIL: {
-      push(vm, NIL_VAL);
+      PUSH(NIL_VAL);
       break;
     }
     case OP_TRUE: {
-      push(vm, BOOL_VAL(true));
+      PUSH(BOOL_VAL(true));
       break;
     }
     case OP_FALSE: {
-      push(vm, BOOL_VAL(false));
+      PUSH(BOOL_VAL(false));
       break;
     }
     case OP_NOT: {
-      vm->stackTop[-1] = BOOL_VAL(isFalsey(peek(vm, 0)));
+      sp[-1] = BOOL_VAL(isFalsey(PEEK(0)));
       break;
     }
     case OP_EQUAL: {
-      Value a = pop(vm);
-      Value b = pop(vm);
-      push(vm, BOOL_VAL(valuesEqual(a, b)));
+      Value a = POP();
+      Value b = POP();
+      PUSH(BOOL_VAL(valuesEqual(a, b)));
+      break;
+    }
+    case OP_NOT_EQUAL: {
+      Value a = POP();
+      Value b = POP();
+      PUSH(BOOL_VAL(!valuesEqual(a, b)));
       break;
     }
     case OP_GREATER: {
-      BINARY_OP(BOOL_VAL, >);
+      COMPARISON_OP(>, F64_GREATER);
       break;
     }
     case OP_LESS: {
-      BINARY_OP(BOOL_VAL, <);
+      COMPARISON_OP(<, F64_LESS);
       break;
     }
     case OP_LESS_EQUAL: {
-      BINARY_OP(BOOL_VAL, <=);
+      COMPARISON_OP(<=, F64_LESS_EQUAL);
       break;
     }
     case OP_GREATER_EQUAL: {
-      BINARY_OP(BOOL_VAL, >=);
+      COMPARISON_OP(>=, F64_GREATER_EQUAL);
       break;
     }
     case OP_PRINT: {
-      printValue(pop(vm), "", "\n");
+      printValue(POP(), "", "\n");
       break;
     }
     case OP_POP: {
-      pop(vm);
+      sp--;
+      break;
+    }
+    case OP_POP_JUMP_IF_FALSE: {
+      if (isFalsey(POP()))
+        ip += instruction->operand;
+      break;
+    }
+    case OP_POP_JUMP_IF_TRUE: {
+      if (!isFalsey(POP()))
+        ip += instruction->operand;
       break;
     }
     case OP_INCREMENT: {
-      if (!IS_NUMBER(peek(vm, 0))) {
-        runtimeError(vm, "INCREMENT Operation supported only on numbers.");
-        return INTERPRET_RUNTIME_ERROR;
+      Value a = PEEK(0);
+      if (IS_INT(a) && AS_INT(a) != INT64_MAX) {
+        sp[-1].as.integer++;
+      } else if (IS_NUMBER(a)) {
+        sp[-1] = NUMBER_VAL(AS_NUMBER(a) + 1);
+      } else {
+        RUNTIME_ERROR("INCREMENT Operation supported only on numbers.");
       }
-      vm->stackTop[-1].as.number = vm->stackTop[-1].as.number + 1;
       break;
     }
     case OP_DECREMENT: {
-      if (!IS_NUMBER(peek(vm, 0))) {
-        runtimeError(vm, "DECREMENT Operation supported only on numbers.");
-        return INTERPRET_RUNTIME_ERROR;
+      Value a = PEEK(0);
+      if (IS_INT(a) && AS_INT(a) != INT64_MIN) {
+        sp[-1].as.integer--;
+      } else if (IS_NUMBER(a)) {
+        sp[-1] = NUMBER_VAL(AS_NUMBER(a) - 1);
+      } else {
+        RUNTIME_ERROR("DECREMENT Operation supported only on numbers.");
       }
-      vm->stackTop[-1].as.number = vm->stackTop[-1].as.number - 1;
       break;
     }
-    case OP_DEFINE_GLOBAL:
-    case OP_DEFINE_GLOBAL_LONG: {
-      ObjString *name;
-      if (instruction == OP_DEFINE_GLOBAL_LONG) {
-        name = READ_STRING_LONG();
-        MOVE_BYTES(3);
-      } else {
-        name = READ_STRING();
-      }
+    case OP_DEFINE_GLOBAL: {
+      ObjString *name = READ_STRING();
 
       // nrk doesn't check for redefinition of global variables, it just
       // overwrites them. This is also useful in repl sessions.
-      tableSet(&vm->memoryManager->globals, name, peek(vm, 0));
-      pop(vm);
+      tableSet(&vm->memoryManager->globals, name, PEEK(0));
+      sp--;
       break;
     }
-    case OP_GET_GLOBAL:
-    case OP_GET_GLOBAL_LONG: {
-      ObjString *name;
-      if (instruction == OP_GET_GLOBAL_LONG) {
-        name = READ_STRING_LONG();
-        MOVE_BYTES(3);
-      } else {
-        name = READ_STRING();
-      }
+    case OP_GET_GLOBAL: {
+      ObjString *name = READ_STRING();
 
       Value value;
       if (!tableGet(&vm->memoryManager->globals, name, &value)) {
-        runtimeError(vm, "Undefined variable %s", name->str);
-        return INTERPRET_RUNTIME_ERROR;
+        RUNTIME_ERROR("Undefined variable %s", name->str);
       }
-      push(vm, value);
+      PUSH(value);
       break;
     }
-    case OP_SET_GLOBAL:
-    case OP_SET_GLOBAL_LONG: {
-      ObjString *name;
-      if (instruction == OP_SET_GLOBAL_LONG) {
-        name = READ_STRING_LONG();
-        MOVE_BYTES(3);
-      } else {
-        name = READ_STRING();
-      }
+    case OP_SET_GLOBAL: {
+      ObjString *name = READ_STRING();
 
       Value isConstVal;
       if (tableGet(&vm->memoryManager->constants, name, &isConstVal)) {
-        runtimeError(vm, "Cannot assign to constant variable '%s'", name->str);
-        return INTERPRET_RUNTIME_ERROR;
+        RUNTIME_ERROR("Cannot assign to constant variable '%s'", name->str);
       }
 
       // If it's a new entry, it means the variable doesn't exist, clean up and
       // return error.
-      if (tableSet(&vm->memoryManager->globals, name, peek(vm, 0))) {
+      if (tableSet(&vm->memoryManager->globals, name, PEEK(0))) {
         tableDelete(&vm->memoryManager->globals, name);
-        runtimeError(vm, "Undefined variable '%s'.", name->str);
-        return INTERPRET_RUNTIME_ERROR;
+        RUNTIME_ERROR("Undefined variable '%s'.", name->str);
       }
       break;
     }
       // It's not redundant to take from the stack and push it, but we only look
       // at the top of it during operations.
-    case OP_SET_LOCAL_LONG:
-    case OP_GET_LOCAL_LONG: {
-      runtimeError(vm, "OP_GET_LOCAL_LONG not implemented yet.");
-      return INTERPRET_RUNTIME_ERROR;
-    }
     case OP_GET_LOCAL: {
-      uint8_t slot = READ_BYTE();
-      push(vm, vm->stack[slot]);
+      PUSH(slots[instruction->operand]);
       break;
     }
       // It just set the variable, wherever it is in the stack, looking the top
@@ -391,38 +1384,268 @@ static InterpretResult run(VM *vm) {
       // `expression` so it must produce a value, so it must stay on the stack
       // for who needs to use this value.
     case OP_SET_LOCAL: {
-      uint8_t slot = READ_BYTE();
-      vm->stack[slot] = peek(vm, 0);
+      slots[instruction->operand] = PEEK(0);
+      break;
+    }
+      // Mutable captured variables are shared through an ObjUpvalue, that
+      // points to the stack slot while the local is alive.
+    case OP_GET_UPVALUE: {
+      PUSH(*AS_UPVALUE(frame->upvalues[instruction->operand])->location);
+      break;
+    }
+    case OP_SET_UPVALUE: {
+      *AS_UPVALUE(frame->upvalues[instruction->operand])->location = PEEK(0);
+      break;
+    }
+      // Captured constants are copied in the closure.
+    case OP_GET_CONST_UPVALUE: {
+      PUSH(frame->upvalues[instruction->operand]);
       break;
     }
     case OP_JUMP: {
-      u_int16_t offset = READ_SHORT();
-      vm->ip += offset;
+      ip += instruction->operand;
+      break;
+    }
+    case OP_JUMP_HASH: {
+      Value k;
+      if (tableGetValue(&AS_MAP(READ_CONSTANT())->table, POP(), &k)) {
+        Instruction *jump = ip + 1 + AS_INT(k);
+        ip = jump + 1 + jump->operand;
+      }
+      break;
+    }
+    case OP_JUMP_TABLE: {
+      // [min, case of min, case of min + 1, ...], -1 for no case.
+      ValueArray *table = &AS_ARRAY(READ_CONSTANT())->elements;
+      Value value = POP();
+      int64_t n;
+      if (IS_INT(value)) {
+        n = AS_INT(value);
+      } else if (IS_DOUBLE(value) && AS_NUMBER(value) >= INT64_MIN &&
+                 AS_NUMBER(value) < -(double)INT64_MIN &&
+                 AS_NUMBER(value) == (int64_t)AS_NUMBER(value)) {
+        n = (int64_t)AS_NUMBER(value);
+      } else {
+        break;
+      }
+      uint64_t index = (uint64_t)n - (uint64_t)AS_INT(table->values[0]);
+      if (index >= (uint64_t)table->count - 1)
+        break;
+      int64_t k = AS_INT(table->values[index + 1]);
+      if (k >= 0) {
+        Instruction *jump = ip + 1 + k;
+        ip = jump + 1 + jump->operand;
+      }
       break;
     }
     case OP_JUMP_IF_FALSE: {
-      u_int16_t offset = READ_SHORT();
-      if (isFalsey(peek(vm, 0)))
-        vm->ip += offset;
+      if (isFalsey(PEEK(0)))
+        ip += instruction->operand;
+      break;
+    }
+    case OP_JUMP_IF_NOT_GREATER: {
+      COMPARISON_JUMP(>);
+      break;
+    }
+    case OP_JUMP_IF_NOT_GREATER_EQUAL: {
+      COMPARISON_JUMP(>=);
+      break;
+    }
+    case OP_JUMP_IF_NOT_LESS: {
+      COMPARISON_JUMP(<);
+      break;
+    }
+    case OP_JUMP_IF_NOT_LESS_EQUAL: {
+      COMPARISON_JUMP(<=);
+      break;
+    }
+    case OP_JUMP_IF_TRUE: {
+      if (!isFalsey(PEEK(0)))
+        ip += instruction->operand;
+      break;
+    }
+    case OP_LOOP: {
+      ip += instruction->operand;
+      break;
+    }
+      // Range loops keep 4 locals: [counter, limit, step, variable].
+      // OP_FOR_RANGE_INIT checks them once and skips the loop if it's empty,
+      // then at the end of each iteration OP_FOR_RANGE steps the counter,
+      // copies it to the loop variable and jumps back to the body, all in one
+      // dispatch. The counter stays an integer if bounds and step are.
+    case OP_FOR_RANGE_INIT: {
+      Value *range = slots + instruction->slot;
+      if (!IS_NUMBER(range[0]) || !IS_NUMBER(range[1]) ||
+          !IS_NUMBER(range[2])) {
+        RUNTIME_ERROR("Range bounds and step must be numbers.");
+      }
+
+      if (!IS_INT(range[0]) || !IS_INT(range[1]) || !IS_INT(range[2])) {
+        for (int i = 0; i < 3; i++) {
+          range[i] = NUMBER_VAL(AS_NUMBER(range[i]));
+        }
+      }
+
+      bool inRange;
+      if (IS_INT(range[0])) {
+        int64_t step = AS_INT(range[2]);
+        if (step == 0) {
+          RUNTIME_ERROR("Range step cannot be 0.");
+        }
+        inRange = step > 0 ? AS_INT(range[0]) < AS_INT(range[1])
+                           : AS_INT(range[0]) > AS_INT(range[1]);
+      } else {
+        double step = AS_NUMBER(range[2]);
+        if (step == 0) {
+          RUNTIME_ERROR("Range step cannot be 0.");
+        }
+        inRange = step > 0 ? AS_NUMBER(range[0]) < AS_NUMBER(range[1])
+                           : AS_NUMBER(range[0]) > AS_NUMBER(range[1]);
+      }
+
+      if (inRange) {
+        range[3] = range[0];
+      } else {
+        ip += instruction->operand;
+      }
+      break;
+    }
+    case OP_FOR_RANGE: {
+      Value *range = slots + instruction->slot;
+      if (IS_INT(range[0])) {
+        int64_t step = AS_INT(range[2]);
+        int64_t next;
+        // On overflow the counter is past any limit.
+        if (!__builtin_add_overflow(AS_INT(range[0]), step, &next) &&
+            (step > 0 ? next < AS_INT(range[1]) : next > AS_INT(range[1]))) {
+          range[0] = range[3] = INT_VAL(next);
+          ip += instruction->operand;
+        }
+      } else {
+        double step = AS_NUMBER(range[2]);
+        double next = AS_NUMBER(range[0]) + step;
+        double limit = AS_NUMBER(range[1]);
+        if (step > 0 ? next < limit : next > limit) {
+          range[0] = range[3] = NUMBER_VAL(next);
+          ip += instruction->operand;
+        }
+      }
+      break;
+    }
+      // Other loops keep 3 locals: [iterable, index, variable]. Over an
+      // array, each iteration copies the element at the index (the array can
+      // change in the body). Over a generator, each iteration resumes it on its
+      // own stacks, and goes on with the body once it yields (OP_YIELD puts
+      // the value in the variable), or exits the loop once it returned (see
+      // RETURN_TO_CALLER()).
+    case OP_FOR_EACH: {
+      Value *each = slots + instruction->slot;
+      if (IS_ARRAY(each[0])) {
+        ValueArray *elements = &AS_ARRAY(each[0])->elements;
+        int64_t index = AS_INT(each[1]);
+        if (index >= elements->count) {
+          ip += instruction->operand;
+        } else {
+          each[2] = elements->values[index];
+          each[1] = INT_VAL(index + 1);
+        }
+        break;
+      }
+      if (!IS_COROUTINE(each[0])) {
+        RUNTIME_ERROR("Can only loop over ranges, arrays and generators.");
+      }
+
+      ObjCoroutine *coroutine = AS_COROUTINE(each[0]);
+      if (coroutine->state == COROUTINE_DONE) {
+        ip += instruction->operand;
+        break;
+      }
+      if (coroutine->state == COROUTINE_RUNNING) {
+        RUNTIME_ERROR("Generator is already running.");
+      }
+
+      SPILL();
+      resumeCoroutine(vm, coroutine);
+      frame = &vm->frames[vm->frameCount - 1];
+      RELOAD();
+      break;
+    }
+    case OP_YIELD: {
+      Value value = POP();
+      SPILL();
+      suspendCoroutine(vm, COROUTINE_SUSPENDED);
+      frame = &vm->frames[vm->frameCount - 1];
+      RELOAD();
+      // Back right after the OP_FOR_EACH that resumed it.
+      slots[ip[-1].slot + 2] = value;
       break;
     }
     }
   }
 
-#undef READ_BYTE
-#undef READ_SHORT
-#undef MOVE_BYTES
+#undef SPILL
+#undef RELOAD
+#undef RUNTIME_ERROR
+#undef PUSH
+#undef POP
+#undef PEEK
+#undef READ_INSTRUCTION
 #undef READ_CONSTANT
-#undef READ_CONSTANT_LONG
 #undef READ_STRING
-#undef READ_STRING_LONG
-#undef BINARY_OP
-#undef BINARY_OP_BITWISE
+#undef READ_CACHE
+#undef RETURN_TO_CALLER
+#undef CHECK_BOUNDS
+#undef CHECK_INDEX
+#undef ARITHMETIC_OP
+#undef COMPARISON_OP
+#undef FLOAT64_OP
+#undef COMPARISON_JUMP
+#undef BITWISE_OP
+#undef SHIFT_OP
+}
+
+// Decodes and verifies the chunk, and the chunks of the functions in its
+// constants, so that calls don't have to check them.
+//
+// The decoded chunk is kept until the chunk is written again, so running it
+// again doesn't decode it twice.
+static bool prepareChunk(Chunk *chunk, int arity, int upvalueCount) {
+  if (chunk->decoded.verified)
+    return true;
+
+  for (int i = 0; i < chunk->constants.count; i++) {
+    Value constant = chunk->constants.values[i];
+    if (IS_FUNCTION(constant) &&
+        !prepareChunk(&AS_FUNCTION(constant)->chunk,
+                      AS_FUNCTION(constant)->arity,
+                      AS_FUNCTION(constant)->upvalueCount))
+      return false;
+  }
+
+  if (!decodeChunk(chunk)) {
+    fprintf(stderr, "Malformed bytecode.\n");
+    return false;
+  }
+
+  return verifyChunk(chunk, arity, upvalueCount);
 }
 
 InterpretResult interpretChunk(VM *vm, Chunk *chunk) {
-  vm->chunk = chunk;
-  vm->ip = vm->chunk->code;
+  if (!prepareChunk(chunk, 0, 0))
+    return INTERPRET_COMPILE_ERROR;
+
+  // Every chunk starts with an empty stack, big enough for all it pushes. Like
+  // a function, the script has a callee slot below its locals.
+  resetStack(vm);
+  reserveStack(vm, chunk->decoded.maxStack + 1);
+  *vm->stackTop++ = NIL_VAL;
+
+  CallFrame *frame = &vm->frames[vm->frameCount++];
+  frame->function = NULL;
+  frame->upvalues = NULL;
+  frame->chunk = chunk;
+  frame->ip = chunk->decoded.code;
+  frame->slots = vm->stackTop;
 
   return run(vm);
 }
@@ -438,10 +1661,7 @@ InterpretResult interpret(VM *vm, const char *source) {
     return INTERPRET_COMPILE_ERROR;
   }
 
-  vm->chunk = &chunk;
-  vm->ip = vm->chunk->code;
-
-  InterpretResult res = run(vm);
+  InterpretResult res = interpretChunk(vm, &chunk);
 
   freeChunk(&chunk);
   return res;
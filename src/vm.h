@@ -4,17 +4,18 @@
 #include "chunk.h"
 #include "compiler.h"
 #include "memory.h"
+#include "object.h"
 #include "table.h"
 #include "value.h"
 
-typedef struct {
-  // Chunk to be executed
-  Chunk *chunk;
+// Maximum depth of nested calls.
+#define FRAMES_MAX 1024
 
-  // Instruction Pointer about to be executed (first byte of chunk.code)
-  // It is a real pointer as it's easier and faster to use memory directly
-  // Note: it is called PC (Program Counter in some arch like ARM)
-  uint8_t *ip;
+typedef struct VM {
+  // Call frames of the running code, grown up to FRAMES_MAX.
+  CallFrame *frames;
+  int frameCount;
+  int frameCap;
 
   // Dynamically growing stack
   int stackCap;
@@ -23,6 +24,19 @@ typedef struct {
   // Pointer to the first empty item (allowed in C) i.e. the next one to fill
   Value *stackTop;
 
+  // Upvalues still pointing to the stack, the topmost slot first.
+  ObjUpvalue *openUpvalues;
+
+  // Generator running, NULL for the script. The stacks above are its own,
+  // it holds the ones of its resumer (see ObjCoroutine).
+  ObjCoroutine *coroutine;
+
+  // "init", the name of initializers, see OP_METHOD.
+  ObjString *initString;
+
+  // Set by nativeError(), checked after calling a native function.
+  bool hadNativeError;
+
   // VM's compiler instance
   Compiler *compiler;
 
@@ -44,4 +58,12 @@ void resetStack(VM *vm);
 void push(VM *vm, Value value);
 Value pop(VM *vm);
 
+// Makes the C function available to scripts as a global constant. It's called
+// with the arguments in place on the stack (args[0] is the first one) and must
+// not push anything. arity is checked by the VM, -1 accepts any number.
+void defineNative(VM *vm, const char *name, NativeFn function, int arity);
+// Reports a runtime error from a native function, that must return right
+// after (the returned nil is discarded).
+Value nativeError(VM *vm, const char *format, ...);
+
 #endif